@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../protocol.h"
+
+/*
+ * loadgen: drives the server over loopback with concurrent sessions, each
+ * a thread with its own connection running a mix of commands back to
+ * back, and prints one JSON object with the throughput and the latency
+ * percentiles of the run. It speaks the wire protocol itself, so the
+ * time of each command is measured from its request to the last byte of
+ * its answer, without the client's prompt or disk in the way.
+ *
+ *   usage: loadgen [-p port] [-c clients] [-s size] [-t seconds] [-n ops]
+ *                  [-m mix] [-f file]
+ *
+ * mix is a comma separated list of ls, get, put and mkdir, each with an
+ * optional :weight, e.g. get:8,put:2,ls:1. get reads file, which has to
+ * be there already; put writes put<client> of the given size, and mkdir
+ * makes m<pid>.<client>.<n>. A session stops after -n commands or -t
+ * seconds, whichever comes first, but always finishes the command it is
+ * in.
+ */
+
+enum { CMD_LS, CMD_GET, CMD_PUT, CMD_MKDIR, CMDS };
+
+static const char *cmdNames[CMDS] = { "ls", "get", "put", "mkdir" };
+
+struct session
+{
+    pthread_t   thread;
+    int         id;
+    int         fd;
+    uint32_t    requestId;
+    unsigned    seed;
+    double     *latency;        /* seconds per command, in the order run */
+    long        ops;
+    long        room;
+    long        errors;
+    long        files;          /* gets and puts that completed */
+    long long   bytes;          /* file bytes moved */
+    long        mkdirs;
+};
+
+static int port = 6666;
+static int clients = 1;
+static long long size = 1024;
+static double seconds = 5;
+static long maxOps;
+static const char *file = "data";
+static int weights[CMDS];
+static int totalWeight;
+static double deadline;
+static unsigned char *payload;  /* what puts send, FRAME_MAX_DATA bytes */
+
+/*         Name: now
+ *  Description: reads the monotonic clock
+ *   Parameters: none
+ *       Return: double seconds
+ */
+static double now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*         Name: parseSize
+ *  Description: reads a byte count with an optional K, M or G suffix
+ *   Parameters: text
+ *       Return: long long bytes, or -1 if it isn't one
+ */
+static long long parseSize(const char *text){
+    char *end;
+    long long n = strtoll(text, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': n <<= 10;   /* fall through */
+    case 'M': case 'm': n <<= 10;   /* fall through */
+    case 'K': case 'k': n <<= 10; end++; break;
+    }
+    return (end == text || *end != '\0' || n < 0) ? -1 : n;
+}
+
+/*         Name: parseMix
+ *  Description: fills in the weight of every command of a mix
+ *   Parameters: text
+ *       Return: int, 0 on success, -1 if the mix names an unknown command
+ */
+static int parseMix(const char *text){
+    char buf[256], *item, *colon, *save;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", text);
+    memset(weights, 0, sizeof(weights));
+    totalWeight = 0;
+    for (item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if ((colon = strchr(item, ':')) != NULL)
+            *colon++ = '\0';
+        for (i = 0; i < CMDS && strcmp(item, cmdNames[i]) != 0; i++)
+            ;
+        if (i == CMDS)
+            return -1;
+        weights[i] += colon ? atoi(colon) : 1;
+        totalWeight += colon ? atoi(colon) : 1;
+    }
+    return totalWeight > 0 ? 0 : -1;
+}
+
+/*         Name: sendAll
+ *  Description: writes a whole buffer to the socket
+ *   Parameters: socket, buffer, length
+ *       Return: int, 0 on success, -1 on error
+ */
+static int sendAll(int fd, const void *buf, size_t len){
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*         Name: recvAll
+ *  Description: reads exactly len bytes from the socket
+ *   Parameters: socket, buffer, length
+ *       Return: int, 0 on success, -1 on error or end of stream
+ */
+static int recvAll(int fd, void *buf, size_t len){
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = recv(fd, p, len, 0)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*         Name: request
+ *  Description: sends a request frame with its payload
+ *   Parameters: struct session*, opcode, payload prefix and its length,
+ *               path
+ *       Return: int, 0 on success, -1 on error
+ */
+static int request(struct session *s, uint8_t op, const void *prefix, size_t prefixLen, const char *path){
+    unsigned char buf[FRAME_HEADER_SIZE + 8 + FRAME_MAX_CONTROL];
+    size_t pathLen = path ? strlen(path) : 0;
+
+    if (prefixLen + pathLen > FRAME_MAX_CONTROL)
+        return -1;
+    frameBuild(buf, op, 0, ++s->requestId, prefixLen + pathLen);
+    memcpy(buf + FRAME_HEADER_SIZE, prefix, prefixLen);
+    memcpy(buf + FRAME_HEADER_SIZE + prefixLen, path, pathLen);
+    return sendAll(s->fd, buf, FRAME_HEADER_SIZE + prefixLen + pathLen);
+}
+
+/*         Name: readFrame
+ *  Description: reads a frame header and its payload, which has to fit
+ *               the buffer
+ *   Parameters: struct session*, struct frame*, buffer and its size
+ *       Return: int, 0 on success, -1 on error
+ */
+static int readFrame(struct session *s, struct frame *f, unsigned char *buf, size_t room){
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    if (recvAll(s->fd, header, FRAME_HEADER_SIZE) < 0)
+        return -1;
+    frameDecode(header, f);
+    if (f->version != FRAME_VERSION || f->length > room)
+        return -1;
+    return recvAll(s->fd, buf, f->length);
+}
+
+/*         Name: discard
+ *  Description: reads and drops len payload bytes
+ *   Parameters: struct session*, length
+ *       Return: int, 0 on success, -1 on error
+ */
+static int discard(struct session *s, uint64_t len){
+    static __thread unsigned char sink[256 * 1024];
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(s->fd, sink, len < sizeof(sink) ? len : sizeof(sink), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*         Name: runLs
+ *  Description: lists the session's directory and reads every entry
+ *   Parameters: struct session*
+ *       Return: int, 1 if the server said OK, 0 if it refused, -1 on error
+ */
+static int runLs(struct session *s){
+    unsigned char buf[FRAME_MAX_CONTROL];
+    struct frame f;
+
+    if (request(s, OP_LS, NULL, 0, NULL) < 0)
+        return -1;
+    while (1) {
+        if (recvAll(s->fd, buf, FRAME_HEADER_SIZE) < 0)
+            return -1;
+        frameDecode(buf, &f);
+        if (f.opcode != OP_DATA)
+            break;
+        if (discard(s, f.length) < 0)
+            return -1;
+    }
+    if (f.length > sizeof(buf) || recvAll(s->fd, buf, f.length) < 0)
+        return -1;
+    return f.opcode == OP_OK;
+}
+
+/*         Name: runGet
+ *  Description: gets the benchmark file and reads it to the end
+ *   Parameters: struct session*
+ *       Return: int, 1 once it all arrived, 0 if refused, -1 on error
+ */
+static int runGet(struct session *s){
+    unsigned char buf[FRAME_MAX_CONTROL];
+    struct frame f;
+    uint64_t left;
+
+    if (request(s, OP_GET, NULL, 0, file) < 0 || readFrame(s, &f, buf, sizeof(buf)) < 0)
+        return -1;
+    if (f.opcode != OP_FILE_INFO)
+        return 0;
+    for (left = getU64(buf); left > 0; left -= f.length) {
+        if (recvAll(s->fd, buf, FRAME_HEADER_SIZE) < 0)
+            return -1;
+        frameDecode(buf, &f);
+        if (f.opcode != OP_DATA || f.length > left || discard(s, f.length) < 0)
+            return -1;
+        s->bytes += f.length;
+    }
+    s->files++;
+    return 1;
+}
+
+/*         Name: runPut
+ *  Description: puts size bytes as put<client> and waits for the OK
+ *   Parameters: struct session*
+ *       Return: int, 1 if stored, 0 if refused, -1 on error
+ */
+static int runPut(struct session *s){
+    unsigned char buf[FRAME_MAX_CONTROL], header[FRAME_HEADER_SIZE], info[8];
+    char path[32];
+    struct frame f;
+    long long left;
+    size_t n;
+
+    snprintf(path, sizeof(path), "put%d", s->id);
+    putU64(info, size);
+    if (request(s, OP_PUT, info, 8, path) < 0)
+        return -1;
+    for (left = size; left > 0; left -= n) {
+        n = left < FRAME_MAX_DATA ? left : FRAME_MAX_DATA;
+        frameBuild(header, OP_DATA, 0, s->requestId, n);
+        if (sendAll(s->fd, header, FRAME_HEADER_SIZE) < 0 || sendAll(s->fd, payload, n) < 0)
+            return -1;
+    }
+    if (readFrame(s, &f, buf, sizeof(buf)) < 0)
+        return -1;
+    if (f.opcode != OP_OK)
+        return 0;
+    s->bytes += size;
+    s->files++;
+    return 1;
+}
+
+/*         Name: runMkdir
+ *  Description: makes a directory no other command has made
+ *   Parameters: struct session*
+ *       Return: int, 1 if made, 0 if refused, -1 on error
+ */
+static int runMkdir(struct session *s){
+    unsigned char buf[FRAME_MAX_CONTROL];
+    char path[48];
+    struct frame f;
+
+    snprintf(path, sizeof(path), "m%d.%d.%ld", (int)getpid(), s->id, s->mkdirs++);
+    if (request(s, OP_MKDIR, NULL, 0, path) < 0 || readFrame(s, &f, buf, sizeof(buf)) < 0)
+        return -1;
+    return f.opcode == OP_OK;
+}
+
+/*         Name: pickCommand
+ *  Description: draws the next command of the mix by its weight
+ *   Parameters: struct session*
+ *       Return: int command
+ */
+static int pickCommand(struct session *s){
+    int r = rand_r(&s->seed) % totalWeight, i;
+
+    for (i = 0; r >= weights[i]; i++)
+        r -= weights[i];
+    return i;
+}
+
+/*         Name: runSession
+ *  Description: one client: connects and runs the mix until it is done
+ *   Parameters: struct session*
+ *       Return: void*, NULL
+ */
+static void *runSession(void *arg){
+    static int (*const run[CMDS])(struct session*) = { runLs, runGet, runPut, runMkdir };
+    struct session *s = arg;
+    struct sockaddr_in addr;
+    double start;
+    int one = 1, rv;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((s->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(s->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        s->errors++;
+        return NULL;
+    }
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while ((maxOps == 0 || s->ops < maxOps) && (s->ops == 0 || now() < deadline)) {
+        start = now();
+        rv = run[pickCommand(s)](s);
+        if (rv < 0) {
+            s->errors++;
+            break;
+        }
+        if (rv == 0) {
+            s->errors++;
+            continue;
+        }
+        if (s->ops == s->room) {
+            s->room = s->room ? 2 * s->room : 1024;
+            if ((s->latency = realloc(s->latency, s->room * sizeof(double))) == NULL)
+                break;
+        }
+        s->latency[s->ops++] = now() - start;
+    }
+    close(s->fd);
+    return NULL;
+}
+
+/*         Name: compareDouble
+ *  Description: orders latencies for qsort
+ *   Parameters: two doubles
+ *       Return: int
+ */
+static int compareDouble(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*         Name: percentile
+ *  Description: picks the latency below which p of the sorted ones fall
+ *   Parameters: sorted latencies, count, fraction p
+ *       Return: double seconds, 0 without any
+ */
+static double percentile(const double *sorted, long n, double p){
+    long i = (long)(p * n);
+
+    if (n == 0)
+        return 0;
+    return sorted[i < n ? i : n - 1];
+}
+
+int main(int argc, char *argv[]){
+    struct session *sessions;
+    double start, elapsed, *all;
+    long ops = 0, errors = 0, files = 0, n;
+    long long bytes = 0;
+    int opt, i;
+
+    parseMix("get");
+    while ((opt = getopt(argc, argv, "p:c:s:t:n:m:f:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 's': size = parseSize(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'n': maxOps = atol(optarg); break;
+        case 'f': file = optarg; break;
+        case 'm':
+            if (parseMix(optarg) < 0) {
+                fprintf(stderr, "loadgen: bad mix %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: loadgen [-p port] [-c clients] [-s size] [-t seconds] [-n ops] "
+                            "[-m mix] [-f file]\n");
+            return 1;
+        }
+    }
+    if (clients < 1 || size < 0) {
+        fprintf(stderr, "loadgen: bad client count or size\n");
+        return 1;
+    }
+    if ((payload = malloc(FRAME_MAX_DATA)) == NULL ||
+        (sessions = calloc(clients, sizeof(*sessions))) == NULL)
+        return 1;
+    for (n = 0; n < FRAME_MAX_DATA; n++)
+        payload[n] = rand();
+
+    start = now();
+    deadline = start + seconds;
+    for (i = 0; i < clients; i++) {
+        sessions[i].id = i;
+        sessions[i].seed = i + 1;
+        pthread_create(&sessions[i].thread, NULL, runSession, &sessions[i]);
+    }
+    for (i = 0; i < clients; i++)
+        pthread_join(sessions[i].thread, NULL);
+    elapsed = now() - start;
+
+    for (i = 0; i < clients; i++) {
+        ops += sessions[i].ops;
+        errors += sessions[i].errors;
+        files += sessions[i].files;
+        bytes += sessions[i].bytes;
+    }
+    if ((all = malloc((ops ? ops : 1) * sizeof(double))) == NULL)
+        return 1;
+    for (i = 0, n = 0; i < clients; i++) {
+        memcpy(all + n, sessions[i].latency, sessions[i].ops * sizeof(double));
+        n += sessions[i].ops;
+    }
+    qsort(all, ops, sizeof(double), compareDouble);
+
+    printf("{\"ops\": %ld, \"errors\": %ld, \"files\": %ld, \"bytes\": %lld, \"seconds\": %.3f, "
+           "\"ops_per_s\": %.1f, \"files_per_s\": %.1f, \"mb_per_s\": %.2f, "
+           "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}\n",
+           ops, errors, files, bytes, elapsed, ops / elapsed, files / elapsed, bytes / elapsed / 1e6,
+           percentile(all, ops, 0.50) * 1e3, percentile(all, ops, 0.99) * 1e3,
+           ops ? all[ops - 1] * 1e3 : 0.0);
+    return errors > 0 && ops == 0;
+}
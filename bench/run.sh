@@ -0,0 +1,130 @@
+#!/bin/sh
+#
+# The benchmark matrix: starts a fresh server for every cell and drives it
+# over loopback with bench/loadgen, for each file size, number of
+# concurrent clients and command mix. Each cell comes out as one JSON
+# object on its own line, with loadgen's throughput and latency plus the
+# server's CPU time per GB moved and its peak RSS. Given a baseline from
+# an earlier run, the cells both have are compared side by side.
+#
+#   usage: bench/run.sh [output.json] [baseline.json]
+#
+# The matrix is set through the environment:
+#
+#   SIZES    file sizes of get and put        1K 64K 1M 64M 1G (8G works too)
+#   CLIENTS  concurrent sessions              1 4 16
+#   MIXES    loadgen mixes; ls and mkdir      get put ls mkdir get:8,put:2,ls:1,mkdir:1
+#            alone don't depend on the size
+#   TIME     seconds per cell                 3
+#   SERVER_OPTS  extra server options, e.g. --io uring
+#
+# Set TMPDIR to a tmpfs to take the disk out of it.
+#
+set -e
+
+SIZES=${SIZES:-"1K 64K 1M 64M 1G"}
+CLIENTS=${CLIENTS:-"1 4 16"}
+MIXES=${MIXES:-"get put ls mkdir get:8,put:2,ls:1,mkdir:1"}
+TIME=${TIME:-3}
+OUT=${1:-/dev/stdout}
+BASELINE=$2
+PORT=6666
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+gcc -O2 "$REPO/server.c" "$REPO/protocol.c" "$REPO/checksum.c" "$REPO/compress.c" "$REPO/uring.c" \
+    -o "$WORK/server" -pthread -lz
+gcc -O2 "$REPO/bench/loadgen.c" "$REPO/protocol.c" -o "$WORK/loadgen" -pthread
+mkdir "$WORK/files"
+TICK=$(getconf CLK_TCK)
+
+# bytes <size>: a size with K, M or G suffix in bytes
+bytes() {
+    echo "$1" | awk '{ n = $1 + 0; u = substr($1, length($1));
+                       if (u == "K") n *= 1024; if (u == "M") n *= 1048576; if (u == "G") n *= 1073741824;
+                       printf "%.0f", n }'
+}
+
+# cell <size> <clients> <mix> <name>: prints the JSON line of one cell
+cell() {
+    rm -rf "$WORK/srv"
+    mkdir "$WORK/srv"
+    if [ ! -f "$WORK/files/$1" ]; then
+        head -c "$(bytes "$1")" /dev/urandom > "$WORK/files/$1"
+    fi
+    ln "$WORK/files/$1" "$WORK/srv/data"
+
+    # a listing worth reading
+    i=0
+    while [ $i -lt 100 ]; do
+        : > "$WORK/srv/f$i"
+        i=$((i + 1))
+    done
+
+    "$WORK/server" --workers 1 --root "$WORK/srv" $SERVER_OPTS > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.3
+    result=$("$WORK/loadgen" -p $PORT -c "$2" -s "$1" -t "$TIME" -m "$3")
+    cpu=$(awk -v t="$TICK" '{ printf "%.3f", ($14 + $15) / t }' /proc/$SERVER/stat)
+    rss=$(awk '/^VmHWM/ { print $2 }' /proc/$SERVER/status)
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+
+    echo "$result" | awk -v name="$4" -v mix="$3" -v size="$(bytes "$1")" -v c="$2" \
+                         -v cpu="$cpu" -v rss="$rss" '{
+        match($0, /"bytes": [0-9]+/);
+        moved = substr($0, RSTART + 9, RLENGTH - 9);
+        sub(/^\{/, "");
+        sub(/\}$/, "");
+        printf "{\"name\": \"%s\", \"mix\": \"%s\", \"size\": %s, \"clients\": %s, %s, ", name, mix, size, c, $0;
+        printf "\"server_cpu_s\": %s, \"cpu_s_per_gb\": %s, \"peak_rss_kb\": %s}\n",
+               cpu, (moved > 0 ? sprintf("%.3f", cpu / (moved / 1e9)) : "null"), rss
+    }'
+}
+
+{
+    echo "["
+    first=1
+    for mix in $MIXES; do
+        case $mix in
+        ls|mkdir) sizes=0 ;;
+        *) sizes=$SIZES ;;
+        esac
+        for size in $sizes; do
+            for c in $CLIENTS; do
+                name=$mix/$size/c$c
+                [ "$size" = 0 ] && name=$mix/c$c
+                echo "$name" >&2
+                line=$(cell "$size" "$c" "$mix" "$name")
+                [ $first -eq 1 ] || echo ","
+                printf "  %s" "$line"
+                first=0
+            done
+        done
+    done
+    printf "\n]\n"
+} > "$WORK/result.json"
+cat "$WORK/result.json" > "$OUT"
+
+# each cell against the baseline's cell of the same name
+if [ -n "$BASELINE" ]; then
+    printf "%-36s %12s %12s %8s %10s %10s\n" cell "ops/s before" "ops/s now" change "p99 before" "p99 now" >&2
+    awk 'function field(line, key) {
+             if (!match(line, "\"" key "\": [^,}]+"))
+                 return "";
+             return substr(line, RSTART + length(key) + 4, RLENGTH - length(key) - 4)
+         }
+         /"name"/ {
+             name = field($0, "name");
+             gsub(/"/, "", name);
+             rate = field($0, "ops_per_s") + 0;
+             if (FILENAME == ARGV[1]) {
+                 before[name] = rate;
+                 p99[name] = field($0, "p99_ms");
+             } else if (name in before) {
+                 printf "%-36s %12.1f %12.1f %+7.1f%% %10.3f %10.3f\n", name, before[name], rate,
+                        (before[name] > 0 ? (rate / before[name] - 1) * 100 : 0), p99[name], field($0, "p99_ms")
+             }
+         }' "$BASELINE" "$WORK/result.json" >&2
+fi
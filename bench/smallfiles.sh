@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Measures files per second for tree gets and puts of many small files on
+# loopback, each file sent by itself (--no-batch) and batched many to a
+# BATCH frame, for 1 KB, 4 KB and 64 KB files. Files are spread over
+# directories of 100. Set TMPDIR to a tmpfs to take the disk out of it.
+#
+#   usage: bench/smallfiles.sh [files per size] [runs, best taken]
+#
+set -e
+
+FILES=${1:-10000}
+ROUNDS=${2:-3}
+PORT=6666
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+gcc -O2 "$REPO/server.c" "$REPO/protocol.c" "$REPO/checksum.c" "$REPO/compress.c" "$REPO/uring.c" \
+    -o "$WORK/server" -pthread -lz
+gcc -O2 "$REPO/client.c" "$REPO/protocol.c" "$REPO/checksum.c" "$REPO/compress.c" \
+    -o "$WORK/client" -pthread -lz 2>/dev/null
+
+mkdir "$WORK/srv" "$WORK/cli"
+"$WORK/server" --workers 1 --root "$WORK/srv" > /dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+# tree <KB>: makes $WORK/cli/t<KB> with FILES files of that size
+tree() {
+    dir="$WORK/cli/t$1"
+    head -c $(($1 * 1024)) /dev/urandom > "$WORK/one"
+    i=0
+    while [ $i -lt "$FILES" ]; do
+        [ $((i % 100)) -eq 0 ] && mkdir -p "$dir/d$((i / 100))"
+        cp "$WORK/one" "$dir/d$((i / 100))/f$i"
+        i=$((i + 1))
+    done
+}
+
+# run <get|put> <KB> <client options>: prints the best files/s of ROUNDS runs
+run() {
+    best=0
+    r=0
+    while [ $r -lt "$ROUNDS" ]; do
+        rm -rf "$WORK/srv/t$2" "$WORK/get"
+        mkdir "$WORK/get"
+        if [ "$1" = get ]; then
+            cp -r "$WORK/cli/t$2" "$WORK/srv/"
+            rate=$(cd "$WORK/get" && printf 'get -r t%s\nquit\n' "$2" |
+                   "$WORK/client" $3 127.0.0.1 $PORT | awk '/get -r:/ { print $(NF - 3) }')
+        else
+            rate=$(cd "$WORK/cli" && printf 'put -r t%s\nquit\n' "$2" |
+                   "$WORK/client" $3 127.0.0.1 $PORT | awk '/put -r:/ { print $(NF - 3) }')
+        fi
+        best=$(echo "$best $rate" | awk '{ print ($2 > $1) ? $2 : $1 }')
+        r=$((r + 1))
+    done
+    echo "$best"
+}
+
+printf "%-6s %-8s %14s %14s %8s\n" size transfer "files/s single" "files/s batch" speedup
+for kb in 1 4 64; do
+    tree $kb
+    for cmd in get put; do
+        single=$(run $cmd $kb --no-batch)
+        batch=$(run $cmd $kb "")
+        echo "$single $batch" |
+            awk -v s="${kb}KB" -v c="$cmd -r" '{ printf "%-6s %-8s %14.0f %14.0f %7.2fx\n", s, c, $1, $2, $2 / $1 }'
+    done
+    rm -rf "$WORK/cli/t$kb" "$WORK/srv/t$kb"
+done
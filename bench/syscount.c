@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+ * syscount: runs a command under ptrace, following all of its threads, and
+ * prints how many system calls it made in total and which ones it made
+ * most. SIGINT and SIGTERM are passed on to the command, so a server can
+ * be stopped the usual way and the counts come out when it exits.
+ *
+ *   usage: syscount [-o file] command [args...]
+ */
+
+#define MAX_SYSCALL 1024
+#define TOP 12
+
+static unsigned long counts[MAX_SYSCALL];
+static pid_t child;
+
+/* names of the calls a file server is likely to make; the rest print as numbers */
+static const struct { long nr; const char *name; } names[] = {
+    { SYS_read, "read" }, { SYS_write, "write" }, { SYS_pread64, "pread64" },
+    { SYS_pwrite64, "pwrite64" }, { SYS_sendto, "sendto" }, { SYS_recvfrom, "recvfrom" },
+    { SYS_sendfile, "sendfile" }, { SYS_splice, "splice" }, { SYS_epoll_wait, "epoll_wait" },
+    { SYS_epoll_pwait, "epoll_pwait" }, { SYS_epoll_ctl, "epoll_ctl" },
+    { SYS_io_uring_enter, "io_uring_enter" }, { SYS_io_uring_register, "io_uring_register" },
+    { SYS_openat, "openat" }, { SYS_openat2, "openat2" }, { SYS_close, "close" },
+    { SYS_fstat, "fstat" }, { SYS_newfstatat, "newfstatat" }, { SYS_ftruncate, "ftruncate" },
+    { SYS_fallocate, "fallocate" }, { SYS_accept4, "accept4" }, { SYS_futex, "futex" },
+    { SYS_getdents64, "getdents64" }, { SYS_copy_file_range, "copy_file_range" },
+    { SYS_mmap, "mmap" }, { SYS_munmap, "munmap" }, { SYS_brk, "brk" },
+};
+
+/*         Name: syscallName
+ *  Description: names a system call number
+ *   Parameters: long number, buffer for unnamed ones
+ *       Return: const char* name
+ */
+static const char *syscallName(long nr, char *buf, size_t size){
+    size_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (names[i].nr == nr)
+            return names[i].name;
+    }
+    snprintf(buf, size, "#%ld", nr);
+    return buf;
+}
+
+/*         Name: forward
+ *  Description: passes a stop signal on to the traced command
+ *   Parameters: int signal
+ *       Return: void
+ */
+static void forward(int sig){
+    kill(child, sig);
+}
+
+/*         Name: report
+ *  Description: prints the total and the most frequent calls
+ *   Parameters: FILE* output
+ *       Return: void
+ */
+static void report(FILE *out){
+    unsigned long total = 0, best;
+    int shown[MAX_SYSCALL] = { 0 };
+    char buf[32];
+    int i, k, pick;
+
+    for (i = 0; i < MAX_SYSCALL; i++)
+        total += counts[i];
+    fprintf(out, "syscalls %lu\n", total);
+
+    for (k = 0; k < TOP; k++) {
+        best = 0;
+        pick = -1;
+        for (i = 0; i < MAX_SYSCALL; i++) {
+            if (!shown[i] && counts[i] > best) {
+                best = counts[i];
+                pick = i;
+            }
+        }
+        if (pick < 0)
+            break;
+        shown[pick] = 1;
+        fprintf(out, "  %-20s %lu\n", syscallName(pick, buf, sizeof(buf)), best);
+    }
+}
+
+int main(int argc, char *argv[]){
+    struct __ptrace_syscall_info info;
+    struct sigaction sa;
+    FILE *out = stderr;
+    int status, sig, first = 1;
+    pid_t pid;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        if ((out = fopen(argv[2], "w")) == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: syscount [-o file] command [args...]\n");
+        return 1;
+    }
+
+    if ((child = fork()) == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[1], argv + 1);
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (1) {
+        pid = waitpid(-1, &status, __WALL);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child)
+                break;
+            continue;
+        }
+
+        sig = 0;
+        if (first && pid == child) {
+            /* the stop before exec: from here on every thread is followed */
+            ptrace(PTRACE_SETOPTIONS, pid, NULL,
+                   PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+            first = 0;
+        } else if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAX_SYSCALL)
+                counts[info.entry.nr]++;
+        } else if (status >> 16) {
+            /* a clone event; the new thread reports in by itself */
+        } else if (WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long)sig);
+    }
+
+    report(out);
+    if (out != stderr)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Compares the server's epoll and io_uring backends on loopback: the
+# throughput of repeated gets and puts of one large file, and the system
+# calls the server makes per GB moved, counted with syscount.
+#
+#   usage: bench/uring.sh [file size in MB] [transfers per run]
+#
+set -e
+
+SIZE=${1:-256}
+ROUNDS=${2:-4}
+PORT=6666
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+gcc -O2 "$REPO/server.c" "$REPO/protocol.c" "$REPO/checksum.c" "$REPO/compress.c" "$REPO/uring.c" \
+    -o "$WORK/server" -pthread -lz
+gcc -O2 "$REPO/client.c" "$REPO/protocol.c" "$REPO/checksum.c" "$REPO/compress.c" \
+    -o "$WORK/client" -pthread -lz 2>/dev/null
+gcc -O2 "$REPO/bench/syscount.c" -o "$WORK/syscount"
+
+mkdir "$WORK/srv" "$WORK/cli"
+head -c $((SIZE * 1024 * 1024)) /dev/urandom > "$WORK/cli/big"
+cp "$WORK/cli/big" "$WORK/srv/big"
+
+now() { date +%s.%N; }
+
+# run <backend> <command> <client options> [syscount]: prints seconds taken
+run() {
+    if [ -n "$4" ]; then
+        "$WORK/syscount" -o "$WORK/count" "$WORK/server" --io "$1" --workers 1 --root "$WORK/srv" \
+            > /dev/null 2>&1 &
+    else
+        "$WORK/server" --io "$1" --workers 1 --root "$WORK/srv" > /dev/null 2>&1 &
+    fi
+    SERVER=$!
+    sleep 0.5
+    i=0
+    : > "$WORK/cmds"
+    while [ $i -lt "$ROUNDS" ]; do
+        echo "$2 big" >> "$WORK/cmds"
+        i=$((i + 1))
+    done
+    echo quit >> "$WORK/cmds"
+    start=$(now)
+    (cd "$WORK/cli" && "$WORK/client" $3 127.0.0.1 $PORT < "$WORK/cmds" > /dev/null)
+    end=$(now)
+    kill -INT $SERVER
+    wait $SERVER 2>/dev/null || true
+    echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+GB=$(echo "$SIZE $ROUNDS" | awk '{ printf "%.4f", $1 * $2 / 1024 }')
+printf "%-8s %-16s %10s %14s\n" backend transfer "MB/s" "syscalls/GB"
+for backend in epoll uring; do
+    for case in "get:" "get:--no-checksum" "put:"; do
+        cmd=${case%%:*}
+        opts=${case#*:}
+        secs=$(run $backend $cmd "$opts")
+        run $backend $cmd "$opts" count > /dev/null
+        calls=$(awk '/^syscalls/ { print $2 }' "$WORK/count")
+        label="$cmd${opts:+ $opts}"
+        echo "$SIZE $ROUNDS $secs $calls $GB" |
+            awk -v b=$backend -v l="$label" '{ printf "%-8s %-16s %10.1f %14.0f\n", b, l, $1 * $2 / $3, $4 / $5 }'
+    done
+done
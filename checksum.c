@@ -0,0 +1,373 @@
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HW_TARGET    __attribute__((target("sse4.2")))
+#define CRC32C_U8(c, v)     _mm_crc32_u8((c), (v))
+#if defined(__x86_64__)
+#define CRC32C_U64(c, v)    ((uint32_t)_mm_crc32_u64((c), (v)))
+#else
+#define CRC32C_U64(c, v)    _mm_crc32_u32(_mm_crc32_u32((c), (uint32_t)(v)), (uint32_t)((v) >> 32))
+#endif
+#define CRC32C_HW_PRESENT() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_HW_TARGET    __attribute__((target("+crc")))
+#define CRC32C_U8(c, v)     __crc32cb((c), (v))
+#define CRC32C_U64(c, v)    __crc32cd((c), (v))
+#define CRC32C_HW_PRESENT() (getauxval(AT_HWCAP) & HWCAP_CRC32)
+#endif
+
+#include "checksum.h"
+
+#define CRC32C_POLY     0x82f63b78
+#define CRC32C_LONG     8192    /* bytes per lane of the long three-lane loop */
+#define CRC32C_SHORT    256     /* bytes per lane of the short one */
+
+#define PRIME64_1   0x9e3779b185ebca87ULL
+#define PRIME64_2   0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3   0x165667b19e3779f9ULL
+#define PRIME64_4   0x85ebca77c2b2ae63ULL
+#define PRIME64_5   0x27d4eb2f165667c5ULL
+
+#define ROTL64(x, r)    (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* byte at a time table for the reflected polynomial 0x82f63b78 */
+static const uint32_t crc32cTable[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+    0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+    0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+    0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+    0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+    0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+    0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+    0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+    0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+    0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+    0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+    0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+    0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+    0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+    0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+    0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+    0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+    0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+    0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+    0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+    0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+    0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+/*         Name: crc32cSoftware
+ *  Description: table driven CRC32C, for CPUs without a CRC instruction
+ *   Parameters: uint32_t checksum so far, data, data length
+ *       Return: uint32_t checksum including the new data
+ */
+static uint32_t crc32cSoftware(uint32_t crc, const void *buf, size_t len){
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len--)
+        crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t (*crc32cImpl)(uint32_t, const void*, size_t) = crc32cSoftware;
+
+#ifdef CRC32C_HW_TARGET
+
+/*
+ * The CRC instruction takes three cycles but a new one can start every
+ * cycle, so the hardware kernel runs three lanes over adjacent stretches
+ * of the buffer and then folds them together. Folding a lane's CRC past
+ * the n zero bytes of the lanes after it is a linear map, kept as four
+ * byte-indexed tables per stretch length.
+ */
+static uint32_t crc32cLong[4][256];
+static uint32_t crc32cShort[4][256];
+
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec){
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1)
+            sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat){
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+/* builds the tables that move a CRC past len zero bytes; len is a power of two */
+static void crc32cZeros(uint32_t zeros[][256], size_t len){
+    uint32_t even[32], odd[32], *op = even;
+    uint32_t row = 1;
+    int n;
+
+    odd[0] = CRC32C_POLY;       /* one zero bit */
+    for (n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    gf2MatrixSquare(even, odd); /* two zero bits */
+    gf2MatrixSquare(odd, even); /* four */
+    while (1) {
+        gf2MatrixSquare(even, odd);
+        if ((len >>= 1) == 0)
+            break;
+        gf2MatrixSquare(odd, even);
+        if ((len >>= 1) == 0) {
+            op = odd;
+            break;
+        }
+    }
+
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2MatrixTimes(op, n);
+        zeros[1][n] = gf2MatrixTimes(op, n << 8);
+        zeros[2][n] = gf2MatrixTimes(op, n << 16);
+        zeros[3][n] = gf2MatrixTimes(op, (uint32_t)n << 24);
+    }
+}
+
+static uint32_t crc32cShift(uint32_t zeros[][256], uint32_t crc){
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t load64Native(const unsigned char *p){
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*         Name: crc32cHardware
+ *  Description: CRC32C with the CPU's CRC instruction, three lanes at once
+ *   Parameters: uint32_t checksum so far, data, data length
+ *       Return: uint32_t checksum including the new data
+ */
+CRC32C_HW_TARGET
+static uint32_t crc32cHardware(uint32_t crc, const void *buf, size_t len){
+    const unsigned char *p = buf, *end;
+    uint64_t crc0 = ~crc, crc1, crc2;
+
+    /* the 8 byte steps below want aligned loads */
+    while (len && ((uintptr_t)p & 7)) {
+        crc0 = CRC32C_U8(crc0, *p++);
+        len--;
+    }
+
+    while (len >= 3 * CRC32C_LONG) {
+        crc1 = crc2 = 0;
+        for (end = p + CRC32C_LONG; p < end; p += 8) {
+            crc0 = CRC32C_U64(crc0, load64Native(p));
+            crc1 = CRC32C_U64(crc1, load64Native(p + CRC32C_LONG));
+            crc2 = CRC32C_U64(crc2, load64Native(p + 2 * CRC32C_LONG));
+        }
+        crc0 = crc32cShift(crc32cLong, crc0) ^ crc1;
+        crc0 = crc32cShift(crc32cLong, crc0) ^ crc2;
+        p += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+
+    while (len >= 3 * CRC32C_SHORT) {
+        crc1 = crc2 = 0;
+        for (end = p + CRC32C_SHORT; p < end; p += 8) {
+            crc0 = CRC32C_U64(crc0, load64Native(p));
+            crc1 = CRC32C_U64(crc1, load64Native(p + CRC32C_SHORT));
+            crc2 = CRC32C_U64(crc2, load64Native(p + 2 * CRC32C_SHORT));
+        }
+        crc0 = crc32cShift(crc32cShort, crc0) ^ crc1;
+        crc0 = crc32cShift(crc32cShort, crc0) ^ crc2;
+        p += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+
+    for (; len >= 8; len -= 8, p += 8)
+        crc0 = CRC32C_U64(crc0, load64Native(p));
+    while (len--)
+        crc0 = CRC32C_U8(crc0, *p++);
+    return ~(uint32_t)crc0;
+}
+
+/* picks the hardware kernel before main() when the CPU has one */
+__attribute__((constructor))
+static void crc32cSelect(void){
+    if (!CRC32C_HW_PRESENT())
+        return;
+    crc32cZeros(crc32cLong, CRC32C_LONG);
+    crc32cZeros(crc32cShort, CRC32C_SHORT);
+    crc32cImpl = crc32cHardware;
+}
+
+#endif
+
+/*         Name: crc32c
+ *  Description: extends a CRC32C over more data, with the CPU's CRC
+ *               instruction where there is one
+ *   Parameters: uint32_t checksum so far (0 to start), data, data length
+ *       Return: uint32_t checksum including the new data
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+    return crc32cImpl(crc, buf, len);
+}
+
+/*         Name: rollingChecksum
+ *  Description: computes the rolling checksum of a block from scratch
+ *   Parameters: block, block length
+ *       Return: uint32_t, the two 16-bit sums packed together
+ */
+uint32_t rollingChecksum(const void *buf, size_t len){
+    const unsigned char *p = buf;
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/*         Name: rollingUpdate
+ *  Description: slides the window of a rolling checksum one byte forward
+ *   Parameters: uint32_t checksum of the old window, byte leaving it,
+ *               byte entering it, window length
+ *       Return: uint32_t checksum of the new window
+ */
+uint32_t rollingUpdate(uint32_t sum, unsigned char out, unsigned char in, size_t len){
+    uint32_t a = sum & 0xffff, b = sum >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+static uint64_t xxh64Round(uint64_t acc, uint64_t input){
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64Merge(uint64_t acc, uint64_t val){
+    acc ^= xxh64Round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t load64(const unsigned char *p){
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static uint32_t load32(const unsigned char *p){
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+/*         Name: xxh64
+ *  Description: hashes a buffer with XXH64
+ *   Parameters: data, data length, uint64_t seed
+ *       Return: uint64_t hash
+ */
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed){
+    const unsigned char *p = buf, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64Round(v1, load64(p));
+            v2 = xxh64Round(v2, load64(p + 8));
+            v3 = xxh64Round(v3, load64(p + 16));
+            v4 = xxh64Round(v4, load64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64Merge(h, v1);
+        h = xxh64Merge(h, v2);
+        h = xxh64Merge(h, v3);
+        h = xxh64Merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64Round(0, load64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)load32(p) * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,23 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli). Start from 0 and feed the data in any number of
+ * pieces; each call returns the checksum of everything fed so far.
+ */
+uint32_t crc32c(uint32_t, const void*, size_t);
+
+/*
+ * rsync style rolling checksum of a block: cheap to slide along a file
+ * one byte at a time, and weak, so matches are confirmed with xxh64.
+ */
+uint32_t rollingChecksum(const void*, size_t);
+uint32_t rollingUpdate(uint32_t, unsigned char, unsigned char, size_t);
+
+/* XXH64, the strong block hash of a delta put */
+uint64_t xxh64(const void*, size_t, uint64_t);
+
+#endif
@@ -1,20 +1,40 @@
 #include <stdio.h>        // For printf() and fprintf().
 #include <sys/socket.h>   // For socket(), connect(), send(), recv().
 #include <arpa/inet.h>    // For sockaddr_in, inet_addr().
+#include <netinet/tcp.h>  // For TCP_NODELAY and TCP_INFO.
 #include <stdlib.h>       // For atoi().
 #include <string.h>       // For memset(), strstr().
 #include <unistd.h>       // For close(), access(), exec().
 #include <errno.h>
+#include <stdint.h>       // For int64_t.
+#include <getopt.h>       // For getopt_long().
+#include <glob.h>         // For glob().
+#include <fnmatch.h>      // For fnmatch().
+#include <time.h>         // For clock_gettime().
+#include <sys/stat.h>     // For stat().
+#include <fcntl.h>        // For open().
+#include <pthread.h>      // For the parallel transfer streams.
+#include <dirent.h>       // For fdopendir().
+#include <limits.h>       // For PATH_MAX.
+#include <sys/uio.h>      // For writev().
+
+#include "protocol.h"     // For the frame format shared with the server.
+#include "checksum.h"     // For CRC32C of partial files.
+#include "compress.h"     // For compressed DATA frames.
 
 #define BUFSIZE 1024    // Buffer size.
+#define CHUNKSIZE (64 * 1024) // Bytes of a file held in memory at once.
+#define STREAM_MIN_RANGE (4 * 1024 * 1024) // Smallest range worth its own connection.
+#define DELTA_WINDOW (1024 * 1024)   // Bytes of a file scanned for matching blocks at once.
+#define DELTA_MAX_RUN (8 * 1024 * 1024) // Most bytes one COPY frame asks the server to copy.
+#define TREE_BUFFER (256 * 1024) // Bytes of a tree transfer gathered per send or recv.
+#define TREE_SMALL (8 * 1024)   // Files of a tree put up to this size go out in BATCH frames.
+#define TRACE_STALL 0.010       // Seconds between chunks of a traced transfer that count as a stall.
+#define RETRY_DELAY 100000      // Microseconds a failed manifest file waits per try before the next.
+#define TUNE_INTERVAL (4 * 1024 * 1024) // Bytes a transfer moves between buffer retunes with --buffer auto.
+#define TUNE_MAX (64 * 1024 * 1024)     // Largest socket buffer a retune asks for.
 //#define DEBUG 0         // If defined, print statements will be enabled for debugging.
 
-// For the size of files being sent or received.
-struct header
-{
-  long  data_length;
-};
-
 
 /////////////////////////////////////////////////////////////////////
 // Function protoypes.
@@ -37,14 +57,40 @@ int NumInputs(char *string);
 
 char *SecondSubstring(char* string);
 
-// Returns 0 if message is sucessfully sent.
-int SendMessage(int socket, char *buffer);
+// Sends exactly len bytes. Exits the program on failure.
+void SendAll(int socket, const void *buffer, size_t len);
+
+// Sends all of several buffers with writev. Exits the program on failure.
+void SendAllV(int socket, struct iovec *iov, int count);
+
+// Receives exactly len bytes. Exits the program on failure.
+void ReceiveAll(int socket, void *buffer, size_t len);
+
+// Sends a frame with the given payload. A NULL payload sends only the
+// header and the caller sends the payload. Returns 0.
+int SendFrame(int socket, uint8_t opcode, uint16_t flags, uint32_t requestId, const void *payload, uint64_t length);
+
+// Receives the header of the next frame from the server.
+void ReceiveFrame(int socket, struct frame *frame);
+
+// Receives a whole reply frame. The payload is stored as a string in
+// buffer, truncated to BUFSIZE. Returns the reply opcode.
+int ReceiveReply(int socket, struct frame *frame, char *buffer);
 
-// Returns the number of bytes received.
-int ReceiveMessage(int socket, char *buffer);
+// Returns a fresh request id.
+uint32_t NextRequestId();
 
-// Handles the request for the ls command.
-int HandleRequestLs(int socket, char *cmdbuffer, char *msgbuffer);
+// Handles the request for the ls command and its -l, -a, -r, -S, -t
+// and -U options.
+int HandleRequestLs(int socket, char *cmdbuffer);
+
+// Receives the entries of a listing as the server streams them and
+// prints them to out, one per line. Returns the number of entries, or -1
+// if the server couldn't list the directory.
+int64_t ReceiveListing(int socket, uint8_t options, FILE *out);
+
+// Prints the server's metrics, as they come, in the Prometheus text format.
+int HandleRequestStats(int socket);
 
 // Sends a message to the server and expects a single message back 
 // from the server with the result of the command.
@@ -56,47 +102,541 @@ int HandleRequestPut(int socket, char *cmdbuffer, char *msgbuffer);
 // Gets a file from the server if it exists.
 int HandleRequestGet(int socket, char *cmdbuffer, char *msgbuffer);
 
+// Sends a put request followed by the file's data from offset on. A
+// nonzero offset resumes a put the server already holds that much of.
+// Stores the file size in size. Returns the request id, or 0 if the file
+// couldn't be read.
+uint32_t SendPutRequest(int socket, const char *filename, int64_t offset, int64_t *size);
+
+// Receives the reply to a put request. Returns 0 if the server stored
+// the file; otherwise the reason is left in msgbuffer.
+int ReceivePutReply(int socket, uint32_t requestId, char *msgbuffer);
+
+// Sends one chunk of a file as a DATA frame, compressed with z if it has
+// a codec and the chunk shrinks. With crc, the running CRC32C of the
+// transfer is updated and sent after the chunk. Returns the bytes sent.
+size_t SendDataChunk(int socket, uint32_t requestId, const char *data, size_t len,
+                     struct compressor *z, uint32_t *crc);
+
+// Reads the CRC32C that ends a DATA frame. Returns 0 if it matches crc.
+int CheckTrailer(int socket, uint32_t crc);
+
+// Returns the compression and checksum flags of a get or put request.
+uint16_t TransferFlags(int get);
+
+// Offers the server our codecs and keeps the one it picks.
+void NegotiateCodec(int socket, char *msgbuffer);
+
+// Prints how much compression saved since the counters were cleared.
+void PrintCompression(double seconds);
+
+// Sends a get request. Returns the request id.
+uint32_t SendGetRequest(int socket, const char *filename);
+
+// Receives the reply to a get request and stores the file, keeping the
+// local prefix when the server resumes the get. Returns the number of
+// bytes received, or -1 if the file wasn't stored.
+int64_t ReceiveGetReply(int socket, uint32_t requestId, const char *filename, char *msgbuffer);
+
+// Continues a get that stopped part way, keeping the local prefix if the
+// server's copy starts with the same bytes.
+int HandleRequestReget(int socket, char *cmdbuffer, char *msgbuffer);
+
+// Continues a put that stopped part way, sending only what the server
+// doesn't hold yet.
+int HandleRequestReput(int socket, char *cmdbuffer, char *msgbuffer);
+
+// Computes the CRC32C of the first length bytes of a local file.
+// Returns 0, or -1 if the file is shorter or can't be read.
+int PrefixChecksum(const char *filename, int64_t length, uint32_t *crc);
+
+struct delta;
+
+// Sends a file as the blocks the server's copy already has plus the new
+// bytes in between. Returns 0 on success, -1 on failure, and 1 if the
+// server has no copy to work from.
+int DeltaPut(int socket, const char *filename, char *msgbuffer);
+
+// Sends the new bytes of a delta put as DATA frames.
+void DeltaLiteral(struct delta *d, const char *data, size_t len);
+
+// Adds a matched block to a delta put, merging runs of consecutive blocks.
+void DeltaCopy(struct delta *d, uint32_t block);
+
+// Sends the pending run of matched blocks as a COPY frame.
+void DeltaFlushRun(struct delta *d);
+
+// Returns the server's block that data matches, or -1.
+int64_t DeltaMatch(struct delta *d, uint32_t weak, const char *data);
+
+// Gets several files, keeping up to window requests in flight.
+int HandleRequestMget(int socket, char *cmdbuffer, char *msgbuffer);
+
+// Puts several files, keeping up to window requests in flight.
+int HandleRequestMput(int socket, char *cmdbuffer, char *msgbuffer);
+
+struct treebuffer;
+struct treeput;
+
+// Gets a directory and everything under it into a local directory of
+// the same name, as one stream of entries.
+int HandleRequestGetTree(int socket, char *cmdbuffer);
+
+// Puts a local directory and everything under it as one stream of
+// entries, without waiting for the server between them.
+int HandleRequestPutTree(int socket, char *cmdbuffer, char *msgbuffer);
+
+// Returns the last component of a directory path, which names the copy of
+// a tree on the other side: "." for the current directory or the root.
+// Trailing slashes are cut from path.
+const char *TreeName(char *path);
+
+// Returns 1 if an entry path of a tree get stays inside the tree.
+int TreePathSafe(const char *path);
+
+// Receives the DATA frames of one file of a tree get and writes them to
+// fd; with fd -1 they are read and dropped. Returns 0 if the file was
+// stored intact.
+int ReceiveTreeFile(struct treebuffer *in, uint32_t requestId, int fd, int64_t size, const char *path, char *chunk);
+
+// Stores the files of a BATCH frame of a tree get, one after another
+// straight out of the frame. Returns the number that couldn't be stored.
+int ReceiveTreeBatch(struct treebuffer *in, const struct frame *frame, int rootfd, unsigned char *batch,
+                     int *count, int64_t *bytes);
+
+// Sends the entries under a directory of a tree put, depth first.
+// Takes over dirfd.
+void SendTreeDirectory(struct treeput *tp, int dirfd, size_t len);
+
+// Sends the ENTRY frame of tp->path.
+void SendTreeEntry(struct treeput *tp, char type, const struct stat *st, size_t len);
+
+// Sends the contents of a file of a tree put as DATA frames.
+void SendTreeFile(struct treeput *tp, int fd, int64_t size);
+
+// Adds a small file of a tree put to the pending BATCH frame, sending
+// that first if the file doesn't fit.
+void AddToBatch(struct treeput *tp, int fd, const struct stat *st, size_t len);
+
+// Sends the pending BATCH frame of a tree put, if there is one.
+void SendTreeBatch(struct treeput *tp);
+
+// Adds one chunk of a file to a tree put as a DATA frame, like
+// SendDataChunk.
+void TreeSendData(struct treeput *tp, const char *data, size_t len, uint32_t *crc);
+
+// Buffers bytes of a tree put, sending them once the buffer fills.
+void TreeWrite(struct treebuffer *out, const void *data, size_t len);
+
+// Sends whatever a tree put has buffered.
+void TreeFlush(struct treebuffer *out);
+
+// Reads exactly len bytes of a tree get through its buffer.
+void TreeRead(struct treebuffer *in, void *buffer, size_t len);
+
+// Refills the empty buffer of a tree get with whatever the socket has.
+void TreeFill(struct treebuffer *in);
+
+// Reads the next frame header of a tree get and checks it answers requestId.
+void TreeReadFrame(struct treebuffer *in, uint32_t requestId, struct frame *frame);
+
+// Collects the remote names of an mget command. Arguments with glob
+// characters are matched against the server's listing.
+int ExpandRemoteNames(int socket, char *cmdbuffer, char ***names, int *count);
+
+// Collects the local regular files named or matched by an mput command.
+int ExpandLocalNames(char *cmdbuffer, char ***names, int *count);
+
+// Appends a copy of name to a growable list of names.
+void AddName(char ***names, int *count, int *capacity, const char *name);
+
+// Frees a list of names.
+void FreeNames(char **names, int count);
+
+// Returns the server's listing of its current directory. Caller frees.
+char *FetchListing(int socket);
+
+// Returns a monotonic timestamp in seconds.
+double Now();
+
+// Prints the totals of a batch command.
+void PrintBatchSummary(const char *command, int count, int failed, int64_t bytes, double seconds);
+
+// Starts the timeline of a get or put when --trace or --json is on.
+void TraceStart(const char *op, const char *filename);
+
+// Returns Now() while a transfer is traced, for TraceNetwork and TraceDisk.
+double TraceClock();
+
+// Adds the time since a TraceClock() to the traced transfer's network or
+// disk time.
+void TraceNetwork(double since);
+void TraceDisk(double since);
+
+// Marks a phase of the traced transfer as reached now.
+void TraceMark(double *phase);
+
+// Notes n file bytes received or sent by the traced transfer.
+void TraceChunk(int64_t n);
+
+// Ends the traced transfer and reports its timeline.
+void TraceEnd(int ok);
+
+// Prints a string as a JSON string literal to out.
+void PrintJsonString(FILE *out, const char *string);
+
+// Opens a new connection to the server. Returns the socket, or -1.
+int ConnectToServer();
+
+// How far a transfer had got at its last buffer retune.
+struct tuner
+{
+  double since;
+  int64_t moved;
+};
+
+// With --buffer auto, grows a socket's SO_SNDBUF or SO_RCVBUF every
+// TUNE_INTERVAL bytes to twice the bandwidth-delay product the transfer
+// has seen: its rate since the last retune times the kernel's RTT.
+void Retune(int socket, int option, struct tuner *t, int64_t moved);
+
+// Returns the size of a remote file, or -1 if it doesn't exist.
+int64_t StatRemote(int socket, const char *filename, char *msgbuffer);
+
+// Moves one file over several connections, one byte range each.
+// Returns 0 if every range arrived.
+int ParallelTransfer(const char *filename, int64_t filesize, int put);
+
+// Thread body moving one byte range of a parallel transfer.
+void *StreamMain(void *arg);
+
+// One byte range of a parallel transfer and how it went.
+struct stream
+{
+  pthread_t thread;
+  int index;
+  int put;              // 1 to send the range, 0 to fetch it
+  int fd;               // Local file, read or written with pread/pwrite.
+  const char *filename;
+  int64_t total;        // Size of the whole file.
+  int64_t offset;
+  int64_t length;
+  double seconds;
+  int failed;
+};
+
+struct job;
+struct lane;
+struct scheduler;
+
+// Runs the transfers listed in a manifest over a pool of connections and
+// reports their progress. Returns 0 if every file made it.
+int RunManifest(int socket, const char *path);
+
+// Reads a manifest into a list of jobs. Returns the number read, or -1.
+int ReadManifest(int socket, const char *path, struct job **jobs);
+
+// Orders jobs by priority, then the largest first, for qsort.
+int CompareJobs(const void *a, const void *b);
+
+// Thread body of one manifest connection: runs the jobs queued on it,
+// then steals from the others.
+void *LaneMain(void *arg);
+
+// Takes the next job for a lane: its own largest queued one, or the
+// largest one queued on the lane with the most bytes left. Returns NULL
+// once nothing is left. Called with the scheduler locked.
+struct job *TakeJob(struct scheduler *s, struct lane *lane);
+
+// Queues a job at the end of a lane. Called with the scheduler locked.
+void QueueJob(struct lane *lane, struct job *job);
+
+// Moves one file of a manifest. Returns 0 on success, -1 if the file
+// failed for good and -2 if it is worth another try.
+int RunJob(struct lane *lane, struct job *job);
+int RunGetJob(struct lane *lane, struct job *job, char *message);
+int RunPutJob(struct lane *lane, struct job *job, char *message);
+
+// Send or receive on a lane's connection like SendAll, SendFrame,
+// ReceiveAll, ReceiveFrame and ReceiveReply, but return -1 instead of
+// exiting when the connection fails, so the job can be retried.
+int LaneSend(struct lane *lane, const void *buffer, size_t len);
+int LaneSendFrame(struct lane *lane, uint8_t opcode, uint16_t flags, uint32_t requestId,
+                  const void *payload, uint64_t length);
+int LaneReceive(struct lane *lane, void *buffer, size_t len);
+int LaneReceiveFrame(struct lane *lane, struct frame *frame);
+int LaneReceiveReply(struct lane *lane, struct frame *frame, char *buffer);
+
+// Closes a lane's connection after a failure; the next job reconnects.
+void LaneDrop(struct lane *lane);
+
+// One file of a manifest and how its transfer went.
+struct job
+{
+  int put;              // 1 to send the file, 0 to fetch it
+  char *name;
+  int64_t size;         // From the manifest or looked up; -1 if unknown.
+  int priority;         // Higher goes first.
+  int attempts;
+};
+
+// A connection of a manifest run and the jobs queued on it, largest first.
+struct lane
+{
+  pthread_t thread;
+  struct scheduler *s;
+  int index;
+  int socket;           // -1 until connected, and after a failure.
+  struct job **queue;   // Jobs not yet started are queue[head..tail).
+  int head;
+  int tail;
+  int64_t queued;       // Bytes of the queued jobs.
+  char *buffer;         // One chunk of a file, with room for a frame header and CRC.
+  int files;            // Jobs this lane finished,
+  int stolen;           // and how many of them it took from other lanes.
+  int64_t bytes;
+};
+
+// The jobs of a manifest run, spread over its lanes.
+struct scheduler
+{
+  pthread_mutex_t lock;
+  pthread_cond_t settled;       // Signalled when the last job is settled.
+  struct lane *lanes;
+  int count;            // Lanes.
+  int jobs;             // Jobs, and the room in each lane's queue.
+  int left;             // Jobs neither finished nor given up on.
+  int done;
+  int failed;
+  int retried;
+  int64_t bytes;        // Bytes of the finished files.
+  int64_t moved;        // Bytes moved so far, retries and partial files included.
+};
+
+// Bytes of a tree transfer pass through one large buffer each way, so a
+// tree of small files costs a system call per buffer rather than per frame.
+struct treebuffer
+{
+  int socket;
+  unsigned char *data;
+  size_t start;         // First byte not yet read.
+  size_t end;           // Bytes held.
+};
+
+// A tree put on its way out.
+struct treeput
+{
+  struct treebuffer out;
+  uint32_t requestId;
+  char *chunk;          // One chunk of a file.
+  char path[PATH_MAX];  // Entry being sent, relative to the tree.
+  int count;            // Entries sent.
+  int failed;           // Entries that couldn't be read.
+  int64_t bytes;
+  unsigned char *index; // Index records of the pending BATCH frame,
+  size_t indexLen;
+  char *data;           // the bytes of its files,
+  size_t dataLen;
+  int batched;          // and how many there are.
+  char *raw;            // The whole frame, when it is compressed.
+};
+
+// What a delta put knows about the server's copy, and what it has sent.
+struct delta
+{
+  int socket;
+  uint32_t requestId;
+  uint32_t blockSize;
+  uint64_t blocks;
+  uint32_t *weak;       // Rolling checksum of each of the server's blocks.
+  uint64_t *strong;     // xxh64 of each of the server's blocks.
+  int64_t *buckets;     // Hash table over weak; chains run through next.
+  int64_t *next;
+  uint64_t mask;
+  uint32_t runFirst;    // Pending run of consecutive matched blocks.
+  uint32_t runCount;
+  int64_t matched;      // Bytes reused from the server's copy.
+  int64_t literal;      // Bytes sent as they are.
+  int64_t wire;         // Bytes sent and received, frame headers included.
+};
+
+// When the phases of a single get or put were reached, in seconds since
+// it started; 0 for a phase it never reached.
+struct timeline
+{
+  const char *op;       // "get" or "put" while a transfer is traced, or NULL.
+  const char *filename;
+  double start;
+  double requested;     // The request is sent.
+  double header;        // A get's FILE_INFO has arrived.
+  double first;         // The first file byte arrived or went out.
+  double last;          // The last one did.
+  double done;          // A get's file is synced and closed; a put is acknowledged.
+  double previous;      // When the last chunk moved, to find stalls.
+  double stall;         // Gaps between chunks longer than TRACE_STALL.
+  double network;       // Time blocked on the socket.
+  double disk;          // Time reading, writing, syncing and closing the file.
+  int64_t bytes;
+};
+
+// Report a timeline for each get and put: TRACE_TEXT to stdout, TRACE_JSON
+// as one object per line to stderr, apart from the prompt and messages.
+enum { TRACE_OFF, TRACE_TEXT, TRACE_JSON };
+int tracemode = TRACE_OFF;
+struct timeline timeline;
+
+// Requests kept in flight by mget and mput.
+int window = 8;
+
+// Send put as a delta against the server's copy when it has one.
+int delta = 0;
+
+// Ask the server to compress transfers on the main connection.
+int compress = 0;
+
+// Verify every transfer with CRC32C checksums.
+int checksums = 1;
+
+// Move the small files of a tree many to a BATCH frame.
+int batching = 1;
+
+// Codec agreed with the server and its byte counters.
+struct compressor compressor;
+
+// One compressed DATA frame payload.
+unsigned char *zbuffer;
+
+// Connections used to move a single large file.
+int streams = 1;
+
+// SO_SNDBUF and SO_RCVBUF of every connection, 0 to leave them to the
+// kernel's autotuning; with --buffer auto they grow with the measured
+// bandwidth-delay product instead.
+int socketbuffer = 0;
+int autotune = 0;
+
+// Congestion control of every connection, or NULL for the system default.
+char *congestion = NULL;
+
+// Where ConnectToServer connects to.
+struct sockaddr_in serveraddress;
+
+// The session's directory on the server, as the last cd reported it.
+// Every connection starts at the server's root, so extra streams cd here.
+char remotedirectory[BUFSIZE] = "/";
+
+// Manifest to run instead of reading commands, the connections it uses,
+// and how many times a file that failed on the way is tried again.
+char *manifest = NULL;
+int connections = 4;
+int retries = 3;
+
 /////////////////////////////////////////////////////////////////////
 // Main.
 /////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
   int sockfd;                         // Socket file descripter.
-  struct sockaddr_in serveraddress;   // Server address.
   unsigned short serverport;          // Server port.
   char cmdbuffer[BUFSIZE];            // Buffer for command inputs.
   char msgbuffer[BUFSIZE];            // Buffer for send and receive.
   char *serverip;                     // Server IP address (dotted).
 
+  struct option options[] = {
+    { "window", required_argument, NULL, 'w' },
+    { "streams", required_argument, NULL, 's' },
+    { "delta", no_argument, NULL, 'd' },
+    { "compress", no_argument, NULL, 'z' },
+    { "no-checksum", no_argument, NULL, 'n' },
+    { "no-batch", no_argument, NULL, 'b' },
+    { "trace", no_argument, NULL, 't' },
+    { "json", no_argument, NULL, 'j' },
+    { "manifest", required_argument, NULL, 'm' },
+    { "connections", required_argument, NULL, 'c' },
+    { "retries", required_argument, NULL, 'r' },
+    { "buffer", required_argument, NULL, 'B' },
+    { "congestion", required_argument, NULL, 'C' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "w:s:dz", options, NULL)) != -1) {
+    switch (opt) {
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 's':
+        streams = atoi(optarg);
+        break;
+      case 'd':
+        delta = 1;
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case 'n':
+        checksums = 0;
+        break;
+      case 'b':
+        batching = 0;
+        break;
+      case 't':
+        tracemode = TRACE_TEXT;
+        break;
+      case 'j':
+        tracemode = TRACE_JSON;
+        break;
+      case 'm':
+        manifest = optarg;
+        break;
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 'r':
+        retries = atoi(optarg);
+        break;
+      case 'B':
+        if (strcmp(optarg, "auto") == 0) {
+          autotune = 1;
+        } else {
+          socketbuffer = atoi(optarg) * 1024;
+        }
+        break;
+      case 'C':
+        congestion = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [--window N] [--streams N] [--delta] [--compress] [--no-checksum] [--no-batch] [--trace | --json]\n       [--manifest FILE [--connections N] [--retries N]] [--buffer KB|auto] [--congestion NAME] <Server IP> [<Port>]\n", argv[0]);
+        return -1;
+    }
+  }
+
+  if (window < 1) {
+    window = 1;
+  }
+  if (streams < 1) {
+    streams = 1;
+  }
+  if (connections < 1) {
+    connections = 1;
+  }
+
   // check for correct # of arguments (1 or 2)
-  if ((argc < 2) || (argc > 3)) {
-    fprintf(stderr, "Usage: %s <Server IP> [<Port>]\n", argv[0]);
+  if ((argc - optind < 1) || (argc - optind > 2)) {
+    fprintf(stderr, "Usage: %s [--window N] [--streams N] [--delta] [--compress] [--no-checksum] [--no-batch] [--trace | --json]\n       [--manifest FILE [--connections N] [--retries N]] [--buffer KB|auto] [--congestion NAME] <Server IP> [<Port>]\n", argv[0]);
     return -1;
   }
 
   // Server IP.
-  serverip = argv[1];
+  serverip = argv[optind];
 
   // Check if port is specified.
-  if (argc == 3) {
-    serverport = atoi(argv[2]);
+  if (argc - optind == 2) {
+    serverport = atoi(argv[optind + 1]);
   } else {
     serverport = 7; // 7 is a well know port for echo service.
   }
 
-  #ifdef DEBUG
-  printf("[DEBUG] Creating TCP socket...\n");
-  #endif
-
-  // Create a TCP socket.
-  if ((sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-    Die("Failed to create socket");
-  }
-
-  #ifdef DEBUG
-  printf("[DEBUG] Created a TCP socket...\n");
-  #endif
-
   // Construct the server address structure.
   memset(&serveraddress, 0, sizeof(serveraddress));
   serveraddress.sin_family      = AF_INET;
@@ -108,7 +648,7 @@ int main(int argc, char *argv[]) {
   #endif
 
   // Connect to the server
-  if (connect(sockfd, (struct sockaddr *) &serveraddress, sizeof(serveraddress)) < 0) {
+  if ((sockfd = ConnectToServer()) < 0) {
     Die("Failed to connect to server");
   }
 
@@ -116,6 +656,20 @@ int main(int argc, char *argv[]) {
   printf("[DEBUG] Connected to server... connect()\n");
   #endif
 
+  compressorInit(&compressor, CODEC_NONE);
+  if (compress) {
+    NegotiateCodec(sockfd, msgbuffer);
+  }
+
+  // A manifest runs by itself; the exit status says whether every file made it.
+  if (manifest != NULL) {
+    int failed = RunManifest(sockfd, manifest) != 0;
+
+    SendFrame(sockfd, OP_QUIT, 0, NextRequestId(), NULL, 0);
+    close(sockfd);
+    return failed;
+  }
+
   // Return value variable for functions.
   int rv = 0;
   int loop = 1;
@@ -123,9 +677,13 @@ int main(int argc, char *argv[]) {
   // Main logic code.
   while (loop) {
     printf("ft> ");
-    fgets(cmdbuffer, BUFSIZE, stdin);
 
-    cmdbuffer[strlen(cmdbuffer)-1] = 0;
+    // End of input behaves like quit.
+    if (fgets(cmdbuffer, BUFSIZE, stdin) == NULL) {
+      strcpy(cmdbuffer, "quit\n");
+    }
+
+    cmdbuffer[strcspn(cmdbuffer, "\n")] = 0;
 
     // NumInputs replaces the buffer used, so create a new buffer.
     char pstring[BUFSIZE];
@@ -153,7 +711,7 @@ int main(int argc, char *argv[]) {
         #endif
 
         // Send the 'quit' message to the server.
-        SendMessage(sockfd,cmdbuffer);
+        SendFrame(sockfd, OP_QUIT, 0, NextRequestId(), NULL, 0);
 
         #ifdef DEBUG
         printf("--== Sent message '%s' to the server --==\n", cmdbuffer);
@@ -169,7 +727,9 @@ int main(int argc, char *argv[]) {
         printf("[DEBUG] ls command\n");
         #endif
 
-        HandleRequestLs(sockfd, cmdbuffer, msgbuffer);
+        HandleRequestLs(sockfd, cmdbuffer);
+      } else if (strcmp(cmdbuffer, "stats") == 0) {
+        HandleRequestStats(sockfd);
       } else if (strcmp(cmdbuffer, "clear") == 0) {
         system("clear");
       } else {
@@ -194,6 +754,16 @@ int main(int argc, char *argv[]) {
 
         HandleRequestPut(sockfd, cmdbuffer, msgbuffer);
 
+      } else if (StartsWith(cmdbuffer, "reget ") == 0) {
+        HandleRequestReget(sockfd, cmdbuffer, msgbuffer);
+      } else if (StartsWith(cmdbuffer, "reput ") == 0) {
+        HandleRequestReput(sockfd, cmdbuffer, msgbuffer);
+      } else if (StartsWith(cmdbuffer, "mget ") == 0) {
+        HandleRequestMget(sockfd, cmdbuffer, msgbuffer);
+      } else if (StartsWith(cmdbuffer, "mput ") == 0) {
+        HandleRequestMput(sockfd, cmdbuffer, msgbuffer);
+      } else if (StartsWith(cmdbuffer, "ls -") == 0) {
+        HandleRequestLs(sockfd, cmdbuffer);
       } else if ((StartsWith(cmdbuffer, "cd") == 0) && strstr(cmdbuffer, " ")) {
 
         #ifdef DEBUG
@@ -212,6 +782,24 @@ int main(int argc, char *argv[]) {
         printf("Invalid command.\n");
         HelpMessage();
       } // End of 2 command input.
+    } else if (rv == 3 && StartsWith(cmdbuffer, "get -r ") == 0) {
+      HandleRequestGetTree(sockfd, cmdbuffer);
+    } else if (rv == 3 && StartsWith(cmdbuffer, "put -r ") == 0) {
+      HandleRequestPutTree(sockfd, cmdbuffer, msgbuffer);
+    } else if (rv > 2 && StartsWith(cmdbuffer, "mget ") == 0) {
+
+      #ifdef DEBUG
+      printf("[DEBUG] mget <remote-files> command\n");
+      #endif
+
+      HandleRequestMget(sockfd, cmdbuffer, msgbuffer);
+    } else if (rv > 2 && StartsWith(cmdbuffer, "mput ") == 0) {
+
+      #ifdef DEBUG
+      printf("[DEBUG] mput <file-names> command\n");
+      #endif
+
+      HandleRequestMput(sockfd, cmdbuffer, msgbuffer);
     } else {
       printf("Invalid command.\n");
       HelpMessage();
@@ -230,11 +818,18 @@ int StartsWith(const char *string, const char *substring) {
 
 void HelpMessage() {
   printf("Commands are:\n\n");
-  printf("ls:\t\t\t\t print a listing of the contents of the current directory\n");
+  printf("ls [-lartSU]:\t\t\t print a listing of the contents of the current directory\n");
   printf("get <remote-file>:\t\t retrieve the <remote-file> on the server and store it in the current directory\n");
   printf("put <file-name>:\t\t put and store the file from the client machine to the server machine.\n");
   printf("cd <directory-name>:\t\t change the directory on the server\n");
   printf("mkdir <directory-name>:\t\t create a new sub-directory named <directory-name>\n");
+  printf("mget <remote-files...>:\t\t retrieve several files or glob patterns, pipelined\n");
+  printf("mput <file-names...>:\t\t store several local files or glob patterns, pipelined\n");
+  printf("reget <remote-file>:\t\t resume an interrupted get\n");
+  printf("reput <file-name>:\t\t resume an interrupted put\n");
+  printf("get -r <remote-directory>:\t retrieve a directory and everything under it\n");
+  printf("put -r <directory>:\t\t store a local directory and everything under it on the server\n");
+  printf("stats:\t\t\t\t print the server's transfer metrics\n");
 }
 
 int FileExists(const char *filename) {
@@ -268,104 +863,302 @@ char *SecondSubstring(char* string) {
   return strtok(NULL, " ");
 }
 
-int SendMessage(int socket, char *buffer) {
-  #ifdef DEBUG
-  printf("Inside SendMessage: '%s'\n", buffer);
-  #endif
+void SendAll(int socket, const void *buffer, size_t len) {
+  size_t sent = 0;
+  ssize_t n = 0;
 
-  // Send command to server
-  if (send(socket, buffer, sizeof(char)*BUFSIZE, 0) < 0) {
-    Die("Failed to send message");
+  while (sent < len) {
+    if ((n = send(socket, (const char *)buffer + sent, len - sent, 0)) < 0) {
+      Die("send() failed.");
+    }
+    sent += n;
   }
+}
 
-  #ifdef DEBUG
-  printf("Sent message: '%s', successfully\n", buffer);
-  #endif
+void SendAllV(int socket, struct iovec *iov, int count) {
+  ssize_t n;
 
-  return 0;
+  while (count > 0) {
+    if ((n = writev(socket, iov, count)) < 0) {
+      Die("writev() failed.");
+    }
+    // Skip what went out, finished buffers first.
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void ReceiveAll(int socket, void *buffer, size_t len) {
+  size_t received = 0;
+  ssize_t n = 0;
+
+  while (received < len) {
+    if ((n = recv(socket, (char *)buffer + received, len - received, 0)) <= 0) {
+      if (n == 0) {
+        printf("Server is closed, shutting off client.\n");
+        exit(1);
+      }
+      Die("recv() failed.");
+    }
+    received += n;
+  }
 }
 
-int ReceiveMessage(int socket, char *buffer) {
+int SendFrame(int socket, uint8_t opcode, uint16_t flags, uint32_t requestId, const void *payload, uint64_t length) {
+  unsigned char header[FRAME_HEADER_SIZE];
 
   #ifdef DEBUG
-  printf("Inside ReceiveMessage.\n");
+  printf("[DEBUG] Sending frame opcode 0x%02x id %u length %llu\n", opcode, requestId, (unsigned long long)length);
   #endif
 
-  int bytesRecvd = 0;
+  frameBuild(header, opcode, flags, requestId, length);
 
-  // Send command to server
-  if ((bytesRecvd = recv(socket, buffer, sizeof(char)*BUFSIZE, 0)) <= 0) {
-    if(errno == 0) {
-      printf("Server is closed, shutting off client.\n");
-      exit(1);
+  if (payload == NULL) {
+    SendAll(socket, header, sizeof(header));
+    return 0;
+  }
+
+  // Small frames go out in one send.
+  if (length <= BUFSIZE) {
+    unsigned char message[FRAME_HEADER_SIZE + BUFSIZE];
+
+    memcpy(message, header, sizeof(header));
+    memcpy(message + sizeof(header), payload, length);
+    SendAll(socket, message, sizeof(header) + length);
+  } else {
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *)payload, length } };
+
+    SendAllV(socket, iov, 2);
+  }
+
+  return 0;
+}
+
+void ReceiveFrame(int socket, struct frame *frame) {
+  struct frame_parser parser;
+  unsigned char header[FRAME_HEADER_SIZE];
+  size_t used = 0, have = 0;
+  ssize_t n = 0;
+  int rv = 0;
+
+  frameParserReset(&parser);
+
+  // Feed the parser until it has a whole header; never read past it.
+  while (rv == 0) {
+    if ((n = recv(socket, header, sizeof(header) - have, 0)) <= 0) {
+      if (n == 0) {
+        printf("Server is closed, shutting off client.\n");
+        exit(1);
+      }
+      Die("recv() failed.");
     }
-    Die("recv() failed.");
+    have += n;
+    rv = frameParseHeader(&parser, header, n, &used);
+  }
+
+  if (rv < 0) {
+    printf("Received a malformed frame from the server.\n");
+    exit(1);
   }
 
-  buffer[bytesRecvd] = '\0';
+  *frame = parser.frame;
 
   #ifdef DEBUG
-  printf("Received message from server: '%s'\n", buffer);
+  printf("[DEBUG] Received frame opcode 0x%02x id %u length %llu\n", frame->opcode, frame->requestId, (unsigned long long)frame->length);
   #endif
+}
+
+int ReceiveReply(int socket, struct frame *frame, char *buffer) {
+  uint64_t left;
+  size_t keep;
+
+  ReceiveFrame(socket, frame);
 
-  return bytesRecvd;
+  if (frame->opcode == OP_DATA || frame->length > FRAME_MAX_CONTROL) {
+    printf("Received an unexpected frame from the server.\n");
+    exit(1);
+  }
+
+  keep = (frame->length < BUFSIZE) ? frame->length : BUFSIZE - 1;
+  ReceiveAll(socket, buffer, keep);
+  buffer[keep] = '\0';
+
+  // Drop whatever didn't fit.
+  for (left = frame->length - keep; left > 0; ) {
+    char discard[BUFSIZE];
+    size_t n = (left < BUFSIZE) ? left : BUFSIZE;
+
+    ReceiveAll(socket, discard, n);
+    left -= n;
+  }
+
+  return frame->opcode;
 }
 
-int HandleRequestLs(int socket, char *cmdbuffer, char *msgbuffer) {
+uint32_t NextRequestId() {
+  static uint32_t requestId = 0;
 
-  #ifdef DEBUG
-  printf("--== Sent message '%s' to the server --==\n", cmdbuffer);
-  #endif
+  return __atomic_add_fetch(&requestId, 1, __ATOMIC_RELAXED);
+}
 
-  // Send command to server.
-  SendMessage(socket, cmdbuffer);
+int HandleRequestLs(int socket, char *cmdbuffer) {
+  // Sorted by name unless an option says otherwise, like ls.
+  uint8_t request[2] = { 0, LIST_SORT_NAME };
+  char *option = strchr(cmdbuffer, '-');
+  int64_t count;
+
+  while (option && *++option) {
+    switch (*option) {
+      case 'l': request[0] |= LIST_LONG; break;
+      case 'a': request[0] |= LIST_ALL; break;
+      case 'r': request[0] |= LIST_REVERSE; break;
+      case 'S': request[1] = LIST_SORT_SIZE; break;
+      case 't': request[1] = LIST_SORT_TIME; break;
+      case 'U': request[1] = LIST_SORT_NONE; break;
+      default:
+        printf("Unknown ls option '%c'.\n", *option);
+        return -1;
+    }
+  }
 
+  // Send command to server.
+  SendFrame(socket, OP_LS, 0, NextRequestId(), request, sizeof(request));
 
   #ifdef DEBUG
   printf("[DEBUG] Handling '%s' request to server\n", cmdbuffer);
   #endif
 
-  int bytesRecvd = 0;
+  // Output the server results as they arrive.
+  count = ReceiveListing(socket, request[0], stdout);
+  if (count < 0) {
+    printf("Could not list the directory on the server.\n");
+    return -1;
+  }
 
-  // Read results from server until a null terminator is found.
-  bytesRecvd = ReceiveMessage(socket, msgbuffer);
+  #ifdef DEBUG
+  printf("--== Received %lld entries of '%s' from the server --==\n", (long long)count, cmdbuffer);
+  #endif
 
-  msgbuffer[bytesRecvd] = '\0';
+  return 0;
+}
 
-  // Output the server results.
-  printf("%s", msgbuffer);
+int HandleRequestStats(int socket) {
+  struct frame frame;
+  char page[BUFSIZE];
+  uint64_t left;
+  size_t n;
 
-  // Clear msgbuffer.
-  memset(msgbuffer, 0, sizeof(char)*BUFSIZE);
+  SendFrame(socket, OP_STATS, 0, NextRequestId(), NULL, 0);
 
-  #ifdef DEBUG
-  printf("--== Received entire result of '%s' from the server --==\n", cmdbuffer);
-  #endif
+  for (;;) {
+    ReceiveFrame(socket, &frame);
+    if (frame.opcode != OP_DATA) {
+      break;
+    }
+    for (left = frame.length; left > 0; left -= n) {
+      n = left < sizeof(page) ? left : sizeof(page);
+      ReceiveAll(socket, page, n);
+      fwrite(page, 1, n, stdout);
+    }
+  }
 
+  if (frame.length > BUFSIZE) {
+    printf("Received an unexpected frame from the server.\n");
+    exit(1);
+  }
+  ReceiveAll(socket, page, frame.length);
+  if (frame.opcode != OP_OK) {
+    printf("Could not get the server's metrics.\n");
+    return -1;
+  }
   return 0;
 }
 
+int64_t ReceiveListing(int socket, uint8_t options, FILE *out) {
+  struct frame frame;
+  unsigned char *page = NULL;
+  unsigned char count[8];
+  char when[32];
+  size_t pos, nameLen;
+  time_t mtime, now = time(NULL);
+  struct tm tm;
+
+  for (;;) {
+    ReceiveFrame(socket, &frame);
+    if (frame.opcode != OP_DATA) {
+      break;
+    }
+    if (frame.length > FRAME_MAX_DATA) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+
+    page = realloc(page, frame.length);
+    ReceiveAll(socket, page, frame.length);
+
+    // Pages hold whole records, so each one is printed as it arrives.
+    for (pos = 0; pos < frame.length; pos += nameLen) {
+      if (options & LIST_LONG) {
+        mtime = (time_t)getU64(page + pos + 9);
+        localtime_r(&mtime, &tm);
+        // Like ls, older or future files show the year instead of the time.
+        strftime(when, sizeof(when), (now - mtime < 182 * 24 * 3600 && mtime <= now) ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        fprintf(out, "%c %12llu %s ", page[pos], (unsigned long long)getU64(page + pos + 1), when);
+        pos += 17;
+      }
+      nameLen = (page[pos] << 8) | page[pos + 1];
+      pos += 2;
+      fwrite(page + pos, 1, nameLen, out);
+      fputc('\n', out);
+    }
+  }
+  free(page);
+
+  if (frame.opcode != OP_OK || frame.length != sizeof(count)) {
+    char message[BUFSIZE];
+
+    if (frame.length > FRAME_MAX_CONTROL) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+    ReceiveAll(socket, message, frame.length);
+    return -1;
+  }
+
+  ReceiveAll(socket, count, sizeof(count));
+  return (int64_t)getU64(count);
+}
+
 int HandleRequest(int socket, char *cmdbuffer, char *msgbuffer) {
+  struct frame frame;
+  char *argument = strchr(cmdbuffer, ' ') + 1;
+  uint8_t opcode = (StartsWith(cmdbuffer, "cd") == 0) ? OP_CD : OP_MKDIR;
 
   #ifdef DEBUG
   printf("--== Sent message '%s' to the server --==\n", cmdbuffer);
   #endif
 
   // Send command to server.
-  SendMessage(socket,cmdbuffer);
+  SendFrame(socket, opcode, 0, NextRequestId(), argument, strlen(argument));
 
   #ifdef DEBUG
   printf("[DEBUG] Handling '%s' request to server\n", cmdbuffer);
   #endif
 
-  int bytesRecvd = 0;
-
   // Read result from server.
-  bytesRecvd = ReceiveMessage(socket, msgbuffer);
-
-  if ((strcmp(msgbuffer, "success") != 0)) {
+  if (ReceiveReply(socket, &frame, msgbuffer) != OP_OK) {
     // Output the server results.
-    printf("%s", msgbuffer);
+    printf("%s\n", msgbuffer);
+  } else if (opcode == OP_CD) {
+    // The reply names the directory we ended up in.
+    strcpy(remotedirectory, msgbuffer);
   }
 
   // clear msgbuffer
@@ -381,211 +1174,2534 @@ int HandleRequest(int socket, char *cmdbuffer, char *msgbuffer) {
 int HandleRequestPut(int socket, char *cmdbuffer, char *msgbuffer) {
   // Getting pointer to the file name, which is the 2nd substring
   char *filename = strchr(cmdbuffer, ' ') + 1;
+  int64_t filesize = 0;
+  uint32_t requestId;
 
   #ifdef DEBUG
   printf("[DEBUG] Checking if file exists.\n");
   #endif
 
-  if (FileExists(filename) == 0) {
-    #ifdef DEBUG
-    printf("[DEBUG] File '%s' exists.\n", filename);
-    printf("--== Sending message '%s' to the server --==\n", cmdbuffer);
-    #endif
-
-    // Send command to server.
-    SendMessage(socket, cmdbuffer);
+  if (FileExists(filename) != 0) {
+    printf("File '%s' does not exist in current directory\n", filename);
+    return -1;
+  }
 
-    #ifdef DEBUG
-    printf("--== Sent message '%s' to the server --==\n", cmdbuffer);
-    printf("[DEBUG] Waiting on recv() for message 'filesize' from server\n");
-    #endif
+  // Only the changed blocks of a file the server already has are sent.
+  if (delta) {
+    int rv = DeltaPut(socket, filename, msgbuffer);
 
-    int bytesRecvd = 0;
-    // Check for message "Server ready to receive file" message from server.
-    ReceiveMessage(socket, msgbuffer);
+    if (rv <= 0) {
+      return rv;
+    }
+  }
 
-    FILE *file;
+  // Large files can be split across several connections.
+  if (streams > 1) {
+    struct stat st;
 
-    if (strcmp(msgbuffer, "filesize") == 0) {
-      file = fopen(filename, "rb");
+    if (stat(filename, &st) == 0 && st.st_size >= 2 * STREAM_MIN_RANGE) {
+      return ParallelTransfer(filename, st.st_size, 1);
+    }
+  }
 
-      #ifdef DEBUG
-      printf("[DEBUG] Received message from server: '%s'\n", msgbuffer);
-      printf("[DEBUG] Server is ready to receive file.\n");
-      #endif
+  double start = Now();
+  compressorInit(&compressor, compressor.codec);
+  TraceStart("put", filename);
+  if ((requestId = SendPutRequest(socket, filename, 0, &filesize)) == 0) {
+    TraceEnd(0);
+    return -1;
+  }
 
-      if (file == NULL) {
-        printf("Unable to open file '%s'\n", filename);
-        return -1;
-      }
+  // Receive a message from server indicating the server has succesfully received the file.
+  if (ReceivePutReply(socket, requestId, msgbuffer) == 0) {
+    TraceMark(&timeline.done);
+    printf("success\n");
+    PrintCompression(Now() - start);
+    TraceEnd(1);
+  } else {
+    printf("%s\n", msgbuffer);
+    TraceEnd(0);
+  }
 
-      fseek(file, 0, SEEK_END);
-      unsigned long filesize = ftell(file);
+  // clear msgbuffer
+  memset(msgbuffer, 0, sizeof(char)*BUFSIZE);
 
-      #ifdef DEBUG
-      printf("[DEBUG] %s has size: %lu\n", filename, filesize);
-      printf("[DEBUG] Sending filesize to server\n");
-      #endif
+  #ifdef DEBUG
+  printf("--== Server received entire file. --==\n");
+  #endif
 
-      // Send file size to server.
-      struct header hdr;
-      hdr.data_length = filesize;
-      if (send(socket, (const char*)(&hdr), sizeof(hdr), 0) < 0) {
-        Die("send() failed.\n");
-      }
+  return 0;
+}
 
-      #ifdef DEBUG
-      printf("[DEBUG] Sent filesize to server\n");
-      printf("[DEBUG] Waiting for server to be ready to receive messages.\n");
-      #endif
+int HandleRequestGet(int socket, char *cmdbuffer, char *msgbuffer) {
+  char *filename = strchr(cmdbuffer, ' ') + 1;
+  uint32_t requestId;
 
-      ReceiveMessage(socket, msgbuffer);
+  // Large files can be split across several connections.
+  if (streams > 1) {
+    int64_t filesize = StatRemote(socket, filename, msgbuffer);
 
-      if (strcmp(msgbuffer, "serverReady") != 0) {
-          printf("Server not ready\n");
-          return -1;
-      }
+    if (filesize >= 2 * STREAM_MIN_RANGE) {
+      return ParallelTransfer(filename, filesize, 0);
+    }
+  }
 
-      #ifdef DEBUG
-      printf("[DEBUG] Server ready to receive messages\n");
-      #endif
+  // Send message "Get <file name>"
+  #ifdef DEBUG
+  printf("[DEBUG] Sending message '%s' to server.\n", cmdbuffer);
+  #endif
 
-      char *buffers = (char*)malloc(sizeof(char)*filesize);
-      rewind(file);
+  double start = Now();
+  compressorInit(&compressor, compressor.codec);
+  TraceStart("get", filename);
+  requestId = SendGetRequest(socket, filename);
+  TraceMark(&timeline.requested);
 
-      // Store read data into buffer.
-      fread(buffers, sizeof(char), filesize, file);
+  #ifdef DEBUG
+  printf("[DEBUG] Sent message '%s' to server.\n", cmdbuffer);
+  printf("[DEBUG] Waiting for filesize from server.\n");
+  #endif
 
-      #ifdef DEBUG
-      printf("[DEBUG] Sending file to server.\n");
-      #endif
+  if (ReceiveGetReply(socket, requestId, filename, msgbuffer) < 0) {
+    TraceEnd(0);
+    return -1;
+  }
+  PrintCompression(Now() - start);
+  TraceEnd(1);
+  return 0;
+}
 
-      int sent = 0, n = 0;
-      while (sent < filesize) {
-        if ((n = send(socket, buffers+sent, filesize-sent, 0)) < 0) {
-          Die("send() failed.");
-        }
+uint32_t SendPutRequest(int socket, const char *filename, int64_t offset, int64_t *size) {
+  FILE *file = fopen(filename, "rb");
 
-        if (n == -1)
-            break;  // ERROR
+  if (file == NULL) {
+    printf("Unable to open file '%s'\n", filename);
+    return 0;
+  }
 
-        sent += n;
-      }
+  fseeko(file, 0, SEEK_END);
+  int64_t filesize = ftello(file);
+  fseeko(file, offset, SEEK_SET);
 
-      #ifdef DEBUG
-      printf("[DEBUG] Sent file to server\n");
-      #endif
+  #ifdef DEBUG
+  printf("[DEBUG] %s has size: %lld\n", filename, (long long)filesize);
+  #endif
 
-      // Clean up data.
-      fclose(file);
-      free(buffers);
+  // The put request carries the size followed by the name, and the
+  // file data goes right behind it without waiting for the server.
+  size_t namelen = strlen(filename);
+  unsigned char request[16 + BUFSIZE];
+  uint32_t requestId = NextRequestId();
 
-      // Receive a message from server indicating the server has succesfully received the file.
-      bytesRecvd = ReceiveMessage(socket, msgbuffer);
+  if (namelen > BUFSIZE) {
+    printf("File name '%s' is too long\n", filename);
+    fclose(file);
+    return 0;
+  }
 
-      // Output result from server
-      printf("%s\n", msgbuffer);
-    } else {
-      printf("Received incorrect message from server. Expected 'filesize' but instead received: '%s'\n", msgbuffer);
-      return -1;
-    }
+  putU64(request, filesize);
+  if (offset > 0) {
+    putU64(request + 8, offset);
+    memcpy(request + 16, filename, namelen);
+    SendFrame(socket, OP_PUT, FLAG_RESUME | TransferFlags(0), requestId, request, 16 + namelen);
   } else {
-    printf("File '%s' does not exist in current directory\n", filename);
-    return -1;
+    memcpy(request + 8, filename, namelen);
+    SendFrame(socket, OP_PUT, TransferFlags(0), requestId, request, 8 + namelen);
   }
-
-  // clear msgbuffer
-  memset(msgbuffer, 0, sizeof(char)*BUFSIZE);
+  TraceMark(&timeline.requested);
 
   #ifdef DEBUG
-  printf("--== Server received entire file. --==\n");
+  printf("[DEBUG] Sending file to server.\n");
   #endif
 
-  return 0;
-}
+  char *buffers = (char*)malloc(sizeof(char)*CHUNKSIZE);
+
+  // Send the file one chunk per DATA frame.
+  int64_t sent = offset;
+  uint32_t crc = 0;
+  struct tuner tuner = { 0, 0 };
+  while (sent < filesize) {
+    double since = TraceClock();
+    size_t chunk = fread(buffers, sizeof(char), CHUNKSIZE, file);
+    if (chunk == 0) {
+      Die("fread() failed.");
+    }
+    TraceDisk(since);
+
+    since = TraceClock();
+    SendDataChunk(socket, requestId, buffers, chunk, &compressor, checksums ? &crc : NULL);
+    TraceNetwork(since);
+    TraceChunk(chunk);
+    sent += chunk;
+    Retune(socket, SO_SNDBUF, &tuner, sent - offset);
+  }
 
-int HandleRequestGet(int socket, char *cmdbuffer, char *msgbuffer) {
-  // Send message "Get <file name>"
   #ifdef DEBUG
-  printf("[DEBUG] Sending message '%s' to server.\n", cmdbuffer);
+  printf("[DEBUG] Sent file to server\n");
   #endif
 
-  // Sending command 'get <file name>'
-  SendMessage(socket,cmdbuffer);
+  // Clean up data.
+  fclose(file);
+  free(buffers);
 
-  #ifdef DEBUG
-  printf("[DEBUG] Sent message '%s' to server.\n", cmdbuffer);
-  printf("[DEBUG] Waiting for filesize from server.\n");
-  #endif
+  *size = filesize;
+  return requestId;
+}
 
+int ReceivePutReply(int socket, uint32_t requestId, char *msgbuffer) {
+  struct frame frame;
+  int opcode = ReceiveReply(socket, &frame, msgbuffer);
 
-  struct header hdr;
-  hdr.data_length = 0;
+  if (frame.requestId != requestId) {
+    printf("Received a reply for the wrong request from the server.\n");
+    exit(1);
+  }
+
+  return (opcode == OP_OK) ? 0 : -1;
+}
+
+uint32_t SendGetRequest(int socket, const char *filename) {
+  uint32_t requestId = NextRequestId();
+
+  // Sending the get request with the file name.
+  SendFrame(socket, OP_GET, TransferFlags(1), requestId, filename, strlen(filename));
+
+  return requestId;
+}
+
+int64_t ReceiveGetReply(int socket, uint32_t requestId, const char *filename, char *msgbuffer) {
+  struct frame frame;
 
   // Receive the size of data from server.
-  if(recv(socket, (const char*)(&hdr), sizeof(hdr), 0) <= 0) {
-    if(errno == 0) {
-      printf("Server is closed, shutting off client.\n");
-      exit(1);
-    }
-    Die("error");
+  if (ReceiveReply(socket, &frame, msgbuffer) != OP_FILE_INFO ||
+      (frame.length != 8 && frame.length != 24)) {
+    printf("File '%s' does not exist on server. Please try again.\n", filename);
+    return -1;
   }
 
-  int filesize = hdr.data_length;
+  if (frame.requestId != requestId) {
+    printf("Received a reply for the wrong request from the server.\n");
+    exit(1);
+  }
 
-  if (filesize == -1) {
-    printf("File does not exist on server. Please try again.\n");
-    return 0;
+  int64_t filesize = getU64((unsigned char *)msgbuffer);
+  int64_t offset = 0;
+  struct tuner tuner = { 0, 0 };
+  double since;
+
+  TraceMark(&timeline.header);
+
+  // A resumed get only sends what follows the part we already have.
+  if (frame.length == 24) {
+    offset = getU64((unsigned char *)msgbuffer + 8);
+    filesize = getU64((unsigned char *)msgbuffer + 16);
   }
 
   #ifdef DEBUG
-  printf("[DEBUG] Received filesize from server: '%s'\n", msgbuffer);
+  printf("[DEBUG] Received filesize from server: %lld\n", (long long)filesize);
   #endif
 
-  // File exists on the server. 
-  // Send a message to the server to begin sending the file.
+  // File exists on the server and its data follows right away.
 
-  int received = 0, n = 0;
+  int64_t received = 0;
+  ssize_t n = 0;
   FILE *file;
-  char *filename = strchr(cmdbuffer, ' ') + 1;
-
-  file = fopen(filename, "w");
 
-  // Resize buffer
-  char *tempBuffer = calloc(sizeof(char), filesize);
-
-  // Tell server we are ready to receive the file
-  if (send(socket, "clientReady", sizeof("clientReady"), 0) < 0) {
-    Die("send() failed");
+  // If the file can't be created the data is still read and dropped.
+  if (offset > 0) {
+    // Keep the verified prefix and drop anything after it.
+    if ((file = fopen(filename, "r+")) != NULL &&
+        (ftruncate(fileno(file), offset) < 0 || fseeko(file, offset, SEEK_SET) < 0)) {
+      fclose(file);
+      file = NULL;
+    }
+  } else {
+    file = fopen(filename, "w");
+  }
+  if (file == NULL) {
+    printf("Unable to create file '%s'\n", filename);
   }
 
-  #ifdef DEBUG
-  printf("[DEBUG] Sending clientReady to the server.\n");
-  #endif
+  // One chunk of the file is held in memory at a time.
+  char *tempBuffer = malloc(sizeof(char)*CHUNKSIZE);
+
+  // With checksums every DATA frame ends with the CRC32C of the file so far.
+  uint64_t frameleft = 0, trailer = checksums ? 4 : 0;
+  uint32_t crc = 0;
+  int corrupt = 0;
 
   while(received < filesize) {
-      if((n = recv(socket, tempBuffer+received, filesize-received, 0)) <= 0) {
-        if(errno == 0) {
+      // Each DATA frame announces how much of the file it carries.
+      if (frameleft == 0) {
+        since = TraceClock();
+        ReceiveFrame(socket, &frame);
+        TraceNetwork(since);
+        if (frame.opcode == OP_DATA && (frame.flags & FLAG_COMPRESS) && compressor.codec) {
+          // A compressed chunk is restored whole.
+          if (frame.length <= 4 + trailer || frame.length > 4 + trailer + compressedBound(CHUNKSIZE)) {
+            printf("Received an unexpected frame from the server.\n");
+            exit(1);
+          }
+          since = TraceClock();
+          ReceiveAll(socket, zbuffer, frame.length);
+          TraceNetwork(since);
+
+          uint32_t raw = getU32(zbuffer);
+          if (raw > CHUNKSIZE || raw > filesize - received ||
+              decompressChunk(compressor.codec, zbuffer + 4, frame.length - 4 - trailer, tempBuffer, raw) < 0) {
+            printf("Received a corrupt chunk from the server.\n");
+            exit(1);
+          }
+          if (checksums) {
+            crc = crc32c(crc, tempBuffer, raw);
+            corrupt |= getU32(zbuffer + frame.length - 4) != crc;
+          }
+          since = TraceClock();
+          if (file != NULL && fwrite(tempBuffer, 1, raw, file) != raw) {
+            Die("fwrite() failed.");
+          }
+          TraceDisk(since);
+          TraceChunk(raw);
+          received += raw;
+          Retune(socket, SO_RCVBUF, &tuner, received);
+          compressor.rawBytes += raw;
+          compressor.wireBytes += frame.length;
+          continue;
+        }
+        if (frame.opcode != OP_DATA || frame.length < trailer ||
+            frame.length - trailer > (uint64_t)(filesize - received)) {
+          printf("Received an unexpected frame from the server.\n");
+          exit(1);
+        }
+        frameleft = frame.length - trailer;
+        if (frameleft == 0 && checksums) {
+          corrupt |= CheckTrailer(socket, crc) != 0;
+        }
+        continue;
+      }
+
+      size_t want = (frameleft < CHUNKSIZE) ? frameleft : CHUNKSIZE;
+      since = TraceClock();
+      if((n = recv(socket, tempBuffer, want, 0)) <= 0) {
+        if(n == 0) {
           printf("Server is closed, shutting off client.\n");
           exit(1);
         }
         Die("error");
       }
+      TraceNetwork(since);
 
-      if(n == -1)
-          break;
+      since = TraceClock();
+      if (file != NULL && fwrite(tempBuffer, 1, n, file) != (size_t)n) {
+        Die("fwrite() failed.");
+      }
+      TraceDisk(since);
+      TraceChunk(n);
       received += n;
+      Retune(socket, SO_RCVBUF, &tuner, received);
+      frameleft -= n;
+      compressor.rawBytes += n;
+      compressor.wireBytes += n;
+
+      if (checksums) {
+        crc = crc32c(crc, tempBuffer, n);
+        if (frameleft == 0) {
+          corrupt |= CheckTrailer(socket, crc) != 0;
+        }
+      }
   }
 
   #ifdef DEBUG
   printf("[DEBUG] Received the file from the server.\n");
   #endif
 
-  fwrite(tempBuffer, 1, sizeof(char)*filesize, file);
-
-  // Clean up data.
-  fclose(file);
+  // Clean up data. A traced get waits for the file to reach the disk, so
+  // its timeline shows what the transfer really cost.
+  if (file != NULL) {
+    since = TraceClock();
+    if (timeline.op != NULL) {
+      fflush(file);
+      fsync(fileno(file));
+    }
+    fclose(file);
+    TraceDisk(since);
+  }
+  TraceMark(&timeline.done);
   free(tempBuffer);
 
+  if (corrupt) {
+    printf("Checksum mismatch receiving '%s'; the file is damaged.\n", filename);
+    return -1;
+  }
+
+  return (file != NULL) ? filesize : -1;
+}
+
+int HandleRequestReget(int socket, char *cmdbuffer, char *msgbuffer) {
+  char *filename = strchr(cmdbuffer, ' ') + 1;
+  size_t namelen = strlen(filename);
+  unsigned char request[12 + BUFSIZE];
+  uint32_t requestId = NextRequestId();
+  uint32_t crc = 0;
+  int64_t have = 0;
+  struct stat st;
+
+  if (namelen > BUFSIZE) {
+    printf("File name '%s' is too long\n", filename);
+    return -1;
+  }
+
+  // The server keeps our prefix only if its copy starts with the same bytes.
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+    have = st.st_size;
+  }
+  if (PrefixChecksum(filename, have, &crc) < 0) {
+    have = 0;
+    crc = 0;
+  }
+
+  putU64(request, have);
+  putU32(request + 8, crc);
+  memcpy(request + 12, filename, namelen);
+  SendFrame(socket, OP_GET, FLAG_RESUME | TransferFlags(1), requestId, request, 12 + namelen);
+
+  int64_t n = ReceiveGetReply(socket, requestId, filename, msgbuffer);
+  if (n < 0) {
+    return -1;
+  }
+
+  // Whatever wasn't sent is the prefix that was kept.
+  if (stat(filename, &st) == 0 && st.st_size - n > 0) {
+    printf("resumed at byte %lld, received %lld bytes\n", (long long)(st.st_size - n), (long long)n);
+  } else {
+    printf("received %lld bytes\n", (long long)n);
+  }
+  return 0;
+}
+
+int HandleRequestReput(int socket, char *cmdbuffer, char *msgbuffer) {
+  char *filename = strchr(cmdbuffer, ' ') + 1;
+  struct frame frame;
+  int64_t filesize = 0, offset = 0;
+  uint32_t requestId, crc;
+
+  if (FileExists(filename) != 0) {
+    printf("File '%s' does not exist in current directory\n", filename);
+    return -1;
+  }
+
+  // Ask how much of the file the server holds and what it hashes to.
+  requestId = NextRequestId();
+  SendFrame(socket, OP_STAT, FLAG_RESUME, requestId, filename, strlen(filename));
+
+  if (ReceiveReply(socket, &frame, msgbuffer) == OP_FILE_INFO && frame.length == 12) {
+    offset = getU64((unsigned char *)msgbuffer);
+    if (PrefixChecksum(filename, offset, &crc) < 0 ||
+        crc != getU32((unsigned char *)msgbuffer + 8)) {
+      // The server's copy isn't a prefix of ours; start over.
+      offset = 0;
+    }
+  }
+
+  if ((requestId = SendPutRequest(socket, filename, offset, &filesize)) == 0) {
+    return -1;
+  }
+
+  if (ReceivePutReply(socket, requestId, msgbuffer) == 0) {
+    if (offset > 0) {
+      printf("resumed at byte %lld, sent %lld bytes\n", (long long)offset, (long long)(filesize - offset));
+    } else {
+      printf("success\n");
+    }
+  } else {
+    printf("%s\n", msgbuffer);
+  }
+
+  memset(msgbuffer, 0, sizeof(char)*BUFSIZE);
   return 0;
 }
+
+int PrefixChecksum(const char *filename, int64_t length, uint32_t *crc) {
+  FILE *file = fopen(filename, "rb");
+
+  if (file == NULL) {
+    return -1;
+  }
+
+  char *buffer = malloc(CHUNKSIZE);
+  int64_t done = 0;
+
+  *crc = 0;
+  while (done < length) {
+    size_t want = (length - done < CHUNKSIZE) ? length - done : CHUNKSIZE;
+    size_t n = fread(buffer, 1, want, file);
+
+    if (n == 0) {
+      break;
+    }
+    *crc = crc32c(*crc, buffer, n);
+    done += n;
+  }
+
+  fclose(file);
+  free(buffer);
+  return (done == length) ? 0 : -1;
+}
+
+int DeltaPut(int socket, const char *filename, char *msgbuffer) {
+  struct delta d;
+  struct frame frame;
+  uint64_t i;
+
+  memset(&d, 0, sizeof(d));
+  d.socket = socket;
+
+  // Fetch the signatures of the server's blocks.
+  SendFrame(socket, OP_SIGNATURES, 0, NextRequestId(), filename, strlen(filename));
+  if (ReceiveReply(socket, &frame, msgbuffer) != OP_SIG_INFO || frame.length != 20) {
+    return 1;
+  }
+  d.blockSize = getU32((unsigned char *)msgbuffer + 8);
+  d.blocks = getU64((unsigned char *)msgbuffer + 12);
+  d.wire = FRAME_HEADER_SIZE * 2 + strlen(filename) + frame.length;
+
+  if (d.blockSize == 0 || d.blocks > (uint64_t)getU64((unsigned char *)msgbuffer) / d.blockSize) {
+    printf("Received bad block signatures from the server.\n");
+    exit(1);
+  }
+
+  unsigned char *records = malloc(d.blocks * SIG_RECORD_SIZE + 1);
+  uint64_t have = 0;
+
+  while (have < d.blocks * SIG_RECORD_SIZE) {
+    ReceiveFrame(socket, &frame);
+    if (frame.opcode != OP_DATA || frame.length > d.blocks * SIG_RECORD_SIZE - have) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+    ReceiveAll(socket, records + have, frame.length);
+    have += frame.length;
+    d.wire += FRAME_HEADER_SIZE + frame.length;
+  }
+
+  // Index the blocks by their rolling checksum.
+  for (d.mask = 1; d.mask < d.blocks * 2; d.mask <<= 1);
+  d.mask--;
+  d.weak = malloc(sizeof(uint32_t) * (d.blocks + 1));
+  d.strong = malloc(sizeof(uint64_t) * (d.blocks + 1));
+  d.next = malloc(sizeof(int64_t) * (d.blocks + 1));
+  d.buckets = malloc(sizeof(int64_t) * (d.mask + 1));
+  memset(d.buckets, 0xff, sizeof(int64_t) * (d.mask + 1));
+
+  for (i = 0; i < d.blocks; i++) {
+    d.weak[i] = getU32(records + i * SIG_RECORD_SIZE);
+    d.strong[i] = getU64(records + i * SIG_RECORD_SIZE + 4);
+    d.next[i] = d.buckets[d.weak[i] & d.mask];
+    d.buckets[d.weak[i] & d.mask] = i;
+  }
+  free(records);
+
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    printf("Unable to open file '%s'\n", filename);
+    return -1;
+  }
+
+  fseeko(file, 0, SEEK_END);
+  int64_t filesize = ftello(file);
+  rewind(file);
+
+  // The put names the block size the COPY frames refer to.
+  size_t namelen = strlen(filename);
+  unsigned char request[12 + BUFSIZE];
+
+  putU64(request, filesize);
+  putU32(request + 8, d.blockSize);
+  memcpy(request + 12, filename, namelen);
+  d.requestId = NextRequestId();
+  SendFrame(socket, OP_PUT, FLAG_DELTA, d.requestId, request, 12 + namelen);
+  d.wire += FRAME_HEADER_SIZE + 12 + namelen;
+
+  // Slide a block sized window over the file. Wherever it matches one of
+  // the server's blocks, the bytes before it go out as they are and the
+  // block as a reference; otherwise the window moves on by one byte.
+  size_t capacity = DELTA_WINDOW + d.blockSize;
+  char *buffer = malloc(capacity);
+  size_t len = 0, pos = 0, lit = 0;
+  uint32_t weak = 0;
+  int eof = 0, haveWeak = 0;
+  int64_t match;
+
+  while (1) {
+    if (len - pos < d.blockSize && !eof) {
+      DeltaLiteral(&d, buffer + lit, pos - lit);
+      memmove(buffer, buffer + pos, len - pos);
+      len -= pos;
+      pos = lit = 0;
+      haveWeak = 0;
+
+      size_t n = fread(buffer + len, 1, capacity - len, file);
+      if (n == 0) {
+        eof = 1;
+      }
+      len += n;
+      continue;
+    }
+    if (len - pos < d.blockSize || d.blocks == 0) {
+      break;
+    }
+
+    if (!haveWeak) {
+      weak = rollingChecksum(buffer + pos, d.blockSize);
+      haveWeak = 1;
+    }
+
+    if ((match = DeltaMatch(&d, weak, buffer + pos)) >= 0) {
+      DeltaLiteral(&d, buffer + lit, pos - lit);
+      DeltaCopy(&d, match);
+      pos += d.blockSize;
+      lit = pos;
+      haveWeak = 0;
+      continue;
+    }
+
+    if (pos + d.blockSize < len) {
+      weak = rollingUpdate(weak, buffer[pos], buffer[pos + d.blockSize], d.blockSize);
+    } else {
+      haveWeak = 0;
+    }
+    pos++;
+  }
+
+  // Whatever is left after the last match goes out as it is.
+  DeltaLiteral(&d, buffer + lit, len - lit);
+  while (!eof) {
+    if ((len = fread(buffer, 1, capacity, file)) == 0) {
+      break;
+    }
+    DeltaLiteral(&d, buffer, len);
+  }
+  DeltaFlushRun(&d);
+
+  fclose(file);
+  free(buffer);
+  free(d.weak);
+  free(d.strong);
+  free(d.next);
+  free(d.buckets);
+
+  int rv = ReceivePutReply(socket, d.requestId, msgbuffer);
+  d.wire += FRAME_HEADER_SIZE;
+
+  if (rv == 0) {
+    printf("success\n");
+    printf("delta: %lld bytes reused, %lld bytes sent as is, %lld bytes on the wire for %lld (%.2f%%)\n",
+           (long long)d.matched, (long long)d.literal, (long long)d.wire, (long long)filesize,
+           filesize > 0 ? 100.0 * d.wire / filesize : 0.0);
+  } else {
+    printf("%s\n", msgbuffer);
+  }
+
+  memset(msgbuffer, 0, sizeof(char)*BUFSIZE);
+  return (rv == 0) ? 0 : -1;
+}
+
+void DeltaLiteral(struct delta *d, const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  DeltaFlushRun(d);
+
+  while (len > 0) {
+    size_t chunk = (len < CHUNKSIZE) ? len : CHUNKSIZE;
+
+    d->wire += SendDataChunk(d->socket, d->requestId, data, chunk, &compressor, NULL);
+    d->literal += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+}
+
+void DeltaCopy(struct delta *d, uint32_t block) {
+  if (d->runCount > 0 && block == d->runFirst + d->runCount &&
+      (int64_t)(d->runCount + 1) * d->blockSize <= DELTA_MAX_RUN) {
+    d->runCount++;
+  } else {
+    DeltaFlushRun(d);
+    d->runFirst = block;
+    d->runCount = 1;
+  }
+  d->matched += d->blockSize;
+}
+
+void DeltaFlushRun(struct delta *d) {
+  unsigned char copy[8];
+
+  if (d->runCount == 0) {
+    return;
+  }
+  putU32(copy, d->runFirst);
+  putU32(copy + 4, d->runCount);
+  SendFrame(d->socket, OP_COPY, 0, d->requestId, copy, sizeof(copy));
+  d->wire += FRAME_HEADER_SIZE + sizeof(copy);
+  d->runCount = 0;
+}
+
+int64_t DeltaMatch(struct delta *d, uint32_t weak, const char *data) {
+  int64_t i = d->buckets[weak & d->mask];
+  int hashed = 0;
+  uint64_t strong = 0;
+
+  // The block following the last match is the likeliest one.
+  if (d->runCount > 0 && d->runFirst + d->runCount < d->blocks) {
+    int64_t expect = d->runFirst + d->runCount;
+
+    if (d->weak[expect] == weak) {
+      strong = xxh64(data, d->blockSize, 0);
+      hashed = 1;
+      if (d->strong[expect] == strong) {
+        return expect;
+      }
+    }
+  }
+
+  for (; i >= 0; i = d->next[i]) {
+    if (d->weak[i] != weak) {
+      continue;
+    }
+    if (!hashed) {
+      strong = xxh64(data, d->blockSize, 0);
+      hashed = 1;
+    }
+    if (d->strong[i] == strong) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int HandleRequestMget(int socket, char *cmdbuffer, char *msgbuffer) {
+  char **names = NULL;
+  int count = 0;
+
+  if (ExpandRemoteNames(socket, cmdbuffer, &names, &count) < 0 || count == 0) {
+    printf("No matching files on server.\n");
+    free(names);
+    return -1;
+  }
+
+  uint32_t *requestIds = malloc(sizeof(uint32_t)*count);
+  int next = 0, done = 0, failed = 0;
+  int64_t bytes = 0, n = 0;
+  double start = Now();
+  compressorInit(&compressor, compressor.codec);
+
+  // Keep up to window gets in flight; the server answers them in order.
+  while (done < count) {
+    while (next < count && next - done < window) {
+      requestIds[next] = SendGetRequest(socket, names[next]);
+      next++;
+    }
+
+    if ((n = ReceiveGetReply(socket, requestIds[done], names[done], msgbuffer)) < 0) {
+      failed++;
+    } else {
+      bytes += n;
+    }
+    done++;
+  }
+
+  PrintBatchSummary("mget", count, failed, bytes, Now() - start);
+  PrintCompression(Now() - start);
+
+  FreeNames(names, count);
+  free(requestIds);
+  return failed ? -1 : 0;
+}
+
+int HandleRequestMput(int socket, char *cmdbuffer, char *msgbuffer) {
+  char **names = NULL;
+  int count = 0;
+
+  if (ExpandLocalNames(cmdbuffer, &names, &count) < 0 || count == 0) {
+    printf("No matching files in current directory.\n");
+    free(names);
+    return -1;
+  }
+
+  uint32_t *requestIds = malloc(sizeof(uint32_t)*count);
+  int next = 0, done = 0, failed = 0;
+  int64_t bytes = 0, n = 0;
+  double start = Now();
+  compressorInit(&compressor, compressor.codec);
+
+  // Keep up to window puts in flight; a file that couldn't be read has
+  // request id 0 and no reply to wait for.
+  while (done < count) {
+    while (next < count && next - done < window) {
+      requestIds[next] = SendPutRequest(socket, names[next], 0, &n);
+      if (requestIds[next] != 0) {
+        bytes += n;
+      }
+      next++;
+    }
+
+    if (requestIds[done] == 0 || ReceivePutReply(socket, requestIds[done], msgbuffer) < 0) {
+      if (requestIds[done] != 0) {
+        printf("%s: %s\n", names[done], msgbuffer);
+      }
+      failed++;
+    }
+    done++;
+  }
+
+  PrintBatchSummary("mput", count, failed, bytes, Now() - start);
+  PrintCompression(Now() - start);
+
+  FreeNames(names, count);
+  free(requestIds);
+  return failed ? -1 : 0;
+}
+
+int HandleRequestGetTree(int socket, char *cmdbuffer) {
+  char *dirname = strrchr(cmdbuffer, ' ') + 1;
+  const char *local = TreeName(dirname);
+  unsigned char entry[FRAME_MAX_CONTROL + 1];
+  unsigned char *batch = NULL;
+  struct treebuffer in = { socket, NULL, 0, 0 };
+  struct frame frame;
+  uint32_t requestId = NextRequestId();
+  int count = 0, failed = 0, created, rootfd, fd;
+  int64_t bytes = 0, size;
+  double start = Now();
+
+  // The tree lands in a local directory named like the remote one.
+  created = mkdir(local, 0777) == 0;
+  if ((!created && errno != EEXIST) || (rootfd = open(local, O_RDONLY | O_DIRECTORY)) < 0) {
+    printf("Unable to create directory '%s'\n", local);
+    return -1;
+  }
+
+  in.data = malloc(TREE_BUFFER);
+  char *chunk = malloc(CHUNKSIZE);
+  if (batching) {
+    // A compressed frame, and room to restore it.
+    batch = malloc(4 + 2 * BATCH_MAX);
+  }
+  compressorInit(&compressor, compressor.codec);
+  SendFrame(socket, OP_GET, FLAG_TREE | (batching ? FLAG_BATCH : 0) | TransferFlags(1), requestId,
+            dirname, strlen(dirname));
+
+  // Entries come parents first, so each one is created as it arrives.
+  for (;;) {
+    TreeReadFrame(&in, requestId, &frame);
+    if (frame.opcode == OP_BATCH && batch != NULL) {
+      failed += ReceiveTreeBatch(&in, &frame, rootfd, batch, &count, &bytes);
+      continue;
+    }
+    if (frame.opcode != OP_ENTRY) {
+      break;
+    }
+    if (frame.length <= TREE_HEADER || frame.length > FRAME_MAX_CONTROL) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+    TreeRead(&in, entry, frame.length);
+    entry[frame.length] = '\0';
+
+    char *path = (char *)entry + TREE_HEADER;
+    mode_t mode = getU32(entry + 1) & 07777;
+    size = getU64(entry + 5);
+    if ((entry[0] != 'd' && entry[0] != '-') || size < 0) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+    count++;
+
+    // An entry that would land outside the tree is refused; its data is dropped.
+    int safe = strlen(path) == frame.length - TREE_HEADER && TreePathSafe(path);
+
+    if (entry[0] == 'd') {
+      if (!safe || (mkdirat(rootfd, path, mode | 0700) < 0 && errno != EEXIST)) {
+        printf("Unable to create directory '%s'\n", path);
+        failed++;
+      }
+      continue;
+    }
+
+    fd = safe ? openat(rootfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode) : -1;
+    if (fd < 0) {
+      printf("Unable to create file '%s'\n", path);
+    }
+    if (ReceiveTreeFile(&in, requestId, fd, size, path, chunk) == 0) {
+      bytes += size;
+    } else {
+      failed++;
+    }
+    if (fd >= 0) {
+      struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)getU64(entry + 13), 0 } };
+
+      futimens(fd, times);
+      close(fd);
+    }
+  }
+
+  // The stream ends with the server's own count of entries it couldn't read.
+  if (frame.length > FRAME_MAX_CONTROL) {
+    printf("Received an unexpected frame from the server.\n");
+    exit(1);
+  }
+  TreeRead(&in, entry, frame.length);
+  if (frame.opcode == OP_OK && frame.length == 16) {
+    failed += getU64(entry + 8);
+  } else {
+    entry[frame.length] = '\0';
+    printf("%s\n", (char *)entry);
+    failed++;
+    if (count == 0 && created) {
+      rmdir(local);
+    }
+  }
+
+  PrintBatchSummary("get -r", count, failed, bytes, Now() - start);
+  PrintCompression(Now() - start);
+
+  close(rootfd);
+  free(in.data);
+  free(chunk);
+  free(batch);
+  return failed ? -1 : 0;
+}
+
+int HandleRequestPutTree(int socket, char *cmdbuffer, char *msgbuffer) {
+  char *dirname = strrchr(cmdbuffer, ' ') + 1;
+  const char *remote = TreeName(dirname);
+  unsigned char header[FRAME_HEADER_SIZE];
+  struct frame frame;
+  struct treeput *tp;
+  int fd;
+  double start = Now();
+
+  if ((fd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+    printf("Directory '%s' does not exist\n", dirname);
+    return -1;
+  }
+
+  tp = calloc(1, sizeof(*tp));
+  tp->out.socket = socket;
+  tp->out.data = malloc(TREE_BUFFER);
+  tp->chunk = malloc(CHUNKSIZE);
+  if (batching) {
+    tp->index = malloc(BATCH_MAX);
+    tp->data = malloc(BATCH_MAX);
+    tp->raw = malloc(BATCH_MAX);
+  }
+  tp->requestId = NextRequestId();
+  compressorInit(&compressor, compressor.codec);
+
+  // The request and every entry go out back to back; the server answers
+  // once, after the empty ENTRY that ends the tree.
+  frameBuild(header, OP_PUT, FLAG_TREE | TransferFlags(0), tp->requestId, strlen(remote));
+  TreeWrite(&tp->out, header, sizeof(header));
+  TreeWrite(&tp->out, remote, strlen(remote));
+  SendTreeDirectory(tp, fd, 0);
+  SendTreeBatch(tp);
+  frameBuild(header, OP_ENTRY, 0, tp->requestId, 0);
+  TreeWrite(&tp->out, header, sizeof(header));
+  TreeFlush(&tp->out);
+
+  if (ReceiveReply(socket, &frame, msgbuffer) == OP_OK && frame.length == 16) {
+    tp->failed += getU64((unsigned char *)msgbuffer + 8);
+  } else {
+    printf("%s\n", msgbuffer);
+    tp->failed++;
+  }
+  if (frame.requestId != tp->requestId) {
+    printf("Received a reply for the wrong request from the server.\n");
+    exit(1);
+  }
+
+  PrintBatchSummary("put -r", tp->count, tp->failed, tp->bytes, Now() - start);
+  PrintCompression(Now() - start);
+
+  int rv = tp->failed ? -1 : 0;
+  free(tp->out.data);
+  free(tp->chunk);
+  free(tp->index);
+  free(tp->data);
+  free(tp->raw);
+  free(tp);
+  return rv;
+}
+
+const char *TreeName(char *path) {
+  size_t len = strlen(path);
+  char *name;
+
+  while (len > 1 && path[len - 1] == '/') {
+    path[--len] = '\0';
+  }
+  name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  if (*name == '\0' || strcmp(name, "..") == 0) {
+    return ".";
+  }
+  return name;
+}
+
+int TreePathSafe(const char *path) {
+  const char *p = path, *end;
+
+  if (*path == '\0' || *path == '/') {
+    return 0;
+  }
+  for (; *p; p = *end ? end + 1 : end) {
+    end = strchr(p, '/');
+    if (end == NULL) {
+      end = p + strlen(p);
+    }
+    if (end - p == 2 && p[0] == '.' && p[1] == '.') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int ReceiveTreeFile(struct treebuffer *in, uint32_t requestId, int fd, int64_t size, const char *path, char *chunk) {
+  struct frame frame;
+  uint64_t trailer = checksums ? 4 : 0, left;
+  unsigned char check[4];
+  int64_t received = 0;
+  uint32_t crc = 0, raw;
+  int corrupt = 0, failed = (fd < 0);
+  size_t n;
+
+  while (received < size) {
+    TreeReadFrame(in, requestId, &frame);
+
+    // A compressed chunk is restored whole.
+    if (frame.opcode == OP_DATA && (frame.flags & FLAG_COMPRESS) && compressor.codec) {
+      if (frame.length <= 4 + trailer || frame.length > 4 + trailer + compressedBound(CHUNKSIZE)) {
+        printf("Received an unexpected frame from the server.\n");
+        exit(1);
+      }
+      TreeRead(in, zbuffer, frame.length);
+
+      raw = getU32(zbuffer);
+      if (raw > CHUNKSIZE || raw > size - received ||
+          decompressChunk(compressor.codec, zbuffer + 4, frame.length - 4 - trailer, chunk, raw) < 0) {
+        printf("Received a corrupt chunk from the server.\n");
+        exit(1);
+      }
+      if (checksums) {
+        crc = crc32c(crc, chunk, raw);
+        corrupt |= getU32(zbuffer + frame.length - 4) != crc;
+      }
+      if (!failed && write(fd, chunk, raw) != (ssize_t)raw) {
+        failed = 1;
+      }
+      received += raw;
+      compressor.rawBytes += raw;
+      compressor.wireBytes += frame.length;
+      continue;
+    }
+    if (frame.opcode != OP_DATA || frame.length < trailer ||
+        frame.length - trailer > (uint64_t)(size - received)) {
+      printf("Received an unexpected frame from the server.\n");
+      exit(1);
+    }
+
+    // Plain data is written straight out of the buffer.
+    for (left = frame.length - trailer; left > 0; left -= n) {
+      if (in->start == in->end) {
+        TreeFill(in);
+      }
+      n = (left < in->end - in->start) ? left : in->end - in->start;
+      if (checksums) {
+        crc = crc32c(crc, in->data + in->start, n);
+      }
+      if (!failed && write(fd, in->data + in->start, n) != (ssize_t)n) {
+        failed = 1;
+      }
+      in->start += n;
+      received += n;
+      compressor.rawBytes += n;
+      compressor.wireBytes += n;
+    }
+    if (checksums) {
+      TreeRead(in, check, sizeof(check));
+      corrupt |= getU32(check) != crc;
+    }
+  }
+
+  if (corrupt) {
+    printf("Checksum mismatch receiving '%s'; the file is damaged.\n", path);
+    return -1;
+  }
+  return failed ? -1 : 0;
+}
+
+int ReceiveTreeBatch(struct treebuffer *in, const struct frame *frame, int rootfd, unsigned char *batch,
+                     int *count, int64_t *bytes) {
+  unsigned char *payload = batch;
+  uint64_t len = frame->length, crcLen = checksums ? 4 : 0, rec, pos, size, pathLen;
+  char path[FRAME_MAX_CONTROL + 1];
+  int files, i, fd, failed = 0;
+
+  if (len > 4 + BATCH_MAX) {
+    printf("Received an unexpected frame from the server.\n");
+    exit(1);
+  }
+  TreeRead(in, batch, len);
+  compressor.wireBytes += len;
+  if (frame->flags & FLAG_COMPRESS) {
+    payload = batch + 4 + BATCH_MAX;
+    if (len <= 4 || getU32(batch) > BATCH_MAX ||
+        decompressChunk(compressor.codec, batch + 4, len - 4, payload, getU32(batch)) < 0) {
+      printf("Received a corrupt chunk from the server.\n");
+      exit(1);
+    }
+    len = getU32(batch);
+  }
+  compressor.rawBytes += len;
+
+  // The index has to describe the frame exactly before anything is created.
+  files = (len >= 2) ? (payload[0] << 8 | payload[1]) : -1;
+  for (i = 0, pos = 2, size = 0; i < files; i++) {
+    if (pos + BATCH_RECORD + crcLen > len || getU64(payload + pos + 4) > len) {
+      break;
+    }
+    // A path has to fit an ENTRY frame, as it would without the batch.
+    pathLen = payload[pos + 20 + crcLen] << 8 | payload[pos + 21 + crcLen];
+    if (pathLen > FRAME_MAX_CONTROL - TREE_HEADER) {
+      break;
+    }
+    size += getU64(payload + pos + 4);
+    pos += BATCH_RECORD + crcLen + pathLen;
+  }
+  if (files < 0 || i < files || pos > len || size != len - pos) {
+    printf("Received an unexpected frame from the server.\n");
+    exit(1);
+  }
+
+  for (i = 0, rec = 2; i < files; i++) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)getU64(payload + rec + 12), 0 } };
+
+    size = getU64(payload + rec + 4);
+    pathLen = payload[rec + 20 + crcLen] << 8 | payload[rec + 21 + crcLen];
+    memcpy(path, payload + rec + BATCH_RECORD + crcLen, pathLen);
+    path[pathLen] = '\0';
+    (*count)++;
+
+    if (strlen(path) != pathLen || !TreePathSafe(path) ||
+        (fd = openat(rootfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, getU32(payload + rec) & 07777)) < 0) {
+      printf("Unable to create file '%s'\n", path);
+      failed++;
+    } else if (checksums && crc32c(0, payload + pos, size) != getU32(payload + rec + 20)) {
+      printf("Checksum mismatch receiving '%s'; the file is damaged.\n", path);
+      failed++;
+      close(fd);
+    } else {
+      if (write(fd, payload + pos, size) == (ssize_t)size) {
+        *bytes += size;
+      } else {
+        failed++;
+      }
+      futimens(fd, times);
+      close(fd);
+    }
+    rec += BATCH_RECORD + crcLen + pathLen;
+    pos += size;
+  }
+  return failed;
+}
+
+void SendTreeDirectory(struct treeput *tp, int dirfd, size_t len) {
+  DIR *dir = fdopendir(dirfd);
+  struct dirent *d;
+  struct stat st;
+  size_t n;
+  int fd;
+
+  if (dir == NULL) {
+    printf("Unable to read directory '%s'\n", len ? tp->path : ".");
+    close(dirfd);
+    tp->failed++;
+    return;
+  }
+
+  while ((d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+      continue;
+    }
+    // Symlinks and special files are left out.
+    if (d->d_type != DT_REG && d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) {
+      continue;
+    }
+
+    n = len + (len > 0) + strlen(d->d_name);
+    if (n > FRAME_MAX_CONTROL - TREE_HEADER) {
+      printf("Path of '%s' is too long\n", d->d_name);
+      tp->failed++;
+      continue;
+    }
+    if (len > 0) {
+      tp->path[len] = '/';
+    }
+    strcpy(tp->path + len + (len > 0), d->d_name);
+
+    if ((fd = openat(dirfd, d->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) < 0 || fstat(fd, &st) < 0) {
+      if (errno != ELOOP) {
+        printf("Unable to read '%s'\n", tp->path);
+        tp->failed++;
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      SendTreeEntry(tp, 'd', &st, n);
+      SendTreeDirectory(tp, fd, n);
+    } else if (S_ISREG(st.st_mode) && batching && st.st_size <= TREE_SMALL) {
+      AddToBatch(tp, fd, &st, n);
+      close(fd);
+    } else if (S_ISREG(st.st_mode)) {
+      SendTreeEntry(tp, '-', &st, n);
+      SendTreeFile(tp, fd, st.st_size);
+      close(fd);
+    } else {
+      close(fd);
+    }
+  }
+  closedir(dir);
+}
+
+void SendTreeEntry(struct treeput *tp, char type, const struct stat *st, size_t len) {
+  unsigned char header[FRAME_HEADER_SIZE + TREE_HEADER];
+
+  frameBuild(header, OP_ENTRY, 0, tp->requestId, TREE_HEADER + len);
+  header[FRAME_HEADER_SIZE] = type;
+  putU32(header + FRAME_HEADER_SIZE + 1, st->st_mode & 07777);
+  putU64(header + FRAME_HEADER_SIZE + 5, (type == '-') ? st->st_size : 0);
+  putU64(header + FRAME_HEADER_SIZE + 13, st->st_mtime);
+  TreeWrite(&tp->out, header, sizeof(header));
+  TreeWrite(&tp->out, tp->path, len);
+  tp->count++;
+}
+
+void SendTreeFile(struct treeput *tp, int fd, int64_t size) {
+  int64_t sent = 0;
+  uint32_t crc = 0;
+  size_t want;
+  ssize_t n;
+  int shrank = 0;
+
+  while (sent < size) {
+    want = (size - sent < CHUNKSIZE) ? size - sent : CHUNKSIZE;
+    if ((n = read(fd, tp->chunk, want)) <= 0) {
+      // The server expects the size in the ENTRY, so the rest goes out as zeros.
+      if (!shrank) {
+        printf("File '%s' shrank while it was sent\n", tp->path);
+        tp->failed++;
+        shrank = 1;
+      }
+      memset(tp->chunk, 0, want);
+      n = want;
+    }
+    TreeSendData(tp, tp->chunk, n, checksums ? &crc : NULL);
+    sent += n;
+  }
+  tp->bytes += size;
+}
+
+void AddToBatch(struct treeput *tp, int fd, const struct stat *st, size_t len) {
+  size_t size = st->st_size, crcLen = checksums ? 4 : 0, got;
+  unsigned char *rec;
+  ssize_t n;
+
+  if (tp->batched == BATCH_FILES ||
+      2 + tp->indexLen + BATCH_RECORD + crcLen + len + tp->dataLen + size > BATCH_MAX) {
+    SendTreeBatch(tp);
+  }
+
+  for (got = 0; got < size; got += n) {
+    if ((n = read(fd, tp->data + tp->dataLen + got, size - got)) <= 0) {
+      // The index promises size bytes, so the rest goes out as zeros.
+      printf("File '%s' shrank while it was sent\n", tp->path);
+      tp->failed++;
+      memset(tp->data + tp->dataLen + got, 0, size - got);
+      break;
+    }
+  }
+
+  rec = tp->index + tp->indexLen;
+  putU32(rec, st->st_mode & 07777);
+  putU64(rec + 4, size);
+  putU64(rec + 12, st->st_mtime);
+  if (checksums) {
+    putU32(rec + 20, crc32c(0, tp->data + tp->dataLen, size));
+  }
+  rec[20 + crcLen] = len >> 8;
+  rec[21 + crcLen] = len;
+  memcpy(rec + BATCH_RECORD + crcLen, tp->path, len);
+  tp->indexLen += BATCH_RECORD + crcLen + len;
+  tp->dataLen += size;
+  tp->batched++;
+  tp->count++;
+  tp->bytes += size;
+}
+
+void SendTreeBatch(struct treeput *tp) {
+  unsigned char header[FRAME_HEADER_SIZE + 2];
+  size_t len = 2 + tp->indexLen + tp->dataLen, packed = 0;
+
+  if (tp->batched == 0) {
+    return;
+  }
+  header[FRAME_HEADER_SIZE] = tp->batched >> 8;
+  header[FRAME_HEADER_SIZE + 1] = tp->batched;
+
+  if (compressor.codec != CODEC_NONE) {
+    // Compression wants the frame in one piece.
+    memcpy(tp->raw, header + FRAME_HEADER_SIZE, 2);
+    memcpy(tp->raw + 2, tp->index, tp->indexLen);
+    memcpy(tp->raw + 2 + tp->indexLen, tp->data, tp->dataLen);
+    packed = compressChunk(&compressor, tp->raw, len, zbuffer + 4, compressedBound(CHUNKSIZE));
+    if (packed > 0) {
+      putU32(zbuffer, len);
+      frameBuild(header, OP_BATCH, FLAG_COMPRESS, tp->requestId, 4 + packed);
+      TreeWrite(&tp->out, header, FRAME_HEADER_SIZE);
+      TreeWrite(&tp->out, zbuffer, 4 + packed);
+    } else {
+      frameBuild(header, OP_BATCH, 0, tp->requestId, len);
+      TreeWrite(&tp->out, header, FRAME_HEADER_SIZE);
+      TreeWrite(&tp->out, tp->raw, len);
+    }
+  } else {
+    // Otherwise the pieces go out where they lie, behind what is buffered, in one writev.
+    struct iovec iov[4] = {
+      { tp->out.data, tp->out.end },
+      { header, sizeof(header) },
+      { tp->index, tp->indexLen },
+      { tp->data, tp->dataLen },
+    };
+
+    frameBuild(header, OP_BATCH, 0, tp->requestId, len);
+    SendAllV(tp->out.socket, iov, 4);
+    tp->out.end = 0;
+  }
+  tp->batched = 0;
+  tp->indexLen = tp->dataLen = 0;
+}
+
+void TreeSendData(struct treeput *tp, const char *data, size_t len, uint32_t *crc) {
+  unsigned char header[FRAME_HEADER_SIZE], trailer[4];
+  size_t packed = 0, extra = crc ? 4 : 0;
+
+  if (crc != NULL) {
+    *crc = crc32c(*crc, data, len);
+    putU32(trailer, *crc);
+  }
+
+  if (compressor.codec != CODEC_NONE) {
+    packed = compressChunk(&compressor, data, len, zbuffer + 4, compressedBound(CHUNKSIZE));
+  }
+
+  if (packed > 0) {
+    putU32(zbuffer, len);
+    frameBuild(header, OP_DATA, FLAG_COMPRESS, tp->requestId, 4 + packed + extra);
+    TreeWrite(&tp->out, header, sizeof(header));
+    TreeWrite(&tp->out, zbuffer, 4 + packed);
+  } else {
+    frameBuild(header, OP_DATA, 0, tp->requestId, len + extra);
+    TreeWrite(&tp->out, header, sizeof(header));
+    TreeWrite(&tp->out, data, len);
+  }
+  TreeWrite(&tp->out, trailer, extra);
+}
+
+void TreeWrite(struct treebuffer *out, const void *data, size_t len) {
+  if (out->end + len > TREE_BUFFER) {
+    TreeFlush(out);
+  }
+  if (len > TREE_BUFFER) {
+    SendAll(out->socket, data, len);
+    return;
+  }
+  memcpy(out->data + out->end, data, len);
+  out->end += len;
+}
+
+void TreeFlush(struct treebuffer *out) {
+  SendAll(out->socket, out->data, out->end);
+  out->end = 0;
+}
+
+void TreeRead(struct treebuffer *in, void *buffer, size_t len) {
+  size_t n;
+
+  while (len > 0) {
+    if (in->start == in->end) {
+      TreeFill(in);
+    }
+    n = (len < in->end - in->start) ? len : in->end - in->start;
+    memcpy(buffer, in->data + in->start, n);
+    buffer = (char *)buffer + n;
+    in->start += n;
+    len -= n;
+  }
+}
+
+void TreeFill(struct treebuffer *in) {
+  ssize_t n;
+
+  in->start = in->end = 0;
+  if ((n = recv(in->socket, in->data, TREE_BUFFER, 0)) <= 0) {
+    if (n == 0) {
+      printf("Server is closed, shutting off client.\n");
+      exit(1);
+    }
+    Die("recv() failed.");
+  }
+  in->end = n;
+}
+
+void TreeReadFrame(struct treebuffer *in, uint32_t requestId, struct frame *frame) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  struct frame_parser parser;
+  size_t used;
+
+  TreeRead(in, header, sizeof(header));
+  frameParserReset(&parser);
+  if (frameParseHeader(&parser, header, sizeof(header), &used) <= 0) {
+    printf("Received a malformed frame from the server.\n");
+    exit(1);
+  }
+  *frame = parser.frame;
+
+  if (frame->requestId != requestId) {
+    printf("Received a reply for the wrong request from the server.\n");
+    exit(1);
+  }
+}
+
+int ExpandRemoteNames(int socket, char *cmdbuffer, char ***names, int *count) {
+  char args[BUFSIZE];
+  char *listing = NULL;
+  char *token, *saveptr;
+  int capacity = 16;
+
+  strcpy(args, strchr(cmdbuffer, ' ') + 1);
+  *names = malloc(sizeof(char *)*capacity);
+  *count = 0;
+
+  for (token = strtok_r(args, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+    // Plain names are taken as given.
+    if (strpbrk(token, "*?[") == NULL) {
+      AddName(names, count, &capacity, token);
+      continue;
+    }
+
+    // Patterns are matched against the server's listing, fetched once.
+    if (listing == NULL && (listing = FetchListing(socket)) == NULL) {
+      return -1;
+    }
+
+    char *line = listing;
+    while (*line) {
+      char *end = strchr(line, '\n');
+      if (end) {
+        *end = '\0';
+      }
+      if (*line && fnmatch(token, line, 0) == 0) {
+        AddName(names, count, &capacity, line);
+      }
+      if (end == NULL) {
+        break;
+      }
+      *end = '\n';
+      line = end + 1;
+    }
+  }
+
+  free(listing);
+  return 0;
+}
+
+int ExpandLocalNames(char *cmdbuffer, char ***names, int *count) {
+  char args[BUFSIZE];
+  char *token, *saveptr;
+  int capacity = 16;
+  size_t i;
+  glob_t matches;
+  struct stat st;
+
+  strcpy(args, strchr(cmdbuffer, ' ') + 1);
+  *names = malloc(sizeof(char *)*capacity);
+  *count = 0;
+
+  for (token = strtok_r(args, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+    if (glob(token, GLOB_NOCHECK, NULL, &matches) != 0) {
+      continue;
+    }
+
+    // Only regular files can be put.
+    for (i = 0; i < matches.gl_pathc; i++) {
+      if (stat(matches.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+        AddName(names, count, &capacity, matches.gl_pathv[i]);
+      } else {
+        printf("File '%s' does not exist in current directory\n", matches.gl_pathv[i]);
+      }
+    }
+    globfree(&matches);
+  }
+
+  return 0;
+}
+
+void AddName(char ***names, int *count, int *capacity, const char *name) {
+  if (*count == *capacity) {
+    *capacity *= 2;
+    *names = realloc(*names, sizeof(char *)*(*capacity));
+  }
+  (*names)[(*count)++] = strdup(name);
+}
+
+void FreeNames(char **names, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+}
+
+char *FetchListing(int socket) {
+  uint8_t request[2] = { 0, LIST_SORT_NAME };
+  char *listing = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&listing, &size);
+  int64_t count;
+
+  SendFrame(socket, OP_LS, 0, NextRequestId(), request, sizeof(request));
+  count = ReceiveListing(socket, request[0], out);
+  fclose(out);
+
+  if (count < 0) {
+    printf("Could not list the directory on the server.\n");
+    free(listing);
+    return NULL;
+  }
+
+  return listing;
+}
+
+double Now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void PrintBatchSummary(const char *command, int count, int failed, int64_t bytes, double seconds) {
+  printf("%s: %d files (%d failed), %lld bytes in %.3f s", command, count, failed, (long long)bytes, seconds);
+  if (seconds > 0) {
+    printf(", %.1f files/s, %.2f MB/s", count / seconds, bytes / seconds / 1e6);
+  }
+  printf("\n");
+}
+
+void TraceStart(const char *op, const char *filename) {
+  if (tracemode == TRACE_OFF) {
+    return;
+  }
+
+  memset(&timeline, 0, sizeof(timeline));
+  timeline.op = op;
+  timeline.filename = filename;
+  timeline.start = Now();
+}
+
+double TraceClock() {
+  return (timeline.op != NULL) ? Now() : 0;
+}
+
+void TraceNetwork(double since) {
+  if (timeline.op != NULL) {
+    timeline.network += Now() - since;
+  }
+}
+
+void TraceDisk(double since) {
+  if (timeline.op != NULL) {
+    timeline.disk += Now() - since;
+  }
+}
+
+void TraceMark(double *phase) {
+  if (timeline.op != NULL) {
+    *phase = Now() - timeline.start;
+  }
+}
+
+void TraceChunk(int64_t n) {
+  if (timeline.op == NULL) {
+    return;
+  }
+
+  double now = Now() - timeline.start;
+
+  if (timeline.bytes == 0) {
+    timeline.first = now;
+  } else if (now - timeline.previous > TRACE_STALL) {
+    timeline.stall += now - timeline.previous - TRACE_STALL;
+  }
+  timeline.last = timeline.previous = now;
+  timeline.bytes += n;
+}
+
+void TraceEnd(int ok) {
+  if (timeline.op == NULL) {
+    return;
+  }
+
+  struct timeline *t = &timeline;
+  double total = t->done ? t->done : Now() - t->start;
+  double moving = t->last - t->first;
+  double rate = (moving > 0) ? t->bytes / moving / 1e6 : 0;
+  const char *bound;
+
+  // Whichever took most of the transfer: waiting for the first byte,
+  // the file on this side, or the socket.
+  if (t->first > total / 2) {
+    bound = "handshake";
+  } else if (t->disk > t->network) {
+    bound = "disk";
+  } else {
+    bound = "network";
+  }
+
+  if (tracemode == TRACE_JSON) {
+    fprintf(stderr, "{\"op\": \"%s\", \"file\": ", t->op);
+    PrintJsonString(stderr, t->filename);
+    fprintf(stderr, ", \"ok\": %s, \"bytes\": %lld, \"request_ms\": %.3f, \"header_ms\": ",
+            ok ? "true" : "false", (long long)t->bytes, t->requested * 1e3);
+    if (t->header > 0) {
+      fprintf(stderr, "%.3f", t->header * 1e3);
+    } else {
+      fprintf(stderr, "null");
+    }
+    fprintf(stderr, ", \"first_byte_ms\": %.3f, \"last_byte_ms\": %.3f, \"done_ms\": %.3f, "
+            "\"mb_per_s\": %.2f, \"ttfb_ms\": %.3f, \"stall_ms\": %.3f, \"network_ms\": %.3f, "
+            "\"disk_ms\": %.3f, \"bound\": \"%s\"}\n",
+            t->first * 1e3, t->last * 1e3, total * 1e3, rate, t->first * 1e3, t->stall * 1e3,
+            t->network * 1e3, t->disk * 1e3, bound);
+  } else {
+    printf("trace %s %s: %s, %lld bytes\n", t->op, t->filename, ok ? "ok" : "failed", (long long)t->bytes);
+    printf("  %10.3f ms  request sent\n", t->requested * 1e3);
+    if (t->header > 0) {
+      printf("  %10.3f ms  header received\n", t->header * 1e3);
+    }
+    printf("  %10.3f ms  first byte\n", t->first * 1e3);
+    printf("  %10.3f ms  last byte\n", t->last * 1e3);
+    printf("  %10.3f ms  %s\n", total * 1e3, strcmp(t->op, "get") == 0 ? "synced and closed" : "acknowledged");
+    printf("  %.2f MB/s, time to first byte %.3f ms, stalled %.3f ms\n", rate, t->first * 1e3, t->stall * 1e3);
+    printf("  network %.3f ms, disk %.3f ms: %s-bound\n", t->network * 1e3, t->disk * 1e3, bound);
+  }
+  t->op = NULL;
+}
+
+void PrintJsonString(FILE *out, const char *string) {
+  fputc('"', out);
+  for (; *string; string++) {
+    unsigned char c = (unsigned char)*string;
+
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+int ConnectToServer() {
+  int sockfd;
+
+  #ifdef DEBUG
+  printf("[DEBUG] Creating TCP socket...\n");
+  #endif
+
+  // Create a TCP socket.
+  if ((sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    return -1;
+  }
+
+  // Requests and frame headers go out in the same send as what follows
+  // them, so nothing is gained by waiting for more, and a small reply
+  // or request would otherwise sit out a delayed ACK. Buffer sizes are
+  // set before connecting so the window scale allows for them.
+  int on = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (socketbuffer > 0) {
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &socketbuffer, sizeof(socketbuffer));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &socketbuffer, sizeof(socketbuffer));
+  }
+  if (congestion != NULL &&
+      setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion)) < 0) {
+    static int warned = 0;
+
+    if (!warned) {
+      printf("Congestion control '%s' is unavailable; using the default.\n", congestion);
+      warned = 1;
+    }
+  }
+
+  if (connect(sockfd, (struct sockaddr *) &serveraddress, sizeof(serveraddress)) < 0) {
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+void Retune(int socket, int option, struct tuner *t, int64_t moved) {
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  double now;
+  int have;
+
+  if (!autotune) {
+    return;
+  }
+  if (t->since == 0) {
+    t->since = Now();
+    t->moved = moved;
+    return;
+  }
+  if (moved - t->moved < TUNE_INTERVAL) {
+    return;
+  }
+
+  now = Now();
+  if (now > t->since && getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+    uint32_t rtt = (info.tcpi_rtt > info.tcpi_rcv_rtt) ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+    double want = 2 * (moved - t->moved) / (now - t->since) * rtt / 1e6;
+
+    if (want > TUNE_MAX) {
+      want = TUNE_MAX;
+    }
+
+    // The kernel doubles the size it is given, and reports the doubled
+    // size. Buffers only grow, and a size set ends the kernel's own
+    // autotuning for the socket, so it is only set past what that reached.
+    len = sizeof(have);
+    if (getsockopt(socket, SOL_SOCKET, option, &have, &len) == 0 && 2 * want > have) {
+      have = want;
+      setsockopt(socket, SOL_SOCKET, option, &have, sizeof(have));
+
+      #ifdef DEBUG
+      printf("[DEBUG] Raised socket buffer to %d bytes for an RTT of %u us\n", have, rtt);
+      #endif
+    }
+  }
+  t->since = now;
+  t->moved = moved;
+}
+
+int64_t StatRemote(int socket, const char *filename, char *msgbuffer) {
+  struct frame frame;
+
+  SendFrame(socket, OP_STAT, 0, NextRequestId(), filename, strlen(filename));
+
+  if (ReceiveReply(socket, &frame, msgbuffer) != OP_FILE_INFO || frame.length < 8) {
+    return -1;
+  }
+  return getU64((unsigned char *)msgbuffer);
+}
+
+int ParallelTransfer(const char *filename, int64_t filesize, int put) {
+  int count = streams, i, failed = 0;
+  int64_t range;
+  int fd;
+
+  // Every stream gets at least STREAM_MIN_RANGE bytes.
+  if (filesize / count < STREAM_MIN_RANGE) {
+    count = filesize / STREAM_MIN_RANGE;
+  }
+
+  if (put) {
+    fd = open(filename, O_RDONLY);
+  } else {
+    // Size the local file up front; each stream fills in its own range.
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && ftruncate(fd, filesize) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0) {
+    printf("Unable to open file '%s'\n", filename);
+    return -1;
+  }
+
+  struct stream *list = calloc(count, sizeof(struct stream));
+  double start = Now();
+
+  range = filesize / count;
+  for (i = 0; i < count; i++) {
+    list[i].index = i;
+    list[i].put = put;
+    list[i].fd = fd;
+    list[i].filename = filename;
+    list[i].total = filesize;
+    list[i].offset = range * i;
+    list[i].length = (i == count - 1) ? filesize - range * i : range;
+
+    if (pthread_create(&list[i].thread, NULL, StreamMain, &list[i]) != 0) {
+      Die("pthread_create() failed");
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    pthread_join(list[i].thread, NULL);
+
+    printf("stream %d: %lld bytes in %.3f s", i, (long long)list[i].length, list[i].seconds);
+    if (list[i].failed) {
+      printf(", failed\n");
+      failed++;
+    } else if (list[i].seconds > 0) {
+      printf(", %.2f MB/s\n", list[i].length / list[i].seconds / 1e6);
+    } else {
+      printf("\n");
+    }
+  }
+
+  double seconds = Now() - start;
+  printf("%s: %lld bytes over %d streams in %.3f s", put ? "put" : "get", (long long)filesize, count, seconds);
+  if (seconds > 0) {
+    printf(", %.2f MB/s", filesize / seconds / 1e6);
+  }
+  printf("%s\n", failed ? ", failed" : "");
+
+  close(fd);
+  free(list);
+  return failed ? -1 : 0;
+}
+
+void *StreamMain(void *arg) {
+  struct stream *st = arg;
+  struct frame frame;
+  char msgbuffer[BUFSIZE];
+  unsigned char request[24 + BUFSIZE];
+  size_t namelen = strlen(st->filename);
+  uint32_t requestId = NextRequestId();
+  int64_t moved = 0;
+  ssize_t n;
+  int socket;
+
+  double start = Now();
+
+  if (namelen > BUFSIZE || (socket = ConnectToServer()) < 0) {
+    st->failed = 1;
+    return NULL;
+  }
+
+  // Join the main connection in its directory.
+  if (strcmp(remotedirectory, "/") != 0) {
+    SendFrame(socket, OP_CD, 0, NextRequestId(), remotedirectory, strlen(remotedirectory));
+    if (ReceiveReply(socket, &frame, msgbuffer) != OP_OK) {
+      close(socket);
+      st->failed = 1;
+      return NULL;
+    }
+  }
+
+  char *buffer = malloc(CHUNKSIZE);
+  struct tuner tuner = { 0, 0 };
+
+  if (st->put) {
+    // The range request carries the file size and the slice it covers.
+    putU64(request, st->total);
+    putU64(request + 8, st->offset);
+    putU64(request + 16, st->length);
+    memcpy(request + 24, st->filename, namelen);
+    SendFrame(socket, OP_PUT, FLAG_RANGE | (checksums ? FLAG_CHECKSUM : 0), requestId, request, 24 + namelen);
+
+    uint32_t crc = 0;
+    while (moved < st->length) {
+      size_t chunk = (st->length - moved < CHUNKSIZE) ? st->length - moved : CHUNKSIZE;
+
+      if ((n = pread(st->fd, buffer, chunk, st->offset + moved)) <= 0) {
+        Die("pread() failed.");
+      }
+      SendDataChunk(socket, requestId, buffer, n, NULL, checksums ? &crc : NULL);
+      moved += n;
+      Retune(socket, SO_SNDBUF, &tuner, moved);
+    }
+
+    st->failed = ReceivePutReply(socket, requestId, msgbuffer) != 0;
+  } else {
+    putU64(request, st->offset);
+    putU64(request + 8, st->length);
+    memcpy(request + 16, st->filename, namelen);
+    SendFrame(socket, OP_GET, FLAG_RANGE | (checksums ? FLAG_CHECKSUM : 0), requestId, request, 16 + namelen);
+
+    if (ReceiveReply(socket, &frame, msgbuffer) != OP_FILE_INFO || frame.length != 24) {
+      st->failed = 1;
+    }
+
+    uint64_t frameleft = 0, trailer = checksums ? 4 : 0;
+    uint32_t crc = 0;
+    while (!st->failed && moved < st->length) {
+      if (frameleft == 0) {
+        ReceiveFrame(socket, &frame);
+        if (frame.opcode != OP_DATA || frame.length < trailer ||
+            frame.length - trailer > (uint64_t)(st->length - moved)) {
+          printf("Received an unexpected frame from the server.\n");
+          exit(1);
+        }
+        frameleft = frame.length - trailer;
+        continue;
+      }
+
+      size_t want = (frameleft < CHUNKSIZE) ? frameleft : CHUNKSIZE;
+      ReceiveAll(socket, buffer, want);
+      if (pwrite(st->fd, buffer, want, st->offset + moved) != (ssize_t)want) {
+        Die("pwrite() failed.");
+      }
+      moved += want;
+      frameleft -= want;
+      Retune(socket, SO_RCVBUF, &tuner, moved);
+
+      if (checksums) {
+        crc = crc32c(crc, buffer, want);
+        if (frameleft == 0 && CheckTrailer(socket, crc) != 0) {
+          printf("stream %d: checksum mismatch\n", st->index);
+          st->failed = 1;
+        }
+      }
+    }
+  }
+
+  SendFrame(socket, OP_QUIT, 0, NextRequestId(), NULL, 0);
+  close(socket);
+  free(buffer);
+
+  st->seconds = Now() - start;
+  return NULL;
+}
+
+int RunManifest(int socket, const char *path) {
+  struct job *jobs = NULL;
+  struct scheduler s;
+  int count, i;
+
+  if ((count = ReadManifest(socket, path, &jobs)) < 0) {
+    return -1;
+  }
+  if (count == 0) {
+    printf("Manifest '%s' lists no files.\n", path);
+    free(jobs);
+    return 0;
+  }
+
+  memset(&s, 0, sizeof(s));
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.settled, NULL);
+  s.count = (connections < count) ? connections : count;
+  s.jobs = count;
+  s.left = count;
+  s.lanes = calloc(s.count, sizeof(struct lane));
+
+  for (i = 0; i < s.count; i++) {
+    s.lanes[i].s = &s;
+    s.lanes[i].index = i;
+    s.lanes[i].socket = -1;
+    s.lanes[i].queue = malloc(sizeof(struct job *) * count);
+    s.lanes[i].buffer = malloc(FRAME_HEADER_SIZE + CHUNKSIZE + 4);
+  }
+
+  // Deal the largest files first, each to the lane with the fewest bytes
+  // queued, so no lane is left with a big file at the end.
+  qsort(jobs, count, sizeof(struct job), CompareJobs);
+  for (i = 0; i < count; i++) {
+    struct lane *least = &s.lanes[0];
+    int j;
+
+    for (j = 1; j < s.count; j++) {
+      if (s.lanes[j].queued < least->queued) {
+        least = &s.lanes[j];
+      }
+    }
+    QueueJob(least, &jobs[i]);
+  }
+
+  double start = Now(), report = start;
+
+  for (i = 0; i < s.count; i++) {
+    if (pthread_create(&s.lanes[i].thread, NULL, LaneMain, &s.lanes[i]) != 0) {
+      Die("pthread_create() failed");
+    }
+  }
+
+  // Report progress once a second until every job is settled.
+  pthread_mutex_lock(&s.lock);
+  while (s.left > 0) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    if (pthread_cond_timedwait(&s.settled, &s.lock, &deadline) == 0 || s.left == 0) {
+      continue;
+    }
+
+    // Printed unlocked, so a slow stdout doesn't hold up the lanes.
+    int64_t moved = __atomic_load_n(&s.moved, __ATOMIC_RELAXED);
+    int done = s.done, failed = s.failed, retried = s.retried;
+
+    pthread_mutex_unlock(&s.lock);
+    report = Now();
+    printf("progress: %d/%d files, %d failed, %d retried, %.1f MB, %.2f MB/s\n", done, count, failed,
+           retried, moved / 1e6, moved / (report - start) / 1e6);
+    fflush(stdout);
+    pthread_mutex_lock(&s.lock);
+  }
+  pthread_mutex_unlock(&s.lock);
+
+  double seconds = Now() - start;
+
+  for (i = 0; i < s.count; i++) {
+    struct lane *lane = &s.lanes[i];
+
+    pthread_join(lane->thread, NULL);
+    printf("connection %d: %d files (%d stolen), %lld bytes\n", i, lane->files, lane->stolen,
+           (long long)lane->bytes);
+    free(lane->queue);
+    free(lane->buffer);
+  }
+
+  PrintBatchSummary("manifest", count, s.failed, s.bytes, seconds);
+  if (s.retried > 0) {
+    printf("retried %d times\n", s.retried);
+  }
+
+  for (i = 0; i < count; i++) {
+    free(jobs[i].name);
+  }
+  free(jobs);
+  free(s.lanes);
+  pthread_cond_destroy(&s.settled);
+  pthread_mutex_destroy(&s.lock);
+  return s.failed ? -1 : 0;
+}
+
+int ReadManifest(int socket, const char *path, struct job **jobs) {
+  FILE *file = fopen(path, "r");
+  char line[BUFSIZE + 64], msgbuffer[BUFSIZE];
+  int count = 0, capacity = 0, number = 0;
+
+  if (file == NULL) {
+    printf("Unable to open manifest '%s'\n", path);
+    return -1;
+  }
+
+  // Each line is "get|put <name> [size [priority]]"; # starts a comment.
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *op, *name, *size, *priority;
+    struct job job;
+
+    number++;
+    line[strcspn(line, "#\n")] = 0;
+    if ((op = strtok(line, " \t")) == NULL) {
+      continue;
+    }
+    name = strtok(NULL, " \t");
+    size = strtok(NULL, " \t");
+    priority = size ? strtok(NULL, " \t") : NULL;
+
+    if ((strcmp(op, "get") != 0 && strcmp(op, "put") != 0) || name == NULL || strlen(name) > BUFSIZE ||
+        (priority && strtok(NULL, " \t"))) {
+      printf("%s:%d: expected 'get|put <name> [size [priority]]'\n", path, number);
+      fclose(file);
+      for (int i = 0; i < count; i++) {
+        free((*jobs)[i].name);
+      }
+      free(*jobs);
+      *jobs = NULL;
+      return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.put = strcmp(op, "put") == 0;
+    job.name = strdup(name);
+    job.size = size ? strtoll(size, NULL, 10) : -1;
+    job.priority = priority ? atoi(priority) : 0;
+
+    // Sizes the manifest leaves out are looked up to order the files.
+    if (job.size < 0 && job.put) {
+      struct stat st;
+
+      job.size = (stat(name, &st) == 0) ? st.st_size : -1;
+    } else if (job.size < 0) {
+      job.size = StatRemote(socket, name, msgbuffer);
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      *jobs = realloc(*jobs, sizeof(struct job) * capacity);
+    }
+    (*jobs)[count++] = job;
+  }
+
+  fclose(file);
+  return count;
+}
+
+int CompareJobs(const void *a, const void *b) {
+  const struct job *x = a, *y = b;
+
+  if (x->priority != y->priority) {
+    return (x->priority > y->priority) ? -1 : 1;
+  }
+  if (x->size != y->size) {
+    return (x->size > y->size) ? -1 : 1;
+  }
+  return 0;
+}
+
+void *LaneMain(void *arg) {
+  struct lane *lane = arg;
+  struct scheduler *s = lane->s;
+  struct job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    job = TakeJob(s, lane);
+    pthread_mutex_unlock(&s->lock);
+
+    if (job == NULL) {
+      break;
+    }
+
+    // A file that failed waits a little longer each time it comes back.
+    if (job->attempts > 0) {
+      usleep(RETRY_DELAY * job->attempts);
+    }
+
+    int rv = RunJob(lane, job);
+
+    pthread_mutex_lock(&s->lock);
+    if (rv == 0) {
+      s->done++;
+      s->bytes += job->size;
+      lane->files++;
+      lane->bytes += job->size;
+      s->left--;
+    } else if (rv == -2 && job->attempts < retries) {
+      job->attempts++;
+      s->retried++;
+      QueueJob(lane, job);
+    } else {
+      s->failed++;
+      s->left--;
+    }
+    if (s->left == 0) {
+      pthread_cond_signal(&s->settled);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  if (lane->socket >= 0) {
+    LaneSendFrame(lane, OP_QUIT, 0, NextRequestId(), NULL, 0);
+    close(lane->socket);
+  }
+  return NULL;
+}
+
+struct job *TakeJob(struct scheduler *s, struct lane *lane) {
+  struct lane *victim = lane;
+  struct job *job;
+  int i;
+
+  if (lane->head == lane->tail) {
+    victim = NULL;
+    for (i = 0; i < s->count; i++) {
+      struct lane *other = &s->lanes[i];
+
+      if (other->head < other->tail && (victim == NULL || other->queued > victim->queued)) {
+        victim = other;
+      }
+    }
+    if (victim == NULL) {
+      return NULL;
+    }
+    lane->stolen++;
+  }
+
+  job = victim->queue[victim->head++];
+  victim->queued -= (job->size > 0) ? job->size : 0;
+  return job;
+}
+
+void QueueJob(struct lane *lane, struct job *job) {
+  // Every job is queued on one lane at most, so there is always room
+  // once the started ones are dropped from the front.
+  if (lane->tail == lane->s->jobs) {
+    memmove(lane->queue, lane->queue + lane->head, sizeof(struct job *) * (lane->tail - lane->head));
+    lane->tail -= lane->head;
+    lane->head = 0;
+  }
+  lane->queue[lane->tail++] = job;
+  lane->queued += (job->size > 0) ? job->size : 0;
+}
+
+int RunJob(struct lane *lane, struct job *job) {
+  char message[BUFSIZE];
+  int rv;
+
+  message[0] = '\0';
+  if (lane->socket < 0 && (lane->socket = ConnectToServer()) < 0) {
+    snprintf(message, BUFSIZE, "unable to connect to the server");
+    rv = -2;
+  } else {
+    rv = job->put ? RunPutJob(lane, job, message) : RunGetJob(lane, job, message);
+  }
+
+  if (rv == -2) {
+    printf("%s: %s, %s\n", job->name, message[0] ? message : "connection lost",
+           (job->attempts < retries) ? "retrying" : "giving up");
+  } else if (rv < 0) {
+    printf("%s: %s\n", job->name, message);
+  }
+  return rv;
+}
+
+int RunGetJob(struct lane *lane, struct job *job, char *message) {
+  struct frame frame;
+  uint32_t requestId = NextRequestId();
+  int64_t filesize, moved = 0;
+  uint64_t frameleft = 0, trailer = checksums ? 4 : 0;
+  uint32_t crc = 0;
+  struct tuner tuner = { 0, 0 };
+  int corrupt = 0, fd;
+
+  if (LaneSendFrame(lane, OP_GET, checksums ? FLAG_CHECKSUM : 0, requestId, job->name, strlen(job->name)) < 0 ||
+      LaneReceiveReply(lane, &frame, message) < 0) {
+    return -2;
+  }
+  if (frame.opcode != OP_FILE_INFO) {
+    return -1;
+  }
+  if (frame.length != 8) {
+    snprintf(message, BUFSIZE, "unexpected reply from the server");
+    LaneDrop(lane);
+    return -2;
+  }
+  filesize = getU64((unsigned char *)message);
+  message[0] = '\0';
+
+  // The data follows right away, so a file that can't be created costs
+  // the connection.
+  if ((fd = open(job->name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    snprintf(message, BUFSIZE, "unable to create file");
+    LaneDrop(lane);
+    return -1;
+  }
+
+  while (moved < filesize) {
+    if (frameleft == 0) {
+      if (LaneReceiveFrame(lane, &frame) < 0) {
+        close(fd);
+        return -2;
+      }
+      if (frame.opcode != OP_DATA || (frame.flags & FLAG_COMPRESS) || frame.length < trailer ||
+          frame.length - trailer > (uint64_t)(filesize - moved)) {
+        snprintf(message, BUFSIZE, "unexpected frame from the server");
+        LaneDrop(lane);
+        close(fd);
+        return -2;
+      }
+      frameleft = frame.length - trailer;
+    } else {
+      size_t want = (frameleft < CHUNKSIZE) ? frameleft : CHUNKSIZE;
+
+      if (LaneReceive(lane, lane->buffer, want) < 0) {
+        close(fd);
+        return -2;
+      }
+      if (write(fd, lane->buffer, want) != (ssize_t)want) {
+        snprintf(message, BUFSIZE, "write() failed");
+        LaneDrop(lane);
+        close(fd);
+        return -1;
+      }
+      moved += want;
+      frameleft -= want;
+      __atomic_add_fetch(&lane->s->moved, want, __ATOMIC_RELAXED);
+      Retune(lane->socket, SO_RCVBUF, &tuner, moved);
+      if (checksums) {
+        crc = crc32c(crc, lane->buffer, want);
+      }
+    }
+
+    if (frameleft == 0 && checksums) {
+      unsigned char check[4];
+
+      if (LaneReceive(lane, check, sizeof(check)) < 0) {
+        close(fd);
+        return -2;
+      }
+      corrupt |= getU32(check) != crc;
+    }
+  }
+
+  close(fd);
+  job->size = filesize;
+  if (corrupt) {
+    snprintf(message, BUFSIZE, "checksum mismatch");
+    return -2;
+  }
+  return 0;
+}
+
+int RunPutJob(struct lane *lane, struct job *job, char *message) {
+  struct frame frame;
+  struct stat st;
+  struct tuner tuner = { 0, 0 };
+  unsigned char request[8 + BUFSIZE];
+  unsigned char *data = (unsigned char *)lane->buffer + FRAME_HEADER_SIZE;
+  size_t namelen = strlen(job->name), trailer = checksums ? 4 : 0;
+  uint32_t requestId = NextRequestId(), crc = 0;
+  int64_t moved = 0;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(job->name, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    snprintf(message, BUFSIZE, "unable to open file");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  putU64(request, st.st_size);
+  memcpy(request + 8, job->name, namelen);
+  if (LaneSendFrame(lane, OP_PUT, checksums ? FLAG_CHECKSUM : 0, requestId, request, 8 + namelen) < 0) {
+    close(fd);
+    return -2;
+  }
+
+  // The size went out in the request, so a file that changes under us
+  // costs the connection. Each DATA frame is built around its chunk and
+  // sent whole.
+  while (moved < st.st_size) {
+    size_t chunk = (st.st_size - moved < CHUNKSIZE) ? st.st_size - moved : CHUNKSIZE;
+
+    if ((n = read(fd, data, chunk)) <= 0) {
+      snprintf(message, BUFSIZE, "read() failed");
+      LaneDrop(lane);
+      close(fd);
+      return -1;
+    }
+    if (checksums) {
+      crc = crc32c(crc, data, n);
+      putU32(data + n, crc);
+    }
+    frameBuild((unsigned char *)lane->buffer, OP_DATA, 0, requestId, n + trailer);
+    if (LaneSend(lane, lane->buffer, FRAME_HEADER_SIZE + n + trailer) < 0) {
+      close(fd);
+      return -2;
+    }
+    moved += n;
+    __atomic_add_fetch(&lane->s->moved, n, __ATOMIC_RELAXED);
+    Retune(lane->socket, SO_SNDBUF, &tuner, moved);
+  }
+  close(fd);
+
+  if (LaneReceiveReply(lane, &frame, message) < 0) {
+    return -2;
+  }
+  if (frame.opcode != OP_OK) {
+    return -1;
+  }
+  job->size = st.st_size;
+  return 0;
+}
+
+int LaneSend(struct lane *lane, const void *buffer, size_t len) {
+  size_t sent = 0;
+  ssize_t n;
+
+  while (sent < len) {
+    if ((n = send(lane->socket, (const char *)buffer + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+      LaneDrop(lane);
+      return -1;
+    }
+    sent += n;
+  }
+  return 0;
+}
+
+int LaneSendFrame(struct lane *lane, uint8_t opcode, uint16_t flags, uint32_t requestId,
+                  const void *payload, uint64_t length) {
+  unsigned char message[FRAME_HEADER_SIZE + 8 + BUFSIZE];
+
+  frameBuild(message, opcode, flags, requestId, length);
+  if (payload == NULL) {
+    return LaneSend(lane, message, FRAME_HEADER_SIZE);
+  }
+  memcpy(message + FRAME_HEADER_SIZE, payload, length);
+  return LaneSend(lane, message, FRAME_HEADER_SIZE + length);
+}
+
+int LaneReceive(struct lane *lane, void *buffer, size_t len) {
+  size_t received = 0;
+  ssize_t n;
+
+  while (received < len) {
+    if ((n = recv(lane->socket, (char *)buffer + received, len - received, 0)) <= 0) {
+      LaneDrop(lane);
+      return -1;
+    }
+    received += n;
+  }
+  return 0;
+}
+
+int LaneReceiveFrame(struct lane *lane, struct frame *frame) {
+  struct frame_parser parser;
+  unsigned char header[FRAME_HEADER_SIZE];
+  size_t used = 0;
+
+  frameParserReset(&parser);
+  if (LaneReceive(lane, header, sizeof(header)) < 0) {
+    return -1;
+  }
+  if (frameParseHeader(&parser, header, sizeof(header), &used) <= 0) {
+    LaneDrop(lane);
+    return -1;
+  }
+  *frame = parser.frame;
+  return 0;
+}
+
+int LaneReceiveReply(struct lane *lane, struct frame *frame, char *buffer) {
+  uint64_t left;
+  size_t keep;
+
+  if (LaneReceiveFrame(lane, frame) < 0) {
+    return -1;
+  }
+  if (frame->opcode == OP_DATA || frame->length > FRAME_MAX_CONTROL) {
+    LaneDrop(lane);
+    return -1;
+  }
+
+  keep = (frame->length < BUFSIZE) ? frame->length : BUFSIZE - 1;
+  if (LaneReceive(lane, buffer, keep) < 0) {
+    return -1;
+  }
+  buffer[keep] = '\0';
+
+  // Drop whatever didn't fit.
+  for (left = frame->length - keep; left > 0; ) {
+    char discard[BUFSIZE];
+    size_t n = (left < BUFSIZE) ? left : BUFSIZE;
+
+    if (LaneReceive(lane, discard, n) < 0) {
+      return -1;
+    }
+    left -= n;
+  }
+  return 0;
+}
+
+void LaneDrop(struct lane *lane) {
+  if (lane->socket >= 0) {
+    close(lane->socket);
+    lane->socket = -1;
+  }
+}
+
+size_t SendDataChunk(int socket, uint32_t requestId, const char *data, size_t len,
+                     struct compressor *z, uint32_t *crc) {
+  unsigned char trailer[4];
+  size_t packed = 0, extra = crc ? 4 : 0;
+
+  if (crc != NULL) {
+    *crc = crc32c(*crc, data, len);
+    putU32(trailer, *crc);
+  }
+
+  if (z != NULL && z->codec != CODEC_NONE) {
+    packed = compressChunk(z, data, len, zbuffer + 4, compressedBound(CHUNKSIZE));
+  }
+
+  if (packed > 0) {
+    putU32(zbuffer, len);
+    memcpy(zbuffer + 4 + packed, trailer, extra);
+    SendFrame(socket, OP_DATA, FLAG_COMPRESS, requestId, zbuffer, packed + 4 + extra);
+    return FRAME_HEADER_SIZE + packed + 4 + extra;
+  }
+
+  // Header, data and checksum leave in one system call.
+  unsigned char header[FRAME_HEADER_SIZE];
+  struct iovec iov[3] = {
+    { header, sizeof(header) }, { (void *)data, len }, { trailer, extra }
+  };
+
+  frameBuild(header, OP_DATA, 0, requestId, len + extra);
+  SendAllV(socket, iov, 3);
+  return FRAME_HEADER_SIZE + len + extra;
+}
+
+int CheckTrailer(int socket, uint32_t crc) {
+  unsigned char trailer[4];
+
+  ReceiveAll(socket, trailer, sizeof(trailer));
+  return (getU32(trailer) == crc) ? 0 : -1;
+}
+
+uint16_t TransferFlags(int get) {
+  uint16_t flags = checksums ? FLAG_CHECKSUM : 0;
+
+  // A put says it is compressed frame by frame.
+  if (get && compressor.codec != CODEC_NONE) {
+    flags |= FLAG_COMPRESS;
+  }
+  return flags;
+}
+
+void NegotiateCodec(int socket, char *msgbuffer) {
+  struct frame frame;
+  unsigned char offer[] = { CODEC_DEFLATE };
+
+  SendFrame(socket, OP_HELLO, 0, NextRequestId(), offer, sizeof(offer));
+
+  if (ReceiveReply(socket, &frame, msgbuffer) == OP_OK && frame.length == 1 &&
+      codecSupported((unsigned char)msgbuffer[0])) {
+    compressorInit(&compressor, (unsigned char)msgbuffer[0]);
+    zbuffer = malloc(8 + compressedBound(CHUNKSIZE));
+  } else {
+    printf("Server doesn't compress; transfers are sent raw.\n");
+  }
+}
+
+void PrintCompression(double seconds) {
+  if (compressor.codec == CODEC_NONE || compressor.rawBytes == 0) {
+    return;
+  }
+
+  printf("compression: %llu bytes as %llu (%.2fx)", (unsigned long long)compressor.rawBytes,
+         (unsigned long long)compressor.wireBytes, (double)compressor.rawBytes / compressor.wireBytes);
+  if (seconds > 0) {
+    printf(", %.2f MB/s effective", compressor.rawBytes / seconds / 1e6);
+  }
+  printf("\n");
+}
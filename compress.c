@@ -0,0 +1,85 @@
+#include <zlib.h>
+
+#include "protocol.h"
+#include "compress.h"
+
+#define MAX_BACKOFF 64
+#define DEFLATE_LEVEL 1     /* speed over ratio; the link is the bottleneck */
+
+/*         Name: compressorInit
+ *  Description: readies a compressor for a codec and clears its counters
+ *   Parameters: struct compressor*, int codec
+ *       Return: void
+ */
+void compressorInit(struct compressor *z, int codec){
+    z->codec = codec;
+    z->skip = 0;
+    z->backoff = 1;
+    z->rawBytes = 0;
+    z->wireBytes = 0;
+}
+
+/*         Name: codecSupported
+ *  Description: tells whether this build can compress with a codec
+ *   Parameters: int codec
+ *       Return: int, 1 if it can, 0 if not
+ */
+int codecSupported(int codec){
+    return codec == CODEC_DEFLATE;
+}
+
+/*         Name: compressedBound
+ *  Description: the most bytes compressChunk may need for a chunk
+ *   Parameters: size_t chunk length
+ *       Return: size_t
+ */
+size_t compressedBound(size_t len){
+    return compressBound(len);
+}
+
+/*         Name: compressChunk
+ *  Description: compresses one chunk on its own, unless the compressor is
+ *               backing off or the chunk wouldn't shrink by at least 1/16
+ *   Parameters: struct compressor*, chunk, chunk length, output buffer of
+ *               compressedBound(length) bytes, output size
+ *       Return: size_t compressed length, or 0 to send the chunk raw
+ */
+size_t compressChunk(struct compressor *z, const void *in, size_t len, void *out, size_t outSize){
+    uLongf outLen = outSize;
+
+    z->rawBytes += len;
+    if (z->codec == CODEC_NONE || len == 0 || z->skip > 0) {
+        if (z->skip > 0)
+            z->skip--;
+        z->wireBytes += len;
+        return 0;
+    }
+
+    if (compress2(out, &outLen, in, len, DEFLATE_LEVEL) != Z_OK || outLen >= len - len / 16) {
+        z->skip = z->backoff;
+        if (z->backoff < MAX_BACKOFF)
+            z->backoff *= 2;
+        z->wireBytes += len;
+        return 0;
+    }
+
+    z->backoff = 1;
+    z->wireBytes += outLen + 4;
+    return outLen;
+}
+
+/*         Name: decompressChunk
+ *  Description: restores one chunk made by compressChunk
+ *   Parameters: int codec, compressed bytes, their length, output buffer,
+ *               int raw length the chunk must come out at
+ *       Return: int, 0 on success, -1 if the chunk is corrupt
+ */
+int decompressChunk(int codec, const void *in, size_t len, void *out, size_t rawLen){
+    uLongf outLen = rawLen;
+
+    if (codec != CODEC_DEFLATE)
+        return -1;
+    if (uncompress(out, &outLen, in, len) != Z_OK || outLen != rawLen)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Chunk compression for DATA frames. Every chunk is compressed on its own,
+ * so chunks can be produced and consumed in any grouping. Chunks that
+ * don't shrink go out raw, and after such a chunk the compressor backs
+ * off for a growing number of chunks before trying again, so data that
+ * is already compressed costs almost no CPU.
+ */
+struct compressor
+{
+    int         codec;      /* CODEC_*, CODEC_NONE sends everything raw */
+    int         skip;       /* chunks still to send raw without trying */
+    int         backoff;    /* skip length after the next failed chunk */
+    uint64_t    rawBytes;   /* file bytes through this compressor */
+    uint64_t    wireBytes;  /* payload bytes they took on the wire */
+};
+
+void compressorInit(struct compressor*, int);
+size_t compressChunk(struct compressor*, const void*, size_t, void*, size_t);
+int decompressChunk(int, const void*, size_t, void*, size_t);
+size_t compressedBound(size_t);
+int codecSupported(int);
+
+#endif
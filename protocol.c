@@ -0,0 +1,171 @@
+#include <string.h>
+#include <endian.h>
+
+#include "protocol.h"
+
+/*         Name: frameEncode
+ *  Description: writes a frame header in network byte order
+ *   Parameters: struct frame*, output buffer of FRAME_HEADER_SIZE bytes
+ *       Return: void
+ */
+void frameEncode(const struct frame *f, unsigned char *out){
+    uint16_t flags = htobe16(f->flags);
+    uint32_t id = htobe32(f->requestId);
+
+    out[0] = f->version;
+    out[1] = f->opcode;
+    memcpy(out + 2, &flags, sizeof(flags));
+    memcpy(out + 4, &id, sizeof(id));
+    putU64(out + 8, f->length);
+}
+
+/*         Name: frameDecode
+ *  Description: reads a frame header from network byte order
+ *   Parameters: input buffer of FRAME_HEADER_SIZE bytes, struct frame*
+ *       Return: void
+ */
+void frameDecode(const unsigned char *in, struct frame *f){
+    uint16_t flags;
+    uint32_t id;
+
+    memcpy(&flags, in + 2, sizeof(flags));
+    memcpy(&id, in + 4, sizeof(id));
+    f->version = in[0];
+    f->opcode = in[1];
+    f->flags = be16toh(flags);
+    f->requestId = be32toh(id);
+    f->length = getU64(in + 8);
+}
+
+/*         Name: frameBuild
+ *  Description: encodes a header for the given fields
+ *   Parameters: output buffer, opcode, flags, request id, payload length
+ *       Return: size_t, FRAME_HEADER_SIZE
+ */
+size_t frameBuild(unsigned char *out, uint8_t opcode, uint16_t flags, uint32_t requestId, uint64_t length){
+    struct frame f;
+
+    f.version = FRAME_VERSION;
+    f.opcode = opcode;
+    f.flags = flags;
+    f.requestId = requestId;
+    f.length = length;
+    frameEncode(&f, out);
+    return FRAME_HEADER_SIZE;
+}
+
+/*         Name: frameParserReset
+ *  Description: readies a parser for the next frame header
+ *   Parameters: struct frame_parser*
+ *       Return: void
+ */
+void frameParserReset(struct frame_parser *p){
+    p->headerLen = 0;
+    p->remaining = 0;
+}
+
+/*         Name: frameParseHeader
+ *  Description: takes as many bytes as the current header still needs
+ *   Parameters: struct frame_parser*, input bytes, input length,
+ *               size_t* set to the number of bytes taken
+ *       Return: int, 1 once the header is complete, 0 if more bytes are
+ *               needed, -1 if the header is not a valid frame
+ */
+int frameParseHeader(struct frame_parser *p, const void *buf, size_t len, size_t *used){
+    size_t take = FRAME_HEADER_SIZE - p->headerLen;
+
+    if (take > len)
+        take = len;
+    memcpy(p->header + p->headerLen, buf, take);
+    p->headerLen += take;
+    *used = take;
+
+    if (p->headerLen < FRAME_HEADER_SIZE)
+        return 0;
+
+    frameDecode(p->header, &p->frame);
+    if (p->frame.version != FRAME_VERSION)
+        return -1;
+    p->remaining = p->frame.length;
+    return 1;
+}
+
+/*         Name: frameHeaderDone
+ *  Description: tells whether the parser holds a complete header
+ *   Parameters: struct frame_parser*
+ *       Return: int, 1 if p->frame is valid
+ */
+int frameHeaderDone(const struct frame_parser *p){
+    return p->headerLen == FRAME_HEADER_SIZE;
+}
+
+/*         Name: frameConsumePayload
+ *  Description: accounts for n payload bytes handled by the caller and
+ *               resets the parser when the frame ends
+ *   Parameters: struct frame_parser*, size_t byte count
+ *       Return: int, 1 if the frame is finished
+ */
+int frameConsumePayload(struct frame_parser *p, size_t n){
+    p->remaining -= n;
+    if (p->remaining > 0)
+        return 0;
+    frameParserReset(p);
+    return 1;
+}
+
+/*         Name: putU64
+ *  Description: stores a 64-bit value in network byte order
+ *   Parameters: output buffer, uint64_t
+ *       Return: void
+ */
+void putU64(unsigned char *out, uint64_t value){
+    value = htobe64(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+/*         Name: getU64
+ *  Description: loads a 64-bit value stored in network byte order
+ *   Parameters: input buffer
+ *       Return: uint64_t
+ */
+uint64_t getU64(const unsigned char *in){
+    uint64_t value;
+
+    memcpy(&value, in, sizeof(value));
+    return be64toh(value);
+}
+
+/*         Name: putU32
+ *  Description: stores a 32-bit value in network byte order
+ *   Parameters: output buffer, uint32_t
+ *       Return: void
+ */
+void putU32(unsigned char *out, uint32_t value){
+    value = htobe32(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+/*         Name: getU32
+ *  Description: loads a 32-bit value stored in network byte order
+ *   Parameters: input buffer
+ *       Return: uint32_t
+ */
+uint32_t getU32(const unsigned char *in){
+    uint32_t value;
+
+    memcpy(&value, in, sizeof(value));
+    return be32toh(value);
+}
+
+/*         Name: payloadString
+ *  Description: copies a payload into a NUL terminated string
+ *   Parameters: payload, payload length, output buffer, output size
+ *       Return: int, 0 on success, -1 if it doesn't fit or contains a NUL
+ */
+int payloadString(const void *payload, size_t len, char *out, size_t outSize){
+    if (len >= outSize || memchr(payload, '\0', len) != NULL)
+        return -1;
+    memcpy(out, payload, len);
+    out[len] = '\0';
+    return 0;
+}
@@ -0,0 +1,166 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Every message on the wire is a 16 byte frame header followed by
+ * `length` payload bytes. All header fields are in network byte order:
+ *
+ *   0       1       2               4               8              16
+ *   +-------+-------+---------------+---------------+---------------+
+ *   |version|opcode |     flags     |  request id   |    length     |
+ *   +-------+-------+---------------+---------------+---------------+
+ *
+ * Replies carry the request id of the request they answer.
+ *
+ * A get or put costs one round trip: the sender puts the size in the
+ * request (put) or FILE_INFO reply (get) and follows it immediately with
+ * DATA frames; a put is acknowledged once, after the last DATA frame.
+ *
+ * A delta put first fetches the block signatures of the server's copy,
+ * then sends DATA frames for new bytes and COPY frames for blocks the
+ * server already has, in file order.
+ *
+ * A listing is streamed as DATA frames of entry records, each
+ *
+ *   [LIST_LONG: u8 type, u64 size, u64 mtime] u16 name length, name
+ *
+ * where type is the first character of ls -l ('-', 'd', 'l', ...).
+ *
+ * A tree get or put (FLAG_TREE) moves a whole directory as one stream:
+ * an ENTRY frame for every directory and regular file, parents before
+ * what they hold, each file's ENTRY followed straight away by its DATA
+ * frames. Nothing is acknowledged per entry; the receiver creates and
+ * writes as the stream goes by, and the tree is answered once, by OK
+ * with the u64 entries stored and the u64 entries that failed. A put
+ * marks the end of its stream with an ENTRY frame without payload.
+ *
+ * Small files of a tree may instead travel many to a BATCH frame, whose
+ * index describes each file and is followed by all their bytes:
+ *
+ *   u16 count, count x (u32 mode, u64 size, u64 mtime, [FLAG_CHECKSUM:
+ *   u32 crc32c], u16 path length, path), file bytes in index order
+ *
+ * A put sends them whenever it likes; a get only if asked with FLAG_BATCH.
+ */
+#define FRAME_VERSION       1
+#define FRAME_HEADER_SIZE   16
+#define FRAME_MAX_CONTROL   4096            /* largest payload of a non-DATA frame */
+#define FRAME_MAX_DATA      (1024 * 1024)   /* largest payload of one DATA frame */
+
+/* requests, client to server */
+#define OP_LS           0x01    /* payload: none, or u8 LIST_ options and u8
+                                   LIST_SORT_ key; answered by DATA frames of
+                                   whole entry records, then OK with the u64
+                                   entry count */
+#define OP_CD           0x02    /* payload: path, relative to the session's
+                                   directory or, if absolute, to the server's
+                                   root; answered by OK with the new directory */
+#define OP_GET          0x03    /* payload: [FLAG_RANGE: u64 offset, u64 length]
+                                   [FLAG_RESUME: u64 offset, u32 crc32c of the
+                                   bytes before offset] path; with FLAG_TREE
+                                   path is a directory, sent as ENTRY frames */
+#define OP_PUT          0x04    /* payload: u64 size, [FLAG_RANGE: u64 offset,
+                                   u64 length] [FLAG_RESUME: u64 offset]
+                                   [FLAG_DELTA: u32 block size] path; DATA
+                                   (and with FLAG_DELTA, COPY) follows. With
+                                   FLAG_TREE only the directory's path, and
+                                   ENTRY frames follow */
+#define OP_MKDIR        0x05    /* payload: path */
+#define OP_QUIT         0x06    /* payload: none */
+#define OP_STAT         0x07    /* payload: path; answered by FILE_INFO, which
+                                   with FLAG_RESUME adds the file's u32 crc32c */
+#define OP_SIGNATURES   0x08    /* payload: path; answered by SIG_INFO */
+#define OP_HELLO        0x09    /* payload: u8 codecs the client can use, most
+                                   wanted first; answered by OK with the u8
+                                   codec the server picked, or none */
+#define OP_STATS        0x0a    /* payload: none; answered by DATA frames of the
+                                   server's metrics as Prometheus text, then OK */
+
+/* replies and data, either direction */
+#define OP_OK           0x80    /* payload: optional text */
+#define OP_ERROR        0x81    /* payload: message */
+#define OP_FILE_INFO    0x82    /* payload: u64 size, [range or resume: u64
+                                   offset, u64 length]; DATA follows a get */
+#define OP_SIG_INFO     0x83    /* payload: u64 size, u32 block size, u64 block
+                                   count; DATA follows with one SIG_RECORD_SIZE
+                                   record (u32 rolling, u64 xxh64) per block */
+#define OP_DATA         0x84    /* payload: file bytes */
+#define OP_COPY         0x85    /* payload: u32 first block, u32 block count of
+                                   the server's copy to reuse in a delta put */
+#define OP_ENTRY        0x86    /* payload: u8 type ('d' or '-'), u32 mode,
+                                   u64 size, u64 mtime, path relative to the
+                                   tree; a file's DATA follows */
+#define OP_BATCH        0x87    /* payload: index and bytes of several small
+                                   files of a tree; with FLAG_COMPRESS, u32 raw
+                                   length and all of it compressed */
+
+#define SIG_RECORD_SIZE 12
+#define TREE_HEADER     21      /* ENTRY payload before the path */
+#define BATCH_RECORD    22      /* index record before the path, without crc */
+#define BATCH_MAX       CODEC_MAX_CHUNK /* largest BATCH payload, uncompressed */
+#define BATCH_FILES     1024    /* most files in one BATCH frame */
+
+/* request flags */
+#define FLAG_RANGE      0x0001  /* get/put a byte range rather than the whole file */
+#define FLAG_RESUME     0x0002  /* continue a get/put that stopped part way */
+#define FLAG_DELTA      0x0004  /* put rebuilt from blocks of the server's copy */
+#define FLAG_COMPRESS   0x0008  /* on a get: DATA may come compressed; on DATA:
+                                   payload is u32 raw length and the chunk
+                                   compressed with the connection's codec */
+#define FLAG_CHECKSUM   0x0010  /* on a get/put: every DATA frame ends with the
+                                   u32 crc32c of all file bytes of the transfer
+                                   up to the end of that frame */
+#define FLAG_TREE       0x0020  /* get/put a directory and everything under it */
+#define FLAG_BATCH      0x0040  /* on a tree get: small files may come in BATCH frames */
+
+/* listing options and sort keys of OP_LS */
+#define LIST_LONG       0x01    /* entries carry type, size and mtime */
+#define LIST_ALL        0x02    /* include names starting with '.' */
+#define LIST_REVERSE    0x04    /* reverse the sort order */
+#define LIST_SORT_NONE  0       /* directory order, streamed as it is read */
+#define LIST_SORT_NAME  1
+#define LIST_SORT_SIZE  2       /* largest first */
+#define LIST_SORT_TIME  3       /* newest first */
+
+/* compression codecs offered in HELLO */
+#define CODEC_NONE      0
+#define CODEC_DEFLATE   1       /* zlib */
+#define CODEC_MAX_CHUNK (64 * 1024)     /* largest raw chunk compressed on its own */
+
+struct frame
+{
+    uint8_t     version;
+    uint8_t     opcode;
+    uint16_t    flags;
+    uint32_t    requestId;
+    uint64_t    length;
+};
+
+/* incremental frame parser; feed it bytes as they arrive */
+struct frame_parser
+{
+    unsigned char   header[FRAME_HEADER_SIZE];
+    size_t          headerLen;      /* header bytes collected so far */
+    struct frame    frame;          /* valid once headerLen == FRAME_HEADER_SIZE */
+    uint64_t        remaining;      /* payload bytes of frame not yet consumed */
+};
+
+void frameEncode(const struct frame*, unsigned char*);
+void frameDecode(const unsigned char*, struct frame*);
+size_t frameBuild(unsigned char*, uint8_t, uint16_t, uint32_t, uint64_t);
+
+void frameParserReset(struct frame_parser*);
+int frameParseHeader(struct frame_parser*, const void*, size_t, size_t*);
+int frameHeaderDone(const struct frame_parser*);
+int frameConsumePayload(struct frame_parser*, size_t);
+
+void putU64(unsigned char*, uint64_t);
+uint64_t getU64(const unsigned char*);
+void putU32(unsigned char*, uint32_t);
+uint32_t getU32(const unsigned char*);
+int payloadString(const void*, size_t, char*, size_t);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,308 +6,4483 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
 #include <sys/syscall.h>
+#include <sys/random.h>
+#include <limits.h>
+#include <linux/openat2.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "compress.h"
+#include "uring.h"
 
-#define MAX_BUF 1024
 #define PORT 6666
+#define MAX_EVENTS 64
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_REPLY (16 * 1024)
+#define CHECKSUM_SLICE (1024 * 1024)   /* bytes hashed before yielding to other connections */
+#define SIG_MIN_BLOCK (2 * 1024)
+#define SIG_MAX_BLOCK CHUNK_SIZE
+#define LIST_DENTS (32 * 1024)      /* getdents64 buffer of a listing */
+#define TREE_DEPTH 128              /* directories a tree get descends into */
+#define TREE_INLINE (8 * 1024)      /* files of a tree get sent from outbuf or a BATCH, not by themselves */
+#define URING_ENTRIES 256
+#define URING_CHUNK (256 * 1024)    /* file bytes per disk request, and per DATA frame of a get */
+#define URING_BUFFER (URING_CHUNK + 4096)   /* with room for a frame header and CRC trailer */
+#define URING_BUFFERS 32            /* registered buffers per worker */
+#define URING_SLOTS 4               /* buffers one transfer keeps in flight */
+#define URING_CONNS 512             /* transfers with fixed files at once, per worker */
+#define URING_POLL 1                /* user data of the poll on the epoll fd */
+#define POOL_CHUNK (68 * 1024)      /* one pooled buffer: a whole DATA or BATCH frame, page aligned */
+#define POOL_MIN 4                  /* buffers a worker has however small the budget: one tree get */
+#define MEMORY_BUDGET 64            /* MB of pooled buffers across all workers, --memory */
+#define CACHE_FILES 256             /* open files a worker keeps for repeated gets */
+#define CACHE_BUCKETS 512
+#define CACHE_DATA_MAX CODEC_MAX_CHUNK      /* hot files up to this size keep their bytes too */
+#define CACHE_DATA_BYTES (16 * 1024 * 1024) /* file bytes a worker keeps at most */
+#define CACHE_RECHECK 1             /* seconds a cached path is trusted without an fstatat */
+#define LATENCY_BUCKETS 24          /* command latency histogram: up to 16 us, doubling, then the rest */
+#define THROUGHPUT_BUCKETS 16       /* transfer rate histogram: up to 1 MB/s, doubling, then the rest */
+#define TUNE_INTERVAL (4 * 1024 * 1024)     /* bytes a transfer moves between buffer retunes, --buffer auto */
+#define TUNE_MAX (64 * 1024 * 1024)         /* largest socket buffer a retune asks for */
+#define FAIR_QUANTUM (256 * 1024)   /* bytes a transfer of weight 1 moves per turn before the others have theirs */
+#define MAX_WEIGHT 16               /* largest --weight, so a turn stays a few MB */
+#define WEIGHT_RULES 64             /* --weight options the server takes */
+#define RATE_TICK 10                /* ms between token refills while transfers wait for them */
+#define THROUGHPUT_MIN (1024 * 1024)    /* gets and puts smaller than this only count as latency */
+#define COMMAND_SLOTS 32            /* latency by request opcode, tree gets and puts 16 on */
+#define CLIENT_SLOTS 16             /* busiest client addresses each worker keeps counts for */
 
-void handleSigInt(int);
-void cleanUp();
-void handlels(char*);
-void clearBuffer(char*);
-int fileExists(const char*);
+/* what a connection is currently waiting for */
+enum connState {
+    STATE_READ_FRAME,       /* the next request frame */
+    STATE_SEND_REPLY,       /* outbuf to drain, then nextState */
+    STATE_GET_DATA,         /* DATA frames still going out */
+    STATE_PUT_DATA,         /* DATA frames still coming in */
+    STATE_CHECKSUM,         /* hashing a file prefix for a resume */
+    STATE_SIGNATURES,       /* block signatures still going out */
+    STATE_LIST,             /* directory entries still going out */
+    STATE_TREE_GET,         /* ENTRY and BATCH frames of a tree still going out */
+    STATE_TREE_PUT,         /* the next ENTRY or BATCH frame of a tree coming in */
+    STATE_STATS             /* the text of a STATS reply still going out */
+};
+
+/*
+ * A file kept open by a worker's cache. Its path is the key, relative to
+ * rootFd; an inotify watch on the file drops it as soon as the file is
+ * written, truncated, renamed or unlinked, and the path is checked again
+ * with fstatat now and then in case a directory above it moved.
+ */
+struct cacheEntry
+{
+    struct cacheEntry *next;        /* in its hash bucket */
+    struct cacheEntry *newer;       /* in least recently used order */
+    struct cacheEntry *older;
+    char   *path;
+    uint32_t hash;
+    int     fd;
+    struct stat st;
+    int     wd;                     /* inotify watch on the file */
+    unsigned refs;                  /* transfers using fd or data */
+    int     stale;                  /* out of the cache, freed with the last reference */
+    unsigned char *data;            /* the file's bytes once it is hot, or NULL */
+    uint32_t crc;                   /* and their CRC32C */
+    time_t  checked;                /* when path was last seen to lead to the file */
+};
+
+/* a worker's open files, looked up by path */
+struct fileCache
+{
+    int     inotifyFd;              /* -1 leaves the cache off */
+    struct cacheEntry *buckets[CACHE_BUCKETS];
+    struct cacheEntry *newest;
+    struct cacheEntry *oldest;
+    unsigned count;
+    size_t  dataBytes;              /* of data held by the entries */
+};
+
+/* how long one kind of command took, kept by each worker */
+struct commandStats
+{
+    unsigned long count;
+    unsigned long micros;
+    unsigned long buckets[LATENCY_BUCKETS]; /* bucket i up to 16 us << i, the last unbounded */
+};
+
+/* a client address and what its sessions on one worker did */
+struct clientStats
+{
+    uint32_t addr;                  /* network order; 0 while the slot is unused */
+    unsigned long bytes;
+    unsigned long commands;
+};
+
+/* one event loop thread with its own listener and connection set */
+struct worker
+{
+    int         id;
+    pthread_t   thread;
+    int         listenSocket;
+    int         epollFd;
+    /* written only by the owning thread, read with COUNTER_GET */
+    unsigned long accepted;
+    unsigned long active;
+    unsigned long commands;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long cacheStale;       /* entries dropped because their file changed */
+    unsigned long poolWaits;        /* transfers that had to wait for buffers */
+    unsigned long sendBlocked;      /* sends that found the socket full */
+    unsigned long sendShort;        /* sends that took only part of what they were given */
+    unsigned long recvBlocked;      /* reads that found the socket empty */
+    unsigned long errors;           /* requests answered with ERROR */
+    unsigned long retunes;          /* socket buffers grown by --buffer auto */
+    unsigned long yields;           /* turns a transfer ended to let the others go */
+    unsigned long throttles;        /* times a transfer waited for tokens */
+    struct commandStats commandStats[COMMAND_SLOTS];
+    unsigned long throughput[THROUGHPUT_BUCKETS];   /* gets and puts by MB/s, bucket i up to 1 << i */
+    unsigned long throughputSum;    /* of their MB/s */
+    struct clientStats clients[CLIENT_SLOTS];
+    unsigned char *pool;            /* this worker's share of the memory budget */
+    unsigned char **poolFree;       /* its unused buffers, most recently freed last */
+    int     poolSize;
+    int     poolFreeCount;
+    struct connection *waitHead;    /* transfers waiting for buffers, oldest first */
+    struct connection *waitTail;
+    struct connection *waking;      /* the waiter poolWake is running, served ahead of the rest */
+    int64_t tokens;                 /* bytes this worker's share of --rate lets through now */
+    struct timespec refilled;
+    int     timerFd;                /* ticks every RATE_TICK while transfers wait for tokens */
+    struct connection *throttledHead;   /* those transfers, oldest first */
+    struct connection *throttledTail;
+    struct fileCache cache;
+    struct uring *ring;     /* io_uring backend, or NULL for plain epoll */
+    unsigned char *ioBuffers;   /* URING_BUFFERS of URING_BUFFER bytes */
+    int     ioFree[URING_BUFFERS];
+    int     ioFreeCount;
+    int     fixedBuffers;   /* ioBuffers are registered with the ring */
+    int     fileFree[URING_CONNS];  /* unused pairs of fixed file slots */
+    int     fileFreeCount;
+};
+
+/* single-writer counters: a relaxed load and store, never a locked add */
+#define COUNTER_GET(c)      __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#define COUNTER_ADD(c, n)   __atomic_store_n(&(c), COUNTER_GET(c) + (n), __ATOMIC_RELAXED)
+
+/* socket bytes count for the worker and for the connection's command, and against its turn and rates */
+#define COUNT_IN(conn, n)   do { COUNTER_ADD((conn)->worker->bytesIn, n); CHARGE(conn, n); } while (0)
+#define COUNT_OUT(conn, n)  do { COUNTER_ADD((conn)->worker->bytesOut, n); CHARGE(conn, n); } while (0)
+/* a send or receive takes no more than is left of the transfer's turn */
+#define TURN_SIZE(conn, len)    (((conn)->turnLeft > 0 && (int64_t)(len) > (conn)->turnLeft) ? \
+                                 (size_t)(conn)->turnLeft : (size_t)(len))
+#define CHARGE(conn, n)     do { (conn)->moved += (n); (conn)->turnLeft -= (n); (conn)->tokens -= (n); \
+                                 (conn)->worker->tokens -= (n); } while (0)
+
+/* a client address and the share of the link its sessions get, --weight */
+struct weightRule
+{
+    uint32_t addr;          /* network order */
+    int     weight;         /* FAIR_QUANTUM bytes per turn */
+};
+
+/* what a buffer of a transfer on the io_uring backend is doing */
+enum ioState {
+    IO_FREE,
+    IO_READING,             /* get: file bytes coming in from disk */
+    IO_READY,               /* get: read, waiting its turn on the socket */
+    IO_SENDING,             /* get: one DATA frame going out */
+    IO_FILLING,             /* put: collecting received bytes */
+    IO_WRITING              /* put: bytes going out to disk */
+};
+
+struct ioSlot
+{
+    int     state;
+    int     buf;            /* index of the worker's buffer */
+    unsigned char *data;
+    size_t  bytes;          /* file bytes the slot holds */
+    size_t  len;            /* bytes of the current request */
+    size_t  done;           /* of len */
+    int64_t offset;         /* file offset of the slot's first byte */
+};
+
+/* one entry of a sorted directory listing */
+struct listEntry
+{
+    size_t  name;           /* offset of its name in listing.names */
+    uint16_t nameLen;
+    char    type;           /* first character of ls -l */
+    int64_t size;
+    int64_t mtime;
+};
+
+/* a directory listing in progress */
+struct listing
+{
+    int     dirFd;
+    uint8_t options;        /* LIST_ flags of the request */
+    uint8_t sort;           /* LIST_SORT_ key */
+    size_t  dentLen;        /* bytes returned by the last getdents64 */
+    size_t  dentOff;        /* first entry of dents not yet consumed */
+    int     sorted;         /* entries holds the whole directory, in order */
+    struct listEntry *entries;
+    size_t  count;
+    size_t  capacity;
+    size_t  next;           /* next of entries to send */
+    char   *names;          /* NUL terminated names of entries */
+    size_t  namesLen;
+    size_t  namesCap;
+    uint64_t sent;
+    char    dents[LIST_DENTS];
+};
 
-int myListenSocket, clientSocket;
-struct header hdr;
-FILE *file;
+/* a tree get or put in progress */
+struct tree
+{
+    uint16_t flags;         /* FLAG_CHECKSUM, FLAG_COMPRESS and FLAG_BATCH of the request */
+    uint64_t entries;
+    uint64_t failed;
+    /* get: the directories being read, the tree's top first */
+    struct listing *dirs[TREE_DEPTH];
+    size_t  pathLen[TREE_DEPTH];    /* length of path at each of them */
+    int     depth;
+    int     fd;             /* entry read but not yet queued, or -1 */
+    struct stat st;         /* and what it is */
+    char    rel[PATH_MAX];  /* and its path in the tree */
+    size_t  relLen;
+    /* get: small files gathered for the next BATCH frame, then the frame */
+    unsigned char *index;
+    size_t  indexLen;
+    unsigned char *data;
+    size_t  dataLen;
+    unsigned count;
+    unsigned char *batch;
+    size_t  batchLen;
+    size_t  batchOff;
+    /* put: the top of the tree and the directory of the last entry */
+    int     rootFd;
+    int     dirFd;
+    int64_t mtime;          /* of the file being received */
+    /* get: directory being read; put: the one dirFd is open on */
+    char    path[PATH_MAX];
+};
 
-struct header
+struct connection
 {
-    long    data_length;
+    int     fd;
+    int     state;
+    int     nextState;
+    uint32_t events;        /* epoll interest currently registered */
+    struct worker *worker;
+    struct frame_parser parser;
+    uint32_t requestId;     /* request being answered */
+    char    inbuf[CHUNK_SIZE];
+    size_t  inoff;          /* first unparsed byte of inbuf */
+    size_t  inend;
+    unsigned char outbuf[FRAME_HEADER_SIZE + MAX_REPLY];
+    size_t  outlen;
+    size_t  outoff;
+    int64_t datalen;
+    int64_t dataoff;
+    int64_t chunkLeft;      /* bytes of the current outgoing DATA frame */
+    int64_t fileBase;       /* file offset of the first byte transferred */
+    int     fileFd;         /* file being served by get or written by put */
+    struct cacheEntry *cached;      /* cache entry fileFd belongs to, or NULL */
+    int     pipeFd[2];      /* splice fallback when sendfile can't be used */
+    size_t  piped;          /* bytes sitting in pipeFd */
+    int     useSplice;
+    uint8_t sumFor;         /* OP_GET or OP_STAT waiting on the checksum */
+    int64_t sumLen;         /* file prefix being hashed */
+    int64_t sumOff;
+    uint32_t sum;
+    uint32_t sumWant;       /* client's checksum of its prefix, for OP_GET */
+    uint32_t blockSize;     /* signature block size of a delta put */
+    int     delta;          /* put arrives as DATA and COPY frames */
+    int     basisFd;        /* old copy the COPY frames of a delta put read from */
+    int64_t basisSize;
+    int     deltaDir;       /* directory holding deltaPath and tempPath */
+    char   *deltaPath;      /* file a delta put replaces once it is rebuilt */
+    char   *tempPath;       /* where it is rebuilt */
+    struct compressor zip;  /* codec picked in HELLO, and its counters */
+    int     compress;       /* current get sends compressed DATA frames */
+    unsigned char *zbuf;    /* one whole DATA frame of a compressed or checksummed get, pooled */
+    size_t  zlen;
+    size_t  zoff;
+    int     verify;         /* DATA frames of this transfer end in a CRC32C */
+    uint32_t crc;           /* CRC32C of the transfer's file bytes so far */
+    int     corrupt;        /* a DATA frame failed its CRC32C */
+    struct listing *list;   /* directory being listed, or NULL */
+    struct tree *tree;      /* tree being sent or received, or NULL */
+    int     dirFd;          /* session's current directory */
+    char   *cwd;            /* and its path under rootFd, "." at the root */
+    struct ioSlot io[URING_SLOTS];  /* transfer buffers on the io_uring backend */
+    int     ioSlots;        /* how many of io hold a buffer */
+    int     ioHead;         /* next slot to send (get) or finish (put), in file order */
+    int     ioTail;         /* next slot to read into (get) or fill (put) */
+    int     ioBusy;         /* slots not IO_FREE */
+    int     ioInflight;     /* requests the ring still owns */
+    int64_t ioQueued;       /* bytes of a get handed to disk reads */
+    int     ioFile;         /* pair of fixed file slots, or -1 */
+    int     ioWait;         /* waiting on the ring rather than on epoll */
+    int     ioError;
+    int     closing;        /* closed, but the ring still holds its buffers */
+    int     poolWait;       /* buffers it waits for on the worker's list, 0 if none */
+    struct connection *waitNext;
+    uint32_t peer;          /* client address, network order */
+    int     command;        /* commandStats slot of the request being served, or -1 */
+    struct timespec started;    /* when it came in */
+    uint64_t moved;         /* socket bytes it has moved so far */
+    uint64_t tunedMoved;    /* moved at the last buffer retune, --buffer auto */
+    struct timespec tunedAt;
+    int64_t turnLeft;       /* bytes left of its turn; below zero, owed from the last one */
+    int     weight;         /* FAIR_QUANTUM bytes it gets per turn, --weight */
+    int     yielded;        /* ended its turn with work left; EPOLLOUT brings it back */
+    int64_t tokens;         /* bytes --session-rate lets it move now */
+    struct timespec refilled;
+    int     throttled;      /* waiting on the worker's list for tokens */
+    struct connection *throttleNext;
+    char   *stats;          /* text of a STATS reply, STATE_STATS */
+    size_t  statsLen;
+    size_t  statsOff;
 };
 
-int main()
+void handleSigInt(int);
+void cleanUp();
+int setNonBlocking(int);
+int openListenSocket(int);
+void *workerMain(void*);
+void printWorkerStats();
+void acceptConnections(struct worker*);
+void handleConnection(struct connection*);
+void closeConnection(struct connection*);
+int dispatchFrame(struct connection*, const struct frame*, unsigned char*);
+int queueFrame(struct connection*, uint8_t, const void*, size_t);
+void reply(struct connection*, uint8_t, const void*, size_t, int);
+int fillInput(struct connection*);
+int readFrame(struct connection*, struct frame*, unsigned char**);
+int flushOutput(struct connection*);
+int sendFileData(struct connection*);
+void retuneBuffers(struct connection*, int);
+int recvFileData(struct connection*);
+void finishTransfer(struct connection*);
+void startChecksum(struct connection*, uint8_t, int64_t, uint32_t);
+int checksumPrefix(struct connection*);
+void finishChecksum(struct connection*);
+uint32_t signatureBlockSize(int64_t);
+int queueSignatures(struct connection*);
+int openDeltaTarget(struct connection*, char*);
+int copyBlocks(struct connection*);
+int commitDelta(struct connection*);
+int fillInputTo(struct connection*, size_t);
+int sendBufferedData(struct connection*);
+int checksumChunk(struct connection*);
+int recvCompressedChunk(struct connection*);
+int checkTrailer(struct connection*);
+int startListing(struct connection*, const unsigned char*, size_t);
+int nextDirEntry(struct listing*, struct dirent64**);
+int describeEntry(struct listing*, struct dirent64*, struct listEntry*);
+int addEntry(struct listing*, const struct listEntry*, const char*);
+int compareEntries(const void*, const void*, void*);
+size_t encodeEntry(unsigned char*, uint8_t, const struct listEntry*, const char*);
+int queueListing(struct connection*);
+void freeListing(struct connection*);
+int startTree(struct connection*, char*, uint16_t, int);
+int nextTreeEntry(struct tree*);
+int queueTree(struct connection*);
+int queueTreeData(struct connection*);
+int addToBatch(struct connection*);
+void sealBatch(struct connection*);
+int flushBatch(struct connection*);
+int storeBatch(struct connection*, const struct frame*, unsigned char*);
+int receiveTreeEntry(struct connection*, const struct frame*, unsigned char*);
+int openTreeParent(struct tree*, char*, char**);
+void freeTree(struct connection*);
+int joinPath(const char*, const char*, char*, size_t);
+int resolvePath(struct connection*, const char*, int, mode_t);
+int resolveParent(struct connection*, char*, char**);
+int createTempAt(int, char*);
+int openRegular(struct connection*, const char*, struct stat*);
+int poolInit(struct worker*, size_t);
+int poolTake(struct connection*, unsigned char**, int);
+void poolGive(struct worker*, unsigned char*);
+void poolWake(struct worker*);
+void poolLeave(struct connection*);
+void rateInit(struct worker*);
+int parseWeight(const char*);
+int sessionWeight(uint32_t);
+int takeTurn(struct connection*);
+void refill(int64_t*, struct timespec*, uint64_t);
+void throttle(struct connection*);
+void throttleLeave(struct connection*);
+void rateTick(struct worker*);
+int isBulk(struct connection*);
+void endCommand(struct connection*);
+void countClient(struct connection*);
+void writeStats(FILE*);
+int startStats(struct connection*);
+int openMetricsSocket(int);
+void *metricsMain(void*);
+void cacheInit(struct worker*);
+int openCached(struct connection*, const char*, struct stat*);
+void closeCached(struct connection*, int);
+void cacheKeep(struct fileCache*, struct cacheEntry*);
+void cacheDrop(struct fileCache*, struct cacheEntry*);
+void cacheUnwatch(struct fileCache*, int);
+void cacheFree(struct fileCache*, struct cacheEntry*);
+void cacheEvents(struct worker*);
+int preallocate(int, int64_t);
+void handleEvents(struct worker*, struct epoll_event*, int);
+int uringStart(struct worker*);
+void uringLoop(struct worker*);
+int uringAttach(struct connection*);
+void uringDetach(struct connection*);
+int uringQueue(struct connection*, int);
+void uringComplete(uint64_t, int32_t);
+void uringCancel(struct connection*);
+int uringSendData(struct connection*);
+size_t uringWriteData(struct connection*, const char*, size_t);
+int uringStartWrite(struct connection*);
+int uringFlushWrites(struct connection*);
+
+struct worker *workers;
+int numWorkers;
+int rootFd;         /* directory sessions are confined to */
+int useUring;       /* --io uring */
+size_t memoryBudget = (size_t)MEMORY_BUDGET << 20;  /* --memory */
+int metricsPort;    /* --metrics, 0 for none */
+int socketBuffer;   /* --buffer, bytes of SO_SNDBUF and SO_RCVBUF; 0 leaves them to the kernel */
+int autoTune;       /* --buffer auto */
+const char *congestion;     /* --congestion, NULL for the system default */
+uint64_t rateLimit;         /* --rate, bytes/s across all sessions, split evenly over the workers; 0 for none */
+uint64_t sessionRate;       /* --session-rate, bytes/s of each session; 0 for none */
+struct weightRule weightRules[WEIGHT_RULES];    /* --weight */
+int numWeightRules;
+
+int main(int argc, char *argv[])
 {
-    
-    char* logName[MAX_BUF], ip[MAX_BUF], buffer[MAX_BUF] , str[MAX_BUF];
-    int  port, i, addrSize, bytesRcv;
-    struct sockaddr_in  myAddr, clientAddr;
-    socklen_t len;
-    
+
+    int  port, i, sig;
+    sigset_t signals;
+    struct option options[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "root",    required_argument, NULL, 'r' },
+        { "io",      required_argument, NULL, 'i' },
+        { "memory",  required_argument, NULL, 'm' },
+        { "metrics", required_argument, NULL, 'M' },
+        { "buffer",  required_argument, NULL, 'b' },
+        { "congestion", required_argument, NULL, 'c' },
+        { "rate",    required_argument, NULL, 'R' },
+        { "session-rate", required_argument, NULL, 'S' },
+        { "weight",  required_argument, NULL, 'W' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *root = ".";
+
     port = PORT;
-    
+    numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((i = getopt_long(argc, argv, "w:r:i:m:M:b:c:R:S:W:", options, NULL)) != -1) {
+        switch (i) {
+        case 'w':
+            numWorkers = atoi(optarg);
+            break;
+        case 'r':
+            root = optarg;
+            break;
+        case 'm':
+            memoryBudget = (size_t)atol(optarg) << 20;
+            break;
+        case 'M':
+            metricsPort = atoi(optarg);
+            break;
+        case 'b':
+            if (strcmp(optarg, "auto") == 0)
+                autoTune = 1;
+            else
+                socketBuffer = atoi(optarg) * 1024;
+            break;
+        case 'c':
+            congestion = optarg;
+            break;
+        case 'R':
+            rateLimit = atof(optarg) * 1024 * 1024;
+            break;
+        case 'S':
+            sessionRate = atof(optarg) * 1024 * 1024;
+            break;
+        case 'W':
+            if (parseWeight(optarg) < 0) {
+                fprintf(stderr, "Error: --weight takes ADDR=N with N from 1 to %d, at most %d times\n",
+                        MAX_WEIGHT, WEIGHT_RULES);
+                exit(-1);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "uring") == 0) {
+                useUring = 1;
+                break;
+            }
+            if (strcmp(optarg, "epoll") == 0) {
+                useUring = 0;
+                break;
+            }
+            /* fall through */
+        default:
+            fprintf(stderr, "Usage: %s [--workers N] [--root DIR] [--io epoll|uring] [--memory MB]\n"
+                            "       [--metrics PORT] [--buffer KB|auto] [--congestion NAME] [--rate MB/s]\n"
+                            "       [--session-rate MB/s] [--weight ADDR=N]...\n", argv[0]);
+            exit(-1);
+        }
+    }
+    if (numWorkers < 1)
+        numWorkers = 1;
+
+    /* a transfer on the ring sends one URING_CHUNK frame per turn, whatever its weight */
+    if (useUring && numWeightRules > 0) {
+        fprintf(stderr, "Error: --weight works with --io epoll only\n");
+        exit(-1);
+    }
+
+    /* every session starts here and can't get out of it */
+    rootFd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        printf("Error: Server couldn't open root directory %s\n", root);
+        exit(-1);
+    }
+
+    /*
+     * Workers never see SIGINT/SIGUSR1; the main thread collects them
+     * with sigwait so the handlers can safely print and tear down.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
     printf("--== Server Running --==\n");
-    
-    printf("--== Creating Socket --==");
-    myListenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (myListenSocket < 0) {
+
+    workers = calloc(numWorkers, sizeof(struct worker));
+    if (workers == NULL) {
+        printf("Error: Server couldn't allocate workers\n");
+        exit(-1);
+    }
+
+    printf("--== Starting %d workers on port %d --==\n", numWorkers, port);
+    for (i = 0; i < numWorkers; i++) {
+        workers[i].id = i;
+        workers[i].listenSocket = openListenSocket(port);
+
+        workers[i].epollFd = epoll_create1(0);
+        if (workers[i].epollFd < 0) {
+            printf("Error: Server couldn't create epoll instance\n");
+            exit(-1);
+        }
+        if (useUring && uringStart(&workers[i]) < 0)
+            printf("io_uring unavailable (%s), worker %d uses epoll\n", strerror(errno), i);
+        cacheInit(&workers[i]);
+        rateInit(&workers[i]);
+        if (poolInit(&workers[i], memoryBudget / numWorkers) < 0) {
+            printf("Error: Server couldn't map buffers for worker %d\n", i);
+            exit(-1);
+        }
+
+        if (pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) != 0) {
+            printf("Error: Server couldn't start worker %d\n", i);
+            exit(-1);
+        }
+    }
+
+    /* Prometheus scrapes the same text the STATS command answers with */
+    if (metricsPort > 0) {
+        pthread_t metrics;
+        int fd = openMetricsSocket(metricsPort);
+
+        if (fd < 0 || pthread_create(&metrics, NULL, metricsMain, (void*)(intptr_t)fd) != 0)
+            printf("Error: Server couldn't serve metrics on port %d\n", metricsPort);
+        else
+            printf("--== Metrics on http://127.0.0.1:%d/metrics --==\n", metricsPort);
+    }
+
+    printf("--== Server waiting for connection requests --==\n");
+
+    while (sigwait(&signals, &sig) == 0) {
+        if (sig == SIGUSR1)
+            printWorkerStats();
+        else
+            handleSigInt(sig);
+    }
+
+    return 0;
+}
+
+
+/*         Name: openListenSocket
+ *  Description: creates a non-blocking SO_REUSEPORT listener on port so that
+ *               every worker can bind its own and the kernel spreads
+ *               incoming connections across them. Accepted connections
+ *               inherit its --buffer sizes, set before listen so the
+ *               window scale allows for them, and its --congestion
+ *   Parameters: int port
+ *       Return: int socket descriptor; exits on failure
+ */
+int openListenSocket(int port){
+    struct sockaddr_in  myAddr;
+    int listenSocket, i, on = 1;
+
+    listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket < 0) {
         printf("Error: Server couldn't open socket\n");
         exit(-1);
     }
-    
-    
-    printf("--== Setting up Server Address --==\n");
+
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        printf("Error: Server couldn't set SO_REUSEPORT\n");
+        exit(-1);
+    }
+    if (socketBuffer > 0) {
+        setsockopt(listenSocket, SOL_SOCKET, SO_SNDBUF, &socketBuffer, sizeof(socketBuffer));
+        setsockopt(listenSocket, SOL_SOCKET, SO_RCVBUF, &socketBuffer, sizeof(socketBuffer));
+    }
+    if (congestion != NULL &&
+        setsockopt(listenSocket, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion)) < 0) {
+        printf("Error: Server couldn't use congestion control %s: %s\n", congestion, strerror(errno));
+        exit(-1);
+    }
+
     memset(&myAddr, 0, sizeof(myAddr));
     myAddr.sin_family = AF_INET;
     myAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     myAddr.sin_port = htons(port);
-    
-    
-    printf("--== Server Binding to socket --==\n");
-    i = bind(myListenSocket, (struct sockaddr *) &myAddr, sizeof(myAddr));
+
+    i = bind(listenSocket, (struct sockaddr *) &myAddr, sizeof(myAddr));
     if (i < 0) {
         printf("Error: Server couldn't bind socket\n");
         exit(-1);
     }
-    
-    
-    printf("--== Server Listening to Socket --==\n");
-    i = listen(myListenSocket, 5);
-    if (i < 0) {
+
+    i = listen(listenSocket, SOMAXCONN);
+    if (i < 0 || setNonBlocking(listenSocket) < 0) {
         printf("Error: Server couldn't listen\n");
         exit(-1);
     }
-    
-    
-    while (1){
-    printf("--== Server waiting for connection request --==\n");
-    addrSize = sizeof(clientAddr);
-    clientSocket = accept(myListenSocket, (struct sockaddr *) &clientAddr,  &addrSize);
-    if (clientSocket < 0) {
-        printf("Error: Server couldn't accept the connection\n");
+
+    return listenSocket;
+}
+
+/*         Name: workerMain
+ *  Description: runs one worker's event loop over its listener and the
+ *               connections accepted from it
+ *   Parameters: struct worker*
+ *       Return: void*, never returns
+ */
+void *workerMain(void *arg){
+    struct worker *w = arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    int n;
+
+    /* the listening socket is the only entry without a connection */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->epollFd, EPOLL_CTL_ADD, w->listenSocket, &ev) < 0) {
+        printf("Error: worker %d couldn't watch listening socket\n", w->id);
         exit(-1);
     }
-    
-    printf("--== Connection Successful, Server Ready to read Messages! --==\n");
-    
-    
-    
-    while ((bytesRcv = recv(clientSocket, buffer, sizeof(buffer), 0)) > 0){
-        
-        if (buffer[0] == 'l' && buffer[1] == 's') {
-            
-            handlels(buffer);
-            send(clientSocket, buffer, sizeof(buffer), 0);
-            
-            //handle cd
-        } else if (buffer[0] == 'c' && buffer[1] == 'd') {
-            printf("received cd command\n");
-            
-            char directory[MAX_BUF] = {0};
-            int i;
-            
-            for (i = 3; buffer[i] != '\0'; i++){
-                directory[i-3] = buffer[i];
-            }
-            
-            if (chdir( directory) == 0 ){
-                printf("cd success\n");
-                send(clientSocket, "success", sizeof("success"), 0);
-            } else {
-                printf("cd fail\n");
-                send(clientSocket, "fail\0", sizeof("fail\0"), 0);
-            }
-            
-            //handle get
-        } else if (buffer[0] == 'g' && buffer[1] == 'e' && buffer[2] == 't'){
-            printf("received get command \n");
-            
-            char fileName[MAX_BUF] = {0};
-            int i;
-            
-            for (i = 4; buffer[i] != '\0'; i++){
-                fileName[i-4] = buffer[i];
-            }
-            
-            struct header hdr;
 
-            if (!fileExists(fileName)) {
-                file = fopen(fileName, "rb");
+    if (w->ring != NULL) {
+        uringLoop(w);
+        return NULL;
+    }
 
-                fseek(file, 0, SEEK_END);
-                unsigned long filesize = ftell(file);
+    while (1) {
+        n = epoll_wait(w->epollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Error: epoll_wait failed\n");
+            exit(-1);
+        }
+        handleEvents(w, events, n);
+        poolWake(w);
+    }
 
-                // send header to client
-                hdr.data_length = filesize;
-                send(clientSocket, (const char*)(&hdr), sizeof(hdr), 0);
+    return NULL;
+}
 
-                printf("Sent size of file to client");
+/*         Name: handleEvents
+ *  Description: serves the connections epoll_wait reported ready, control
+ *               commands first: an ls or cd that became ready along with
+ *               bulk transfers is answered before they take their turns.
+ *               Throttled transfers, which epoll doesn't report, come last
+ *   Parameters: struct worker*, events, number of events
+ *       Return: void
+ */
+void handleEvents(struct worker *w, struct epoll_event *events, int n){
+    char bulk[MAX_EVENTS];
+    void *ptr;
+    int i, pass, ticked = 0;
 
-                // recv msg from client to begin sending file
-                recv(clientSocket, buffer, sizeof(buffer),0);
+    /* sorted up front, as serving one connection can close it */
+    for (i = 0; i < n; i++) {
+        ptr = events[i].data.ptr;
+        bulk[i] = ptr != NULL && ptr != &w->cache && ptr != &w->timerFd && isBulk(ptr);
+    }
 
-                if (strcmp(buffer, "clientReady") != 0) {
-                  printf("client not ready\n");
-                  return -1;
-                }
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < n; i++) {
+            if (bulk[i] != pass)
+                continue;
+            ptr = events[i].data.ptr;
+            if (ptr == NULL)
+                acceptConnections(w);
+            else if (ptr == &w->cache)
+                cacheEvents(w);
+            else if (ptr == &w->timerFd)
+                ticked = 1;
+            else
+                handleConnection(ptr);
+        }
+    }
+    if (ticked)
+        rateTick(w);
+}
 
+/*         Name: isBulk
+ *  Description: tells a connection moving file data from one serving a
+ *               control command or waiting for its next request
+ *   Parameters: struct connection*
+ *       Return: int, 1 for a transfer
+ */
+int isBulk(struct connection *conn){
+    switch (conn->state) {
+    case STATE_GET_DATA:
+    case STATE_PUT_DATA:
+    case STATE_CHECKSUM:
+    case STATE_SIGNATURES:
+    case STATE_TREE_GET:
+    case STATE_TREE_PUT:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-                // client ready to receive data
-                char *buffers = (char*)malloc(sizeof(char)*filesize);
-                rewind(file);
-                // store read data into buffer
-                fread(buffers, sizeof(char), filesize, file);
-                // send buffer to client
+/*         Name: printWorkerStats
+ *  Description: prints each worker's counters, to check load is spread evenly
+ *   Parameters: none
+ *       Return: void
+ */
+void printWorkerStats(){
+    int i;
 
-                #ifdef DEBUG
-                printf("[DEBUG] Sending file to server.\n");
-                #endif
+    for (i = 0; i < numWorkers; i++) {
+        printf("worker %d (%s): accepted %lu active %lu commands %lu bytes in %lu out %lu "
+               "cache hits %lu misses %lu stale %lu buffers %d waits %lu\n",
+               i, workers[i].ring ? "io_uring" : "epoll",
+               COUNTER_GET(workers[i].accepted), COUNTER_GET(workers[i].active),
+               COUNTER_GET(workers[i].commands), COUNTER_GET(workers[i].bytesIn),
+               COUNTER_GET(workers[i].bytesOut), COUNTER_GET(workers[i].cacheHits),
+               COUNTER_GET(workers[i].cacheMisses), COUNTER_GET(workers[i].cacheStale),
+               workers[i].poolSize, COUNTER_GET(workers[i].poolWaits));
+    }
+    fflush(stdout);
+}
 
-                int sent = 0, n = 0;
-                while (sent < filesize) {
-                n = send(clientSocket, buffers+sent, filesize-sent, 0); // error checking is done in actual code and it sends perfectly
-                if (n == -1)
-                    break;  // ERROR
 
-                sent += n;
-                }
+/*         Name: setNonBlocking
+ *  Description: puts a descriptor into non-blocking mode
+ *   Parameters: int file descriptor
+ *       Return: int, 0 on success and -1 on failure
+ */
+int setNonBlocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
 
-                printf("Sent file to server\n");
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
+/*         Name: acceptConnections
+ *  Description: accepts every pending connection and registers it with epoll
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void acceptConnections(struct worker *w){
+    struct sockaddr_in clientAddr;
+    socklen_t addrSize;
+    struct epoll_event ev;
+    struct connection *conn;
+    int fd, on = 1;
 
-                fclose(file);
-                free(buffers);
-            } else {
-                hdr.data_length = -1;
-                send(clientSocket, (const char*)(&hdr), sizeof(hdr), 0);
-            }
-            
-            //handle put
-        } else if ( buffer[0] == 'p' && buffer[1] == 'u' && buffer[2] == 't'){
-            printf("received put command \n");
-            
-            
-            char fileName[MAX_BUF] = {0};
-            int i;
-            char c;
-            int k=0;
-            
-            for (i = 4; buffer[i] != '\0'; i++){
-                fileName[i-4] = buffer[i];
-            }
-            
-            file = fopen(fileName, "w");
-            send(clientSocket, "filesize", sizeof("filesize"), 0);
-            
-            hdr.data_length = 0;
-            // receive header
-            recv(clientSocket, (const char*)(&hdr), sizeof(hdr), 0);
-            printf("data_length = %d\n", hdr.data_length);
-            // resize buffer
-            char *tempBuffer = calloc(sizeof(char), hdr.data_length);
-            // receive data
-            send(clientSocket, "serverReady", sizeof("serverReady"), 0);
-
-            int filesize = hdr.data_length;
-            int received = 0, n = 0;
-            while(received < filesize) {
-                n = recv(clientSocket, tempBuffer+received, filesize-received, 0);
-                if(n == -1)
-                    break;
-                received += n;
-            }
-            fwrite(tempBuffer, 1, sizeof(char)*hdr.data_length, file);
-            
-            printf("finished writing\n");
-            fclose(file);
-            free(tempBuffer);
-            printf("finished sending\n");
-            send(clientSocket, "success", sizeof("success"), 0);
-            
-            //handle mkdir
-        } else if ( buffer[0] == 'm' && buffer[1] == 'k' && buffer[2] == 'd'&& buffer[3] == 'i'&& buffer[4] == 'r') {
-            printf("received mkdir command \nq  ");
-            
-            char directory[MAX_BUF] = {0};
-            int i;
-            
-            for (i = 6; buffer[i] != '\0'; i++){
-                directory[i-6] = buffer[i];
-            }
-            
-            /** making directory */
-            if (mkdir(directory, 0700) == 0) {
-                printf("mkdir success\n");
-                send(clientSocket, "success", sizeof(buffer), 0);
-            } else {
-                printf("mkdir fail\n");
-                send(clientSocket, "fail", sizeof(buffer), 0);
-            }
-        } else {
-            printf("getting this string\n %s\n", buffer);
+    while (1) {
+        addrSize = sizeof(clientAddr);
+        fd = accept4(w->listenSocket, (struct sockaddr *) &clientAddr, &addrSize, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Error: Server couldn't accept the connection\n");
+            return;
+        }
+
+        /* replies go out whole and at once; a header followed by file data is held back with MSG_MORE */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        conn = calloc(1, sizeof(struct connection));
+        if (conn == NULL) {
+            printf("Error: out of memory for connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->worker = w;
+        conn->events = EPOLLIN;
+        conn->fileFd = -1;
+        conn->basisFd = -1;
+        conn->deltaDir = -1;
+        conn->ioFile = -1;
+        conn->command = -1;
+        conn->peer = clientAddr.sin_addr.s_addr;
+        conn->weight = sessionWeight(conn->peer);
+        conn->tokens = (sessionRate / 10 > FAIR_QUANTUM) ? sessionRate / 10 : FAIR_QUANTUM;
+        clock_gettime(CLOCK_MONOTONIC, &conn->refilled);
+        conn->dirFd = fcntl(rootFd, F_DUPFD_CLOEXEC, 0);
+        conn->cwd = strdup(".");
+        if (conn->dirFd < 0 || conn->cwd == NULL) {
+            printf("Error: Server couldn't start a session\n");
+            if (conn->dirFd >= 0)
+                close(conn->dirFd);
+            free(conn->cwd);
+            free(conn);
+            close(fd);
+            continue;
         }
-        
-        clearBuffer(buffer);
+        conn->pipeFd[0] = conn->pipeFd[1] = -1;
+        conn->state = STATE_READ_FRAME;
+        frameParserReset(&conn->parser);
+
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            close(conn->dirFd);
+            free(conn->cwd);
+            free(conn);
+            continue;
         }
-        close(clientSocket);
+        COUNTER_ADD(w->accepted, 1);
+        COUNTER_ADD(w->active, 1);
+
+        printf("--== Connection Successful, Server Ready to read Messages! --==\n");
     }
-    
-    return 0;
 }
 
-
-/*         Name: cleanUp
- *  Description: closes the listening socket, client socket, and the log file
- *   Parameters: none
+/*         Name: endCommand
+ *  Description: records how long the request just answered took, how
+ *               fast a get or put moved its file, and what its client did
+ *   Parameters: struct connection*
  *       Return: void
  */
-void cleanUp(){
-    /* Closing sockets and log file */
-    close(myListenSocket);
-    close(clientSocket);
-    
-    printf("clean up finished, terminating process\n");
-    exit(0);
+void endCommand(struct connection *conn){
+    struct worker *w = conn->worker;
+    struct commandStats *c = &w->commandStats[conn->command];
+    struct timespec now;
+    unsigned long us, rate;
+    int i, op = conn->command & 15;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - conn->started.tv_sec) * 1000000 + (now.tv_nsec - conn->started.tv_nsec) / 1000;
+    for (i = 0; i < LATENCY_BUCKETS - 1 && us > (16UL << i); i++)
+        ;
+    COUNTER_ADD(c->count, 1);
+    COUNTER_ADD(c->micros, us);
+    COUNTER_ADD(c->buckets[i], 1);
+
+    /* bytes per microsecond are MB/s */
+    if ((op == OP_GET || op == OP_PUT) && conn->command < 16 && conn->moved >= THROUGHPUT_MIN) {
+        rate = conn->moved / (us ? us : 1);
+        for (i = 0; i < THROUGHPUT_BUCKETS - 1 && rate > (1UL << i); i++)
+            ;
+        COUNTER_ADD(w->throughput[i], 1);
+        COUNTER_ADD(w->throughputSum, rate);
+    }
+    countClient(conn);
+    conn->command = -1;
 }
 
-/*         Name: ls
- *  Description: fills buffer with output of ls command
- *   Parameters: char array buffer
+/*         Name: countClient
+ *  Description: adds a command and its bytes to the worker's slot for the
+ *               connection's client. A client without a slot takes the
+ *               quietest one and, as in space-saving heavy hitter
+ *               counting, starts from its counts, so a busy client isn't
+ *               pushed out by a stream of small ones; a newcomer's counts
+ *               may be overstated by as much
+ *   Parameters: struct connection*
  *       Return: void
  */
-void handlels(char* buffer){
-    printf("received ls command\n");
-    file = popen("ls", "r");
-    char c;
-    int k = 0;
-    while ((c = fgetc(file)) != EOF) {
-        buffer[k] = c;
-        k++;
+void countClient(struct connection *conn){
+    struct clientStats *c = conn->worker->clients, *slot = NULL;
+    int i;
+
+    for (i = 0; i < CLIENT_SLOTS; i++) {
+        if (c[i].addr == conn->peer) {
+            slot = &c[i];
+            break;
+        }
+        if (slot == NULL || c[i].bytes < slot->bytes)
+            slot = &c[i];
     }
-    buffer[k] = 0;
-    fflush(file);
-    pclose(file);
+    __atomic_store_n(&slot->addr, conn->peer, __ATOMIC_RELAXED);
+    COUNTER_ADD(slot->bytes, conn->moved);
+    COUNTER_ADD(slot->commands, 1);
 }
 
-/*         Name: clearBuffer
- *  Description: clears buffer using memset
- *   Parameters: char array buffer
+/*         Name: writeStats
+ *  Description: writes every worker's counters and histograms in the
+ *               Prometheus text format; the counters are read while the
+ *               workers keep running, so they need not add up exactly
+ *   Parameters: FILE* output
  *       Return: void
  */
-void clearBuffer(char* buffer){
-    memset(buffer, '\0', sizeof(char)*MAX_BUF);
+void writeStats(FILE *out){
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t  offset;
+        int     gauge;
+    } counters[] = {
+        { "ft_connections_accepted_total", "Connections accepted.", offsetof(struct worker, accepted), 0 },
+        { "ft_connections_active", "Connections open.", offsetof(struct worker, active), 1 },
+        { "ft_commands_total", "Requests served.", offsetof(struct worker, commands), 0 },
+        { "ft_errors_total", "Requests answered with an error.", offsetof(struct worker, errors), 0 },
+        { "ft_received_bytes_total", "Bytes read from clients.", offsetof(struct worker, bytesIn), 0 },
+        { "ft_sent_bytes_total", "Bytes sent to clients.", offsetof(struct worker, bytesOut), 0 },
+        { "ft_send_blocked_total", "Sends that found the socket full.", offsetof(struct worker, sendBlocked), 0 },
+        { "ft_send_short_total", "Sends that took only part of their bytes.", offsetof(struct worker, sendShort), 0 },
+        { "ft_recv_blocked_total", "Reads that found the socket empty.", offsetof(struct worker, recvBlocked), 0 },
+        { "ft_cache_hits_total", "Gets and stats served by an open cached file.", offsetof(struct worker, cacheHits), 0 },
+        { "ft_cache_misses_total", "Gets and stats that opened their file.", offsetof(struct worker, cacheMisses), 0 },
+        { "ft_cache_stale_total", "Cached files dropped because they changed.", offsetof(struct worker, cacheStale), 0 },
+        { "ft_buffer_waits_total", "Transfers that waited for buffers.", offsetof(struct worker, poolWaits), 0 },
+        { "ft_socket_retunes_total", "Socket buffers grown by --buffer auto.", offsetof(struct worker, retunes), 0 },
+        { "ft_fair_yields_total", "Turns a transfer ended so the others could go.", offsetof(struct worker, yields), 0 },
+        { "ft_rate_throttles_total", "Times a transfer waited for --rate or --session-rate tokens.", offsetof(struct worker, throttles), 0 },
+    };
+    static const char *commands[COMMAND_SLOTS] = {
+        [OP_LS] = "ls", [OP_CD] = "cd", [OP_GET] = "get", [OP_PUT] = "put", [OP_MKDIR] = "mkdir",
+        [OP_STAT] = "stat", [OP_SIGNATURES] = "signatures", [OP_HELLO] = "hello", [OP_STATS] = "stats",
+        [16 + OP_GET] = "get -r", [16 + OP_PUT] = "put -r",
+    };
+    struct clientStats *seen = calloc(numWorkers * CLIENT_SLOTS, sizeof(*seen));
+    unsigned long count, micros, sum, cumulative, buckets[LATENCY_BUCKETS];
+    char addr[INET_ADDRSTRLEN];
+    size_t i, k, n = 0;
+    int j, b;
+
+    for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", counters[i].name, counters[i].help, counters[i].name,
+                counters[i].gauge ? "gauge" : "counter");
+        for (j = 0; j < numWorkers; j++)
+            fprintf(out, "%s{worker=\"%d\"} %lu\n", counters[i].name, j,
+                    COUNTER_GET(*(unsigned long*)((char*)&workers[j] + counters[i].offset)));
+    }
+
+    fprintf(out, "# HELP ft_command_seconds Time from a request to the end of its answer.\n"
+                 "# TYPE ft_command_seconds histogram\n");
+    for (i = 0; i < COMMAND_SLOTS; i++) {
+        if (commands[i] == NULL)
+            continue;
+        count = micros = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (j = 0; j < numWorkers; j++) {
+            count += COUNTER_GET(workers[j].commandStats[i].count);
+            micros += COUNTER_GET(workers[j].commandStats[i].micros);
+            for (b = 0; b < LATENCY_BUCKETS; b++)
+                buckets[b] += COUNTER_GET(workers[j].commandStats[i].buckets[b]);
+        }
+        if (count == 0)
+            continue;
+        for (b = 0, cumulative = 0; b < LATENCY_BUCKETS - 1; b++) {
+            cumulative += buckets[b];
+            fprintf(out, "ft_command_seconds_bucket{command=\"%s\",le=\"%g\"} %lu\n",
+                    commands[i], (16UL << b) / 1e6, cumulative);
+        }
+        fprintf(out, "ft_command_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n", commands[i],
+                cumulative + buckets[b]);
+        fprintf(out, "ft_command_seconds_sum{command=\"%s\"} %.6f\n", commands[i], micros / 1e6);
+        fprintf(out, "ft_command_seconds_count{command=\"%s\"} %lu\n", commands[i], count);
+    }
+
+    fprintf(out, "# HELP ft_transfer_mbps Rate of gets and puts of at least %d bytes, in MB/s.\n"
+                 "# TYPE ft_transfer_mbps histogram\n", THROUGHPUT_MIN);
+    for (b = 0, cumulative = 0, sum = 0; b < THROUGHPUT_BUCKETS; b++) {
+        for (j = 0; j < numWorkers; j++)
+            cumulative += COUNTER_GET(workers[j].throughput[b]);
+        if (b < THROUGHPUT_BUCKETS - 1)
+            fprintf(out, "ft_transfer_mbps_bucket{le=\"%lu\"} %lu\n", 1UL << b, cumulative);
+    }
+    for (j = 0; j < numWorkers; j++)
+        sum += COUNTER_GET(workers[j].throughputSum);
+    fprintf(out, "ft_transfer_mbps_bucket{le=\"+Inf\"} %lu\n", cumulative);
+    fprintf(out, "ft_transfer_mbps_sum %lu\nft_transfer_mbps_count %lu\n", sum, cumulative);
+
+    /* a client on several workers is summed over them */
+    for (j = 0; j < numWorkers && seen != NULL; j++) {
+        for (b = 0; b < CLIENT_SLOTS; b++) {
+            struct clientStats *c = &workers[j].clients[b];
+            uint32_t a = __atomic_load_n(&c->addr, __ATOMIC_RELAXED);
+
+            if (a == 0)
+                continue;
+            for (k = 0; k < n && seen[k].addr != a; k++)
+                ;
+            if (k == n)
+                n++;
+            seen[k].addr = a;
+            seen[k].bytes += COUNTER_GET(c->bytes);
+            seen[k].commands += COUNTER_GET(c->commands);
+        }
+    }
+    fprintf(out, "# HELP ft_client_bytes_total Socket bytes moved for the busiest client addresses.\n"
+                 "# TYPE ft_client_bytes_total counter\n");
+    for (k = 0; k < n; k++)
+        fprintf(out, "ft_client_bytes_total{client=\"%s\"} %lu\n",
+                inet_ntop(AF_INET, &seen[k].addr, addr, sizeof(addr)), seen[k].bytes);
+    fprintf(out, "# HELP ft_client_commands_total Requests from the busiest client addresses.\n"
+                 "# TYPE ft_client_commands_total counter\n");
+    for (k = 0; k < n; k++)
+        fprintf(out, "ft_client_commands_total{client=\"%s\"} %lu\n",
+                inet_ntop(AF_INET, &seen[k].addr, addr, sizeof(addr)), seen[k].commands);
+    free(seen);
+}
+
+/*         Name: startStats
+ *  Description: renders the metrics for a STATS request, to be streamed
+ *               out as DATA frames in STATE_STATS
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 if memory runs out
+ */
+int startStats(struct connection *conn){
+    FILE *out = open_memstream(&conn->stats, &conn->statsLen);
+
+    if (out == NULL)
+        return -1;
+    writeStats(out);
+    if (fclose(out) != 0) {
+        free(conn->stats);
+        conn->stats = NULL;
+        return -1;
+    }
+    conn->statsOff = 0;
+    conn->state = STATE_STATS;
+    return 0;
 }
 
-/*         Name: fileExists
- *  Description: returns an intenger based on existence of file
- *   Parameters: char*
- *       Return: int
+/*         Name: openMetricsSocket
+ *  Description: opens a blocking listener for metrics scrapes, reachable
+ *               from this host only
+ *   Parameters: int port
+ *       Return: int socket descriptor, or -1
  */
-int fileExists(const char *filename) {
-    return access(filename, F_OK);
+int openMetricsSocket(int port){
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-/*         Name: handleSigInt
- *  Description: handles the SIGINT signal and calls the cleanUp function
- *   Parameters: int
+/*         Name: metricsMain
+ *  Description: answers every HTTP request on the metrics port with the
+ *               metrics, one at a time, away from the workers' loops
+ *   Parameters: listening socket
+ *       Return: void*, never returns
+ */
+void *metricsMain(void *arg){
+    struct timeval timeout = { 1, 0 };
+    char request[1024], header[128], *text;
+    size_t len;
+    ssize_t n;
+    FILE *out;
+    int fd, listenFd = (int)(intptr_t)arg;
+
+    while (1) {
+        if ((fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            continue;
+
+        /* what is asked for doesn't matter; a slow client doesn't hold us up for long */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        recv(fd, request, sizeof(request), 0);
+
+        text = NULL;
+        if ((out = open_memstream(&text, &len)) != NULL) {
+            writeStats(out);
+            if (fclose(out) == 0) {
+                n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+                if (send(fd, header, n, MSG_NOSIGNAL) == n)
+                    send(fd, text, len, MSG_NOSIGNAL);
+            }
+        }
+        free(text);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*         Name: handleConnection
+ *  Description: advances a connection's state machine as far as it can go
+ *               without blocking, then updates its epoll interest
+ *   Parameters: struct connection*
  *       Return: void
  */
-void handleSigInt(int i){
-    printf("handling SIGINT, calling cleanUp function\n");
-    cleanUp();
-    exit(0);
-}
\ No newline at end of file
+void handleConnection(struct connection *conn){
+    struct epoll_event ev;
+    struct frame frame;
+    unsigned char *payload;
+    uint32_t want;
+    size_t len;
+    int rv = 1;
+
+    /*
+     * every time it is served, a transfer gets another turn; what it went
+     * over by last time is paid back, what it left unused isn't saved up
+     */
+    conn->turnLeft = ((conn->turnLeft < 0) ? conn->turnLeft : 0) + (int64_t)FAIR_QUANTUM * conn->weight;
+    conn->yielded = 0;
+
+    while (rv > 0) {
+        switch (conn->state) {
+        case STATE_READ_FRAME:
+            /* back here, the last request has been answered in full */
+            if (conn->command >= 0)
+                endCommand(conn);
+            if ((rv = readFrame(conn, &frame, &payload)) > 0)
+                rv = dispatchFrame(conn, &frame, payload);
+            break;
+
+        case STATE_SEND_REPLY:
+            if ((rv = flushOutput(conn)) > 0)
+                conn->state = conn->nextState;
+            break;
+
+        case STATE_GET_DATA:
+            if ((rv = takeTurn(conn)) <= 0)
+                break;
+            if (autoTune)
+                retuneBuffers(conn, SO_SNDBUF);
+            if (conn->worker->ring != NULL && !conn->compress &&
+                (conn->ioSlots > 0 || uringAttach(conn) > 0)) {
+                if ((rv = flushOutput(conn)) > 0 && (rv = uringSendData(conn)) > 0) {
+                    printf("Sent file to client\n");
+                    finishTransfer(conn);
+                    conn->state = conn->tree ? STATE_TREE_GET : STATE_READ_FRAME;
+                }
+                break;
+            }
+            if (conn->compress) {
+                /* compressed chunks pass through memory anyway, so they are read and sent from zbuf */
+                if ((rv = flushOutput(conn)) > 0 && (rv = sendBufferedData(conn)) > 0) {
+                    printf("Sent file to client, %llu bytes as %llu\n",
+                           (unsigned long long)conn->zip.rawBytes, (unsigned long long)conn->zip.wireBytes);
+                    finishTransfer(conn);
+                    conn->state = conn->tree ? STATE_TREE_GET : STATE_READ_FRAME;
+                }
+                break;
+            }
+            if (conn->chunkLeft == 0 && conn->dataoff < conn->datalen) {
+                /*
+                 * header for the next DATA frame; its payload follows by
+                 * sendfile, and its CRC32C trailer, worked out beforehand,
+                 * once the payload is out
+                 */
+                len = conn->verify ? 4 : 0;
+                conn->chunkLeft = conn->datalen - conn->dataoff;
+                if (conn->chunkLeft > (int64_t)(FRAME_MAX_DATA - len))
+                    conn->chunkLeft = FRAME_MAX_DATA - len;
+                if (conn->verify && checksumChunk(conn) < 0) {
+                    rv = -1;
+                    break;
+                }
+                queueFrame(conn, OP_DATA, NULL, conn->chunkLeft + len);
+            }
+            if ((rv = flushOutput(conn)) <= 0)
+                break;
+            if (conn->chunkLeft == 0) {
+                printf("Sent file to client\n");
+                finishTransfer(conn);
+                conn->state = conn->tree ? STATE_TREE_GET : STATE_READ_FRAME;
+                break;
+            }
+            if ((rv = sendFileData(conn)) > 0 && conn->verify) {
+                putU32(conn->outbuf + conn->outlen, conn->crc);
+                conn->outlen += 4;
+            }
+            break;
+
+        case STATE_PUT_DATA:
+            if ((rv = takeTurn(conn)) <= 0)
+                break;
+            if (autoTune)
+                retuneBuffers(conn, SO_RCVBUF);
+            /* writes still at the disk have to land before the put is answered */
+            if ((rv = recvFileData(conn)) > 0 && conn->ioSlots > 0)
+                rv = uringFlushWrites(conn);
+            if (rv > 0 && conn->tree != NULL) {
+                /* a file of a tree is not answered; a failure only counts */
+                struct timespec times[2] = { { 0, UTIME_OMIT }, { conn->tree->mtime, 0 } };
+
+                if (conn->fileFd < 0 || futimens(conn->fileFd, times) < 0)
+                    conn->tree->failed++;
+                finishTransfer(conn);
+                conn->state = STATE_TREE_PUT;
+            } else if (rv > 0) {
+                if (conn->fileFd >= 0 && commitDelta(conn) == 0) {
+                    printf("finished writing\n");
+                    finishTransfer(conn);
+                    reply(conn, OP_OK, NULL, 0, STATE_READ_FRAME);
+                } else if (conn->corrupt) {
+                    printf("checksum mismatch\n");
+                    finishTransfer(conn);
+                    reply(conn, OP_ERROR, "checksum mismatch", 17, STATE_READ_FRAME);
+                } else {
+                    finishTransfer(conn);
+                    reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+                }
+            }
+            break;
+
+        case STATE_CHECKSUM:
+            if ((rv = checksumPrefix(conn)) > 0)
+                finishChecksum(conn);
+            break;
+
+        case STATE_SIGNATURES:
+            if ((rv = flushOutput(conn)) <= 0)
+                break;
+            if (conn->sumOff == conn->sumLen) {
+                finishTransfer(conn);
+                conn->state = STATE_READ_FRAME;
+                break;
+            }
+            rv = queueSignatures(conn);
+            break;
+
+        case STATE_LIST:
+            if ((rv = flushOutput(conn)) <= 0)
+                break;
+            if ((rv = queueListing(conn)) > 0) {
+                unsigned char count[8];
+
+                putU64(count, conn->list->sent);
+                finishTransfer(conn);
+                reply(conn, OP_OK, count, 8, STATE_READ_FRAME);
+            } else if (rv < 0) {
+                finishTransfer(conn);
+                reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+                rv = 1;
+            }
+            break;
+
+        case STATE_TREE_GET:
+            if ((rv = takeTurn(conn)) <= 0 || (rv = flushOutput(conn)) <= 0 || (rv = flushBatch(conn)) <= 0)
+                break;
+            if ((rv = queueTree(conn)) > 0) {
+                unsigned char counts[16];
+
+                printf("Sent tree to client, %llu entries, %llu failed\n",
+                       (unsigned long long)conn->tree->entries, (unsigned long long)conn->tree->failed);
+                putU64(counts, conn->tree->entries);
+                putU64(counts + 8, conn->tree->failed);
+                freeTree(conn);
+                reply(conn, OP_OK, counts, 16, STATE_READ_FRAME);
+            } else if (rv == 0) {
+                rv = conn->poolWait ? 0 : 1;
+            }
+            break;
+
+        case STATE_TREE_PUT:
+            if ((rv = takeTurn(conn)) > 0 && (rv = readFrame(conn, &frame, &payload)) > 0)
+                rv = receiveTreeEntry(conn, &frame, payload);
+            break;
+
+        case STATE_STATS:
+            if ((rv = flushOutput(conn)) <= 0)
+                break;
+            if (conn->statsOff == conn->statsLen) {
+                finishTransfer(conn);
+                reply(conn, OP_OK, NULL, 0, STATE_READ_FRAME);
+                break;
+            }
+            len = conn->statsLen - conn->statsOff < MAX_REPLY ? conn->statsLen - conn->statsOff : MAX_REPLY;
+            queueFrame(conn, OP_DATA, conn->stats + conn->statsOff, len);
+            conn->statsOff += len;
+            break;
+        }
+    }
+
+    if (rv < 0) {
+        closeConnection(conn);
+        return;
+    }
+
+    /*
+     * wait for whichever direction the current state is blocked on; a
+     * checksum or listing in progress waits for EPOLLOUT too, which is
+     * ready at once and brings it back after the other connections had
+     * their turn
+     */
+    want = (conn->state == STATE_SEND_REPLY || conn->state == STATE_GET_DATA ||
+            conn->state == STATE_CHECKSUM || conn->state == STATE_SIGNATURES ||
+            conn->state == STATE_LIST || conn->state == STATE_TREE_GET ||
+            conn->state == STATE_STATS) ? EPOLLOUT : EPOLLIN;
+
+    /* a transfer that gave up its turn comes back once the others had theirs, like a checksum */
+    if (conn->yielded)
+        want = EPOLLOUT;
+
+    /*
+     * a transfer waiting on the ring, for buffers or for tokens, is
+     * brought back by its completions, poolWake or rateTick
+     */
+    if (conn->ioWait || conn->poolWait || conn->throttled)
+        want = 0;
+    if (want != conn->events) {
+        ev.events = want;
+        ev.data.ptr = conn;
+        epoll_ctl(conn->worker->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = want;
+    }
+}
+
+/*         Name: closeConnection
+ *  Description: releases everything held by a connection, once the ring
+ *               holds none of its buffers
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void closeConnection(struct connection *conn){
+    if (!conn->closing) {
+        epoll_ctl(conn->worker->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+        COUNTER_ADD(conn->worker->active, -1);
+        close(conn->fd);
+        finishTransfer(conn);
+        freeTree(conn);
+        if (conn->pipeFd[0] >= 0) {
+            close(conn->pipeFd[0]);
+            close(conn->pipeFd[1]);
+        }
+        if (conn->poolWait)
+            poolLeave(conn);
+        if (conn->throttled)
+            throttleLeave(conn);
+        close(conn->dirFd);
+        free(conn->cwd);
+        conn->closing = 1;
+        printf("--== Connection closed --==\n");
+
+        /* the ring still writes to our buffers; its last completion frees us */
+        if (conn->ioInflight > 0) {
+            uringCancel(conn);
+            return;
+        }
+    }
+    uringDetach(conn);
+    free(conn);
+}
+
+/*         Name: dispatchFrame
+ *  Description: serves one request frame and moves the connection into the
+ *               state that continues it
+ *   Parameters: struct connection*, struct frame*, payload bytes
+ *       Return: int, 1 to keep going, -1 to close the connection
+ */
+int dispatchFrame(struct connection *conn, const struct frame *frame, unsigned char *payload){
+    char path[FRAME_MAX_CONTROL + 1];
+    char full[PATH_MAX];
+    char *name;
+    unsigned char info[24];
+    struct stat st;
+    int64_t offset;
+    size_t skip;
+    int fd, mode;
+
+    COUNTER_ADD(conn->worker->commands, 1);
+    conn->requestId = frame->requestId;
+    conn->command = (frame->opcode & 15) + ((frame->flags & FLAG_TREE) ? 16 : 0);
+    conn->moved = 0;
+    clock_gettime(CLOCK_MONOTONIC, &conn->started);
+    conn->tunedMoved = 0;
+    conn->tunedAt = conn->started;
+
+    switch (frame->opcode) {
+    case OP_LS:
+        printf("received ls command\n");
+        if (startListing(conn, payload, frame->length) < 0)
+            reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+        return 1;
+
+    case OP_CD:
+        printf("received cd command\n");
+
+        fd = -1;
+        if (payloadString(payload, frame->length, path, sizeof(path)) == 0 &&
+            joinPath(conn->cwd, path, full, sizeof(full)) == 0 &&
+            (fd = resolvePath(conn, path, O_PATH | O_DIRECTORY, 0)) >= 0 &&
+            (name = strdup(full)) != NULL) {
+            close(conn->dirFd);
+            free(conn->cwd);
+            conn->dirFd = fd;
+            conn->cwd = name;
+            printf("cd success\n");
+
+            /* the reply carries the new directory, so other streams can follow */
+            snprintf(path, sizeof(path), "/%s", strcmp(conn->cwd, ".") ? conn->cwd : "");
+            reply(conn, OP_OK, path, strlen(path), STATE_READ_FRAME);
+        } else {
+            if (fd >= 0)
+                close(fd);
+            printf("cd fail\n");
+            reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+        }
+        return 1;
+
+    case OP_STAT:
+        if (payloadString(payload, frame->length, path, sizeof(path)) < 0 ||
+            (fd = openCached(conn, path, &st)) < 0) {
+            reply(conn, OP_ERROR, "no such file", 12, STATE_READ_FRAME);
+            return 1;
+        }
+        if (frame->flags & FLAG_RESUME) {
+            /* the client compares this against its own copy before a resumed put */
+            conn->fileFd = fd;
+            startChecksum(conn, OP_STAT, st.st_size, 0);
+            return 1;
+        }
+        closeCached(conn, fd);
+        putU64(info, st.st_size);
+        reply(conn, OP_FILE_INFO, info, 8, STATE_READ_FRAME);
+        return 1;
+
+    case OP_GET:
+        printf("received get command \n");
+
+        if (frame->flags & FLAG_TREE) {
+            if ((frame->flags & (FLAG_RANGE | FLAG_RESUME)) ||
+                payloadString(payload, frame->length, path, sizeof(path)) < 0 ||
+                startTree(conn, path, frame->flags, 0) < 0)
+                reply(conn, OP_ERROR, "no such directory", 17, STATE_READ_FRAME);
+            return 1;
+        }
+
+        conn->compress = (frame->flags & FLAG_COMPRESS) && conn->zip.codec != CODEC_NONE;
+        conn->verify = (frame->flags & FLAG_CHECKSUM) != 0;
+        compressorInit(&conn->zip, conn->zip.codec);  /* each file starts with a fresh backoff */
+
+        /* a range request names the slice of the file it wants */
+        if ((frame->flags & FLAG_RANGE) && (frame->flags & FLAG_RESUME))
+            return -1;
+        skip = (frame->flags & FLAG_RANGE) ? 16 : (frame->flags & FLAG_RESUME) ? 12 : 0;
+        if (frame->length < skip)
+            return -1;
+
+        conn->fileFd = -1;
+        if (payloadString(payload + skip, frame->length - skip, path, sizeof(path)) == 0)
+            conn->fileFd = openCached(conn, path, &st);
+
+        if (conn->fileFd < 0) {
+            reply(conn, OP_ERROR, "no such file", 12, STATE_READ_FRAME);
+            return 1;
+        }
+
+        if (frame->flags & FLAG_RESUME) {
+            /*
+             * Only the part the client already has is hashed; if it
+             * holds more than the file's size nothing can be kept.
+             */
+            offset = getU64(payload);
+            startChecksum(conn, OP_GET, (offset >= 0 && offset <= st.st_size) ? offset : 0,
+                          getU32(payload + 8));
+            if (offset < 0 || offset > st.st_size)
+                conn->sumWant = ~conn->sumWant;
+            return 1;
+        }
+
+        conn->fileBase = 0;
+        conn->datalen = st.st_size;
+        if (skip) {
+            conn->fileBase = getU64(payload);
+            conn->datalen = getU64(payload + 8);
+            if (conn->fileBase < 0 || conn->datalen < 0 || conn->fileBase > st.st_size ||
+                conn->datalen > st.st_size - conn->fileBase) {
+                finishTransfer(conn);
+                reply(conn, OP_ERROR, "bad range", 9, STATE_READ_FRAME);
+                return 1;
+            }
+        }
+
+        // the size goes out with the first DATA frame, no handshake
+        conn->dataoff = 0;
+        conn->chunkLeft = 0;
+        putU64(info, st.st_size);
+        putU64(info + 8, conn->fileBase);
+        putU64(info + 16, conn->datalen);
+        queueFrame(conn, OP_FILE_INFO, info, skip ? 24 : 8);
+        conn->state = STATE_GET_DATA;
+        return 1;
+
+    case OP_PUT:
+        printf("received put command \n");
+
+        /* a tree put is answered once, after its last ENTRY frame */
+        if (frame->flags & FLAG_TREE) {
+            if (frame->flags & (FLAG_RANGE | FLAG_RESUME | FLAG_DELTA) ||
+                payloadString(payload, frame->length, path, sizeof(path)) < 0 ||
+                startTree(conn, path, frame->flags, 1) < 0)
+                return -1;
+            return 1;
+        }
+
+        /* the data follows right behind the request; the flags exclude each other */
+        mode = frame->flags & (FLAG_RANGE | FLAG_RESUME | FLAG_DELTA);
+        if ((mode & (mode - 1)) || (mode == FLAG_DELTA && (frame->flags & FLAG_CHECKSUM)))
+            return -1;
+        conn->verify = (frame->flags & FLAG_CHECKSUM) != 0;
+        skip = (mode == FLAG_RANGE) ? 24 : (mode == FLAG_RESUME) ? 16 : (mode == FLAG_DELTA) ? 12 : 8;
+        if (frame->length < skip || (int64_t)getU64(payload) < 0)
+            return -1;
+        conn->fileBase = 0;
+        conn->datalen = getU64(payload);
+        conn->dataoff = 0;
+        if (mode == FLAG_RANGE) {
+            conn->fileBase = getU64(payload + 8);
+            conn->datalen = getU64(payload + 16);
+            if (conn->fileBase < 0 || conn->datalen < 0 ||
+                conn->fileBase + conn->datalen > (int64_t)getU64(payload))
+                return -1;
+        } else if (mode == FLAG_RESUME) {
+            /* a resumed put sends only what follows the part already stored */
+            conn->fileBase = getU64(payload + 8);
+            if (conn->fileBase < 0 || conn->fileBase > conn->datalen)
+                return -1;
+            conn->datalen -= conn->fileBase;
+        } else if (mode == FLAG_DELTA) {
+            /* COPY frames are read, and dropped, even if the put fails */
+            conn->delta = 1;
+            conn->blockSize = getU32(payload + 8);
+            if (conn->blockSize == 0 || conn->blockSize > SIG_MAX_BLOCK)
+                return -1;
+        }
+        printf("data_length = %lld\n", (long long)conn->datalen);
+
+        /* if the file can't be opened the data is still read and dropped */
+        conn->fileFd = -1;
+        if (payloadString(payload + skip, frame->length - skip, path, sizeof(path)) < 0) {
+            conn->state = STATE_PUT_DATA;
+            return 1;
+        }
+        if (mode == 0) {
+            conn->fileFd = resolvePath(conn, path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        } else if (mode == FLAG_RESUME) {
+            /*
+             * Keep the stored prefix and drop anything past it, so the
+             * file's length is always what has safely landed.
+             */
+            conn->fileFd = resolvePath(conn, path, O_WRONLY, 0);
+            if (conn->fileFd >= 0 && (fstat(conn->fileFd, &st) < 0 || st.st_size < conn->fileBase ||
+                                      ftruncate(conn->fileFd, conn->fileBase) < 0)) {
+                close(conn->fileFd);
+                conn->fileFd = -1;
+            }
+        } else if (mode == FLAG_DELTA) {
+            conn->fileFd = openDeltaTarget(conn, path);
+        } else {
+            /*
+             * Ranges of one file arrive on several connections in any
+             * order, so none of them may truncate it. Each sizes it to
+             * the announced total, which is idempotent, and writes its
+             * slice in place.
+             */
+            conn->fileFd = resolvePath(conn, path, O_WRONLY | O_CREAT, 0666);
+            if (conn->fileFd >= 0 && preallocate(conn->fileFd, getU64(payload)) < 0) {
+                close(conn->fileFd);
+                conn->fileFd = -1;
+            }
+        }
+        conn->state = STATE_PUT_DATA;
+        return 1;
+
+    case OP_SIGNATURES:
+        if (payloadString(payload, frame->length, path, sizeof(path)) < 0 ||
+            (conn->fileFd = openRegular(conn, path, &st)) < 0) {
+            reply(conn, OP_ERROR, "no such file", 12, STATE_READ_FRAME);
+            return 1;
+        }
+
+        /* only whole blocks get a signature; a short tail is always sent */
+        conn->blockSize = signatureBlockSize(st.st_size);
+        putU64(info, st.st_size);
+        putU32(info + 8, conn->blockSize);
+        putU64(info + 12, st.st_size / conn->blockSize);
+        queueFrame(conn, OP_SIG_INFO, info, 20);
+        conn->sumOff = 0;
+        conn->sumLen = st.st_size - st.st_size % conn->blockSize;
+        conn->state = STATE_SIGNATURES;
+        return 1;
+
+    case OP_HELLO: {
+        unsigned char codec = CODEC_NONE;
+        size_t i;
+
+        /* take the first codec the client offers that this build has */
+        for (i = 0; i < frame->length && codec == CODEC_NONE; i++) {
+            if (codecSupported(payload[i]))
+                codec = payload[i];
+        }
+        compressorInit(&conn->zip, codec);
+        reply(conn, OP_OK, &codec, 1, STATE_READ_FRAME);
+        return 1;
+    }
+
+    case OP_STATS:
+        if (startStats(conn) < 0)
+            reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+        return 1;
+
+    case OP_MKDIR:
+        printf("received mkdir command \n");
+
+        /** making directory */
+        fd = -1;
+        if (payloadString(payload, frame->length, path, sizeof(path)) == 0 &&
+            (fd = resolveParent(conn, path, &name)) >= 0 && mkdirat(fd, name, 0700) == 0) {
+            printf("mkdir success\n");
+            close(fd);
+            reply(conn, OP_OK, NULL, 0, STATE_READ_FRAME);
+        } else {
+            if (fd >= 0)
+                close(fd);
+            printf("mkdir fail\n");
+            reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+        }
+        return 1;
+
+    case OP_QUIT:
+        printf("received quit command\n");
+        return -1;
+
+    default:
+        printf("unknown opcode 0x%02x\n", frame->opcode);
+        reply(conn, OP_ERROR, "unknown command", 15, STATE_READ_FRAME);
+        return 1;
+    }
+}
+
+/*         Name: queueFrame
+ *  Description: appends a frame for the current request to outbuf; a NULL
+ *               payload queues only the header and the caller sends the
+ *               payload itself
+ *   Parameters: struct connection*, opcode, payload, payload length
+ *       Return: int, 0 on success, -1 if outbuf has no room
+ */
+int queueFrame(struct connection *conn, uint8_t opcode, const void *payload, size_t len){
+    size_t body = payload ? len : 0;
+
+    if (conn->outoff == conn->outlen)
+        conn->outoff = conn->outlen = 0;
+    if (conn->outlen + FRAME_HEADER_SIZE + body > sizeof(conn->outbuf))
+        return -1;
+
+    conn->outlen += frameBuild(conn->outbuf + conn->outlen, opcode, 0, conn->requestId, len);
+    if (body) {
+        memcpy(conn->outbuf + conn->outlen, payload, body);
+        conn->outlen += body;
+    }
+    return 0;
+}
+
+/*         Name: reply
+ *  Description: queues a reply frame; once it has been sent the connection
+ *               moves on to nextState
+ *   Parameters: struct connection*, opcode, payload, payload length, state
+ *       Return: void
+ */
+void reply(struct connection *conn, uint8_t opcode, const void *payload, size_t len, int nextState){
+    if (opcode == OP_ERROR)
+        COUNTER_ADD(conn->worker->errors, 1);
+    queueFrame(conn, opcode, payload, len);
+    conn->state = STATE_SEND_REPLY;
+    conn->nextState = nextState;
+}
+
+/*         Name: fillInput
+ *  Description: reads more bytes from the socket into inbuf, first sliding
+ *               any unparsed bytes to the front
+ *   Parameters: struct connection*
+ *       Return: int, 1 if bytes were read, 0 if the socket would block,
+ *               -1 on error or when the client hung up
+ */
+int fillInput(struct connection *conn){
+    ssize_t n;
+
+    if (conn->inoff == conn->inend) {
+        conn->inoff = conn->inend = 0;
+    } else if (conn->inoff > 0 && conn->inend == sizeof(conn->inbuf)) {
+        memmove(conn->inbuf, conn->inbuf + conn->inoff, conn->inend - conn->inoff);
+        conn->inend -= conn->inoff;
+        conn->inoff = 0;
+    }
+
+    while (1) {
+        n = recv(conn->fd, conn->inbuf + conn->inend, TURN_SIZE(conn, sizeof(conn->inbuf) - conn->inend), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            COUNTER_ADD(conn->worker->recvBlocked, 1);
+            return 0;
+        }
+        if (n <= 0)
+            return -1;
+        conn->inend += n;
+        COUNT_IN(conn, n);
+        return 1;
+    }
+}
+
+/*         Name: readFrame
+ *  Description: parses the next control frame out of inbuf, reading from
+ *               the socket as needed; the payload stays valid until the
+ *               next read
+ *   Parameters: struct connection*, struct frame* to fill, payload pointer
+ *       Return: int, 1 when a whole frame is available, 0 if the socket
+ *               would block, -1 on a protocol error or hang up
+ */
+int readFrame(struct connection *conn, struct frame *frame, unsigned char **payload){
+    size_t used;
+    int rv;
+
+    while (1) {
+        if (!frameHeaderDone(&conn->parser)) {
+            rv = frameParseHeader(&conn->parser, conn->inbuf + conn->inoff,
+                                  conn->inend - conn->inoff, &used);
+            conn->inoff += used;
+            if (rv < 0)
+                return -1;
+            if (rv == 0) {
+                if ((rv = fillInput(conn)) <= 0)
+                    return rv;
+                continue;
+            }
+            /* the BATCH frames of a tree put are the one thing bigger */
+            if (conn->parser.frame.length > FRAME_MAX_CONTROL &&
+                (conn->state != STATE_TREE_PUT || conn->parser.frame.opcode != OP_BATCH ||
+                 conn->parser.frame.length > sizeof(conn->inbuf)))
+                return -1;
+        }
+
+        if (conn->inend - conn->inoff < conn->parser.frame.length) {
+            if ((rv = fillInput(conn)) <= 0)
+                return rv;
+            continue;
+        }
+
+        *frame = conn->parser.frame;
+        *payload = (unsigned char *)conn->inbuf + conn->inoff;
+        conn->inoff += frame->length;
+        frameParserReset(&conn->parser);
+        return 1;
+    }
+}
+
+/*         Name: flushOutput
+ *  Description: sends whatever is left of outbuf. Ahead of the file data
+ *               of a get it is sent with MSG_MORE, so the FILE_INFO reply
+ *               or DATA header leaves in the same segment as the first
+ *               bytes of the file rather than in one of its own
+ *   Parameters: struct connection*
+ *       Return: int, 1 when outbuf is empty, 0 if the socket would block,
+ *               -1 on error
+ */
+int flushOutput(struct connection *conn){
+    int more = (conn->state == STATE_GET_DATA && conn->dataoff < conn->datalen) ? MSG_MORE : 0;
+    ssize_t n;
+
+    while (conn->outoff < conn->outlen) {
+        n = send(conn->fd, conn->outbuf + conn->outoff, conn->outlen - conn->outoff, more);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            COUNTER_ADD(conn->worker->sendBlocked, 1);
+            return 0;
+        }
+        if (n < 0)
+            return -1;
+        if ((size_t)n < conn->outlen - conn->outoff)
+            COUNTER_ADD(conn->worker->sendShort, 1);
+        conn->outoff += n;
+        COUNT_OUT(conn, n);
+    }
+    return 1;
+}
+
+/*         Name: sendFileData
+ *  Description: moves the rest of the current DATA frame from fileFd to the
+ *               socket inside the kernel, with sendfile where possible and
+ *               file->pipe->socket splice when the file system doesn't
+ *               support it
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the frame is sent, 0 if the socket would block,
+ *               -1 on error
+ */
+int sendFileData(struct connection *conn){
+    off_t offset;
+    size_t want;
+    ssize_t n;
+
+    while (conn->chunkLeft > 0) {
+        if (!takeTurn(conn))
+            return 0;
+        if (!conn->useSplice) {
+            offset = conn->fileBase + conn->dataoff;
+            want = TURN_SIZE(conn, conn->chunkLeft);
+            n = sendfile(conn->fd, conn->fileFd, &offset, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                if (conn->pipeFd[0] < 0 && pipe2(conn->pipeFd, O_NONBLOCK) < 0)
+                    return -1;
+                conn->useSplice = 1;
+                continue;
+            }
+        } else {
+            /* top the pipe up from the file, then drain it into the socket */
+            if ((int64_t)conn->piped < conn->chunkLeft) {
+                offset = conn->fileBase + conn->dataoff + conn->piped;
+                n = splice(conn->fileFd, &offset, conn->pipeFd[1], NULL,
+                           conn->chunkLeft - conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                    conn->piped += n;
+                else if (n == 0 && conn->piped == 0)
+                    return -1;  /* file shrank under us */
+                else if (n < 0 && errno != EAGAIN)
+                    return -1;
+            }
+            want = TURN_SIZE(conn, conn->piped);
+            n = splice(conn->pipeFd[0], NULL, conn->fd, NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (n > 0)
+                conn->piped -= n;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            COUNTER_ADD(conn->worker->sendBlocked, 1);
+            return 0;
+        }
+        if (n == 0)
+            return -1;  /* file shrank under us */
+
+        if ((size_t)n < want)
+            COUNTER_ADD(conn->worker->sendShort, 1);
+        conn->dataoff += n;
+        conn->chunkLeft -= n;
+        COUNT_OUT(conn, n);
+    }
+    return 1;
+}
+
+/*         Name: retuneBuffers
+ *  Description: with --buffer auto, grows the socket buffer a transfer
+ *               leans on, every TUNE_INTERVAL bytes, to twice its
+ *               bandwidth-delay product: the rate it has moved bytes at
+ *               since the last retune times the kernel's RTT estimate.
+ *               Buffers only grow, and only past what the kernel's own
+ *               autotuning has reached, which stops for that socket once
+ *               a size is set
+ *   Parameters: struct connection*, SO_SNDBUF for a get or SO_RCVBUF for a put
+ *       Return: void
+ */
+void retuneBuffers(struct connection *conn, int option){
+    struct tcp_info info;
+    struct timespec now;
+    socklen_t len = sizeof(info);
+    uint64_t us, rtt, want;
+    int have;
+
+    if (conn->moved - conn->tunedMoved < TUNE_INTERVAL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - conn->tunedAt.tv_sec) * 1000000 + (now.tv_nsec - conn->tunedAt.tv_nsec) / 1000;
+    if (us > 0 && getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        rtt = (info.tcpi_rtt > info.tcpi_rcv_rtt) ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+        want = 2 * (conn->moved - conn->tunedMoved) * rtt / us;
+        if (want > TUNE_MAX)
+            want = TUNE_MAX;
+
+        /* the kernel doubles the size it is given, and reports the doubled size */
+        len = sizeof(have);
+        if (getsockopt(conn->fd, SOL_SOCKET, option, &have, &len) == 0 && 2 * want > (uint64_t)have) {
+            have = want;
+            if (setsockopt(conn->fd, SOL_SOCKET, option, &have, sizeof(have)) == 0)
+                COUNTER_ADD(conn->worker->retunes, 1);
+        }
+    }
+    conn->tunedMoved = conn->moved;
+    conn->tunedAt = now;
+}
+
+/*         Name: recvFileData
+ *  Description: parses the DATA frames of an upload out of inbuf and writes
+ *               their payload to fileFd, one inbuf worth at a time; with no
+ *               fileFd the payload is discarded. COPY frames of a delta put
+ *               are handed to copyBlocks
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the whole upload is written, 0 if the socket
+ *               would block, -1 on error
+ */
+int recvFileData(struct connection *conn){
+    struct frame_parser *p = &conn->parser;
+    size_t trailer = conn->verify ? 4 : 0;
+    ssize_t w, written;
+    size_t n, used;
+    int rv;
+
+    /* the last frame's checksum trails its data */
+    while (conn->dataoff < conn->datalen || frameHeaderDone(p)) {
+        if (conn->inoff == conn->inend) {
+            if (!takeTurn(conn))
+                return 0;
+            if ((rv = fillInput(conn)) <= 0)
+                return rv;
+        }
+
+        if (!frameHeaderDone(p)) {
+            rv = frameParseHeader(p, conn->inbuf + conn->inoff, conn->inend - conn->inoff, &used);
+            conn->inoff += used;
+            if (rv < 0)
+                return -1;
+            if (rv > 0 && p->frame.opcode == OP_COPY && conn->delta)
+                continue;
+            if (rv > 0 && p->frame.opcode == OP_DATA && (p->frame.flags & FLAG_COMPRESS) &&
+                conn->zip.codec != CODEC_NONE)
+                continue;
+            if (rv > 0 && (p->frame.opcode != OP_DATA || p->frame.length < trailer ||
+                           p->frame.length - trailer > (uint64_t)(conn->datalen - conn->dataoff)))
+                return -1;
+            if (rv > 0 && p->frame.length == 0)
+                frameConsumePayload(p, 0);
+            continue;
+        }
+
+        if (p->frame.opcode == OP_COPY) {
+            if ((rv = copyBlocks(conn)) <= 0)
+                return rv;
+            continue;
+        }
+        if (p->frame.flags & FLAG_COMPRESS) {
+            if ((rv = recvCompressedChunk(conn)) <= 0)
+                return rv;
+            continue;
+        }
+
+        if (p->remaining == trailer) {
+            if ((rv = checkTrailer(conn)) <= 0)
+                return rv;
+            continue;
+        }
+
+        n = conn->inend - conn->inoff;
+        if (n > p->remaining - trailer)
+            n = p->remaining - trailer;
+
+        /* on the io_uring backend the bytes are written behind our back */
+        if (conn->fileFd >= 0 && conn->worker->ring != NULL &&
+            (conn->ioSlots > 0 || uringAttach(conn) > 0)) {
+            if ((n = uringWriteData(conn, conn->inbuf + conn->inoff, n)) == 0)
+                return 0;   /* every buffer is at the disk */
+            written = n;
+        } else {
+            written = 0;
+        }
+        if (conn->verify)
+            conn->crc = crc32c(conn->crc, conn->inbuf + conn->inoff, n);
+
+        for (; conn->fileFd >= 0 && written < (ssize_t)n; written += w) {
+            w = pwrite(conn->fileFd, conn->inbuf + conn->inoff + written, n - written,
+                       conn->fileBase + conn->dataoff + written);
+            if (w < 0 && errno == EINTR) {
+                w = 0;
+            } else if (w < 0) {
+                /* keep draining the upload, then report the failure */
+                close(conn->fileFd);
+                conn->fileFd = -1;
+                break;
+            }
+        }
+        conn->inoff += n;
+        conn->dataoff += n;
+        frameConsumePayload(p, n);
+    }
+    return 1;
+}
+
+/*         Name: signatureBlockSize
+ *  Description: picks the delta block size for a file: about the square
+ *               root of its size, so the signature list and the expected
+ *               literal data grow at the same pace
+ *   Parameters: int64_t file size
+ *       Return: uint32_t block size, a multiple of 1 KiB
+ */
+uint32_t signatureBlockSize(int64_t size){
+    uint32_t block = SIG_MIN_BLOCK;
+
+    while (block < SIG_MAX_BLOCK && (int64_t)block * block < size)
+        block += 1024;
+    return block;
+}
+
+/*         Name: queueSignatures
+ *  Description: queues one DATA frame of block signatures, covering about
+ *               CHECKSUM_SLICE bytes of the file
+ *   Parameters: struct connection*
+ *       Return: int, 0 to send it and continue later, -1 on error
+ */
+int queueSignatures(struct connection *conn){
+    unsigned char records[MAX_REPLY];
+    char block[SIG_MAX_BLOCK];
+    size_t n = 0, got;
+    ssize_t r;
+
+    while (conn->sumOff < conn->sumLen && n + SIG_RECORD_SIZE <= sizeof(records) &&
+           (n == 0 || n / SIG_RECORD_SIZE * conn->blockSize < CHECKSUM_SLICE)) {
+        for (got = 0; got < conn->blockSize; got += r) {
+            r = pread(conn->fileFd, block + got, conn->blockSize - got, conn->sumOff + got);
+            if (r < 0 && errno == EINTR) {
+                r = 0;
+            } else if (r <= 0) {
+                return -1;  /* file shrank under us */
+            }
+        }
+        putU32(records + n, rollingChecksum(block, conn->blockSize));
+        putU64(records + n + 4, xxh64(block, conn->blockSize, 0));
+        n += SIG_RECORD_SIZE;
+        conn->sumOff += conn->blockSize;
+    }
+    queueFrame(conn, OP_DATA, records, n);
+    return 0;
+}
+
+/*         Name: openDeltaTarget
+ *  Description: opens the old copy of a delta put as its basis and creates
+ *               the temporary file the new version is rebuilt in
+ *   Parameters: struct connection*, char* path being replaced, which is
+ *               split into directory and name
+ *       Return: int file descriptor of the temporary file, or -1
+ */
+int openDeltaTarget(struct connection *conn, char *path){
+    struct stat st;
+    char *name;
+    int fd;
+
+    if ((conn->basisFd = openRegular(conn, path, &st)) < 0)
+        return -1;
+    conn->basisSize = st.st_size;
+
+    /* the new version is built next to the old one so the rename stays in one directory */
+    if ((conn->deltaDir = resolveParent(conn, path, &name)) < 0)
+        return -1;
+    conn->deltaPath = strdup(name);
+    conn->tempPath = malloc(strlen(name) + 14);
+    if (conn->deltaPath == NULL || conn->tempPath == NULL)
+        return -1;
+    sprintf(conn->tempPath, "%s.delta.XXXXXX", name);
+    if ((fd = createTempAt(conn->deltaDir, conn->tempPath)) < 0) {
+        free(conn->tempPath);
+        conn->tempPath = NULL;
+        return -1;
+    }
+    fchmod(fd, st.st_mode & 07777);
+    return fd;
+}
+
+/*         Name: copyBlocks
+ *  Description: serves a COPY frame of a delta put by copying the named
+ *               blocks of the basis into place, inside the kernel where
+ *               the file system allows
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the frame is done, 0 if the socket would block,
+ *               -1 on error
+ */
+int copyBlocks(struct connection *conn){
+    char buf[CHUNK_SIZE];
+    int64_t len, done;
+    loff_t from, to;
+    uint32_t first, count;
+    ssize_t n;
+    int rv;
+
+    if (conn->parser.frame.length != 8)
+        return -1;
+    if ((rv = fillInputTo(conn, 8)) <= 0)
+        return rv;
+
+    first = getU32((unsigned char *)conn->inbuf + conn->inoff);
+    count = getU32((unsigned char *)conn->inbuf + conn->inoff + 4);
+    len = (int64_t)count * conn->blockSize;
+    if (len > conn->datalen - conn->dataoff)
+        return -1;
+
+    if (conn->fileFd >= 0 && ((int64_t)first + count) * conn->blockSize > conn->basisSize) {
+        close(conn->fileFd);
+        conn->fileFd = -1;
+    }
+
+    for (done = 0; conn->fileFd >= 0 && done < len; done += n) {
+        from = (int64_t)first * conn->blockSize + done;
+        to = conn->dataoff + done;
+        n = copy_file_range(conn->basisFd, &from, conn->fileFd, &to, len - done, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            /* no in-kernel copy here; bounce through a buffer */
+            n = pread(conn->basisFd, buf, (len - done < CHUNK_SIZE) ? len - done : CHUNK_SIZE, from);
+            if (n > 0 && pwrite(conn->fileFd, buf, n, to) != n)
+                n = -1;
+        }
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            /* keep draining the upload, then report the failure */
+            close(conn->fileFd);
+            conn->fileFd = -1;
+        }
+    }
+
+    conn->inoff += 8;
+    conn->dataoff += len;
+    frameConsumePayload(&conn->parser, 8);
+    return 1;
+}
+
+/*         Name: fillInputTo
+ *  Description: reads until inbuf holds at least need unparsed bytes in one
+ *               piece, moving them to the front when they wouldn't fit
+ *   Parameters: struct connection*, size_t need, at most sizeof(inbuf)
+ *       Return: int, 1 when they are there, 0 if the socket would block,
+ *               -1 on error or when the client hung up
+ */
+int fillInputTo(struct connection *conn, size_t need){
+    int rv;
+
+    while (conn->inend - conn->inoff < need) {
+        if (conn->inoff > 0 && conn->inoff + need > sizeof(conn->inbuf)) {
+            memmove(conn->inbuf, conn->inbuf + conn->inoff, conn->inend - conn->inoff);
+            conn->inend -= conn->inoff;
+            conn->inoff = 0;
+        }
+        if ((rv = fillInput(conn)) <= 0)
+            return rv;
+    }
+    return 1;
+}
+
+/*         Name: sendBufferedData
+ *  Description: sends the rest of a get as DATA frames of one chunk each,
+ *               compressed where the chunk shrinks and ending in the
+ *               running CRC32C when the client asked for checksums
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the file is sent, 0 if the socket would block,
+ *               -1 on error
+ */
+int sendBufferedData(struct connection *conn){
+    struct cacheEntry *e = conn->cached;
+    char raw[CODEC_MAX_CHUNK];
+    const char *src;
+    size_t want, packed, len;
+    uint16_t flags;
+    ssize_t n;
+
+    if (conn->zbuf == NULL && !poolTake(conn, &conn->zbuf, 1))
+        return 0;
+
+    while (1) {
+        while (conn->zoff < conn->zlen) {
+            if (!takeTurn(conn))
+                return 0;
+            len = TURN_SIZE(conn, conn->zlen - conn->zoff);
+            n = send(conn->fd, conn->zbuf + conn->zoff, len, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                COUNTER_ADD(conn->worker->sendBlocked, 1);
+                return 0;
+            }
+            if (n < 0)
+                return -1;
+            if ((size_t)n < len)
+                COUNTER_ADD(conn->worker->sendShort, 1);
+            conn->zoff += n;
+            COUNT_OUT(conn, n);
+        }
+        if (conn->dataoff == conn->datalen)
+            return 1;
+        if (!takeTurn(conn))
+            return 0;
+
+        want = (conn->datalen - conn->dataoff < CODEC_MAX_CHUNK) ? conn->datalen - conn->dataoff : CODEC_MAX_CHUNK;
+        if (e != NULL && e->data != NULL) {
+            /* a hot file is read from the cache, not the disk */
+            src = (const char *)e->data + conn->fileBase + conn->dataoff;
+            n = want;
+        } else {
+            do {
+                n = pread(conn->fileFd, raw, want, conn->fileBase + conn->dataoff);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                return -1;  /* file shrank under us */
+            src = raw;
+        }
+        conn->dataoff += n;
+
+        packed = 0;
+        if (conn->compress)
+            packed = compressChunk(&conn->zip, src, n, conn->zbuf + FRAME_HEADER_SIZE + 4,
+                                   compressedBound(CODEC_MAX_CHUNK));
+        if (packed > 0) {
+            putU32(conn->zbuf + FRAME_HEADER_SIZE, n);
+            len = 4 + packed;
+            flags = FLAG_COMPRESS;
+        } else {
+            memcpy(conn->zbuf + FRAME_HEADER_SIZE, src, n);
+            len = n;
+            flags = 0;
+        }
+        if (conn->verify) {
+            /* the cache has the CRC32C of a hot file that goes out whole */
+            if (src != raw && n == e->st.st_size)
+                conn->crc = e->crc;
+            else
+                conn->crc = crc32c(conn->crc, src, n);
+            putU32(conn->zbuf + FRAME_HEADER_SIZE + len, conn->crc);
+            len += 4;
+        }
+        frameBuild(conn->zbuf, OP_DATA, flags, conn->requestId, len);
+        conn->zlen = FRAME_HEADER_SIZE + len;
+        conn->zoff = 0;
+    }
+}
+
+/*         Name: checksumChunk
+ *  Description: adds the file bytes of the next DATA frame of a get to its
+ *               running CRC32C, ahead of sendfile sending them. They come
+ *               from the cache when it holds the file's bytes, and through
+ *               a small buffer otherwise, so the payload itself still goes
+ *               out without a copy. A mapping of the file would save even
+ *               that copy, but it would take a SIGBUS if the file shrank
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 if the file couldn't be read
+ */
+int checksumChunk(struct connection *conn){
+    struct cacheEntry *e = conn->cached;
+    char buf[CHUNK_SIZE];
+    int64_t at = conn->fileBase + conn->dataoff, end = at + conn->chunkLeft;
+    ssize_t n;
+
+    if (e != NULL && e->data != NULL) {
+        /* the cache has the CRC32C of a hot file that goes out whole */
+        if (at == 0 && end == e->st.st_size)
+            conn->crc = e->crc;
+        else
+            conn->crc = crc32c(conn->crc, (const char *)e->data + at, conn->chunkLeft);
+        return 0;
+    }
+
+    while (at < end) {
+        n = pread(conn->fileFd, buf, (end - at < (int64_t)sizeof(buf)) ? end - at : (int64_t)sizeof(buf), at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;  /* file shrank under us */
+        conn->crc = crc32c(conn->crc, buf, n);
+        at += n;
+    }
+    return 0;
+}
+
+/*         Name: recvCompressedChunk
+ *  Description: decompresses a whole compressed DATA frame of an upload
+ *               out of inbuf, checks its CRC32C if it has one, and writes
+ *               it to fileFd
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the frame is done, 0 if the socket would block,
+ *               -1 on error or a corrupt chunk
+ */
+int recvCompressedChunk(struct connection *conn){
+    struct frame_parser *p = &conn->parser;
+    char raw[CODEC_MAX_CHUNK];
+    size_t len = p->frame.length;
+    size_t trailer = conn->verify ? 4 : 0;
+    unsigned char *payload;
+    uint32_t rawLen;
+    int rv;
+
+    if (len <= 4 + trailer || len > sizeof(conn->inbuf))
+        return -1;
+    if ((rv = fillInputTo(conn, len)) <= 0)
+        return rv;
+
+    payload = (unsigned char *)conn->inbuf + conn->inoff;
+    rawLen = getU32(payload);
+    if (rawLen > CODEC_MAX_CHUNK || rawLen > conn->datalen - conn->dataoff ||
+        decompressChunk(conn->zip.codec, payload + 4, len - 4 - trailer, raw, rawLen) < 0)
+        return -1;
+
+    if (conn->verify) {
+        conn->crc = crc32c(conn->crc, raw, rawLen);
+        if (getU32(payload + len - 4) != conn->crc && !conn->corrupt) {
+            conn->corrupt = 1;
+            if (conn->fileFd >= 0)
+                close(conn->fileFd);
+            conn->fileFd = -1;
+        }
+    }
+
+    if (conn->fileFd >= 0 &&
+        pwrite(conn->fileFd, raw, rawLen, conn->fileBase + conn->dataoff) != (ssize_t)rawLen) {
+        /* keep draining the upload, then report the failure */
+        close(conn->fileFd);
+        conn->fileFd = -1;
+    }
+
+    conn->inoff += len;
+    conn->dataoff += rawLen;
+    frameConsumePayload(p, len);
+    return 1;
+}
+
+/*         Name: checkTrailer
+ *  Description: compares the CRC32C that ends a DATA frame with the one
+ *               computed over the data received; on a mismatch the rest
+ *               of the upload is drained and the put fails
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the trailer is consumed, 0 if the socket would
+ *               block, -1 on error
+ */
+int checkTrailer(struct connection *conn){
+    int rv;
+
+    if ((rv = fillInputTo(conn, 4)) <= 0)
+        return rv;
+
+    if (getU32((unsigned char *)conn->inbuf + conn->inoff) != conn->crc && !conn->corrupt) {
+        conn->corrupt = 1;
+        if (conn->fileFd >= 0)
+            close(conn->fileFd);
+        conn->fileFd = -1;
+    }
+    conn->inoff += 4;
+    frameConsumePayload(&conn->parser, 4);
+    return 1;
+}
+
+/*         Name: commitDelta
+ *  Description: puts a rebuilt delta put in place of the old copy; other
+ *               puts have nothing to commit
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 on failure
+ */
+int commitDelta(struct connection *conn){
+    if (conn->tempPath == NULL)
+        return 0;
+    if (renameat(conn->deltaDir, conn->tempPath, conn->deltaDir, conn->deltaPath) < 0)
+        return -1;
+    free(conn->tempPath);
+    conn->tempPath = NULL;
+    return 0;
+}
+
+/*         Name: finishTransfer
+ *  Description: closes the file of a get or put
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void finishTransfer(struct connection *conn){
+    closeCached(conn, conn->fileFd);
+    conn->fileFd = -1;
+    conn->piped = 0;
+    conn->useSplice = 0;
+    conn->datalen = 0;
+    conn->dataoff = 0;
+    conn->chunkLeft = 0;
+    conn->fileBase = 0;
+    conn->sumLen = 0;
+    conn->sumOff = 0;
+    if (conn->basisFd >= 0)
+        close(conn->basisFd);
+    conn->basisFd = -1;
+    conn->delta = 0;
+    if (conn->tempPath != NULL)
+        unlinkat(conn->deltaDir, conn->tempPath, 0);    /* a delta put that never completed */
+    free(conn->tempPath);
+    free(conn->deltaPath);
+    conn->tempPath = conn->deltaPath = NULL;
+    if (conn->deltaDir >= 0)
+        close(conn->deltaDir);
+    conn->deltaDir = -1;
+    conn->compress = 0;
+    conn->zlen = conn->zoff = 0;
+    if (conn->zbuf != NULL && conn->tree == NULL) {
+        /* a tree keeps its zbuf until freeTree */
+        poolGive(conn->worker, conn->zbuf);
+        conn->zbuf = NULL;
+    }
+    conn->verify = 0;
+    conn->crc = 0;
+    conn->corrupt = 0;
+    freeListing(conn);
+    free(conn->stats);
+    conn->stats = NULL;
+    if (conn->ioInflight == 0)
+        uringDetach(conn);
+}
+
+/*         Name: startChecksum
+ *  Description: begins hashing the first len bytes of fileFd for a resumed
+ *               get or a checksummed stat
+ *   Parameters: struct connection*, opcode waiting on the checksum,
+ *               int64_t prefix length, uint32_t checksum the client sent
+ *       Return: void
+ */
+void startChecksum(struct connection *conn, uint8_t op, int64_t len, uint32_t want){
+    conn->sumFor = op;
+    conn->sumLen = len;
+    conn->sumOff = 0;
+    conn->sum = 0;
+    conn->sumWant = want;
+    conn->state = STATE_CHECKSUM;
+}
+
+/*         Name: checksumPrefix
+ *  Description: hashes up to CHECKSUM_SLICE more bytes of the prefix, so a
+ *               large file doesn't stall the worker's other connections
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the prefix is hashed, 0 to continue later,
+ *               -1 on error
+ */
+int checksumPrefix(struct connection *conn){
+    char buf[CHUNK_SIZE];
+    int64_t stop = conn->sumOff + CHECKSUM_SLICE;
+    size_t want;
+    ssize_t n;
+
+    if (stop > conn->sumLen)
+        stop = conn->sumLen;
+
+    while (conn->sumOff < stop) {
+        want = (stop - conn->sumOff < (int64_t)sizeof(buf)) ? stop - conn->sumOff : (int64_t)sizeof(buf);
+        n = pread(conn->fileFd, buf, want, conn->sumOff);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;  /* file shrank under us */
+        conn->sum = crc32c(conn->sum, buf, n);
+        conn->sumOff += n;
+    }
+    return (conn->sumOff == conn->sumLen) ? 1 : 0;
+}
+
+/*         Name: finishChecksum
+ *  Description: answers the request that waited on the checksum: a stat
+ *               gets it back, a get starts sending from the end of the
+ *               prefix if the client's copy matches and from 0 otherwise
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void finishChecksum(struct connection *conn){
+    unsigned char info[24];
+    struct stat st;
+
+    if (fstat(conn->fileFd, &st) < 0) {
+        finishTransfer(conn);
+        reply(conn, OP_ERROR, "fail", 4, STATE_READ_FRAME);
+        return;
+    }
+
+    if (conn->sumFor == OP_STAT) {
+        putU64(info, st.st_size);
+        putU32(info + 8, conn->sum);
+        finishTransfer(conn);
+        reply(conn, OP_FILE_INFO, info, 12, STATE_READ_FRAME);
+        return;
+    }
+
+    conn->fileBase = (conn->sum == conn->sumWant) ? conn->sumLen : 0;
+    conn->datalen = st.st_size - conn->fileBase;
+    conn->dataoff = 0;
+    conn->chunkLeft = 0;
+    printf("resuming get at byte %lld\n", (long long)conn->fileBase);
+
+    putU64(info, st.st_size);
+    putU64(info + 8, conn->fileBase);
+    putU64(info + 16, conn->datalen);
+    queueFrame(conn, OP_FILE_INFO, info, 24);
+    conn->state = STATE_GET_DATA;
+}
+
+/*         Name: startListing
+ *  Description: opens the session's directory for an ls and moves the
+ *               connection on to streaming its entries
+ *   Parameters: struct connection*, request payload, payload length
+ *       Return: int, 0 on success, -1 on a bad request or if the directory
+ *               can't be read
+ */
+int startListing(struct connection *conn, const unsigned char *payload, size_t len){
+    struct listing *list;
+    int fd;
+
+    if (len > 2 || (len == 2 && payload[1] > LIST_SORT_TIME))
+        return -1;
+    if ((fd = openat(conn->dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((list = calloc(1, sizeof(*list))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    list->dirFd = fd;
+    list->options = (len > 0) ? payload[0] : 0;
+    list->sort = (len > 1) ? payload[1] : LIST_SORT_NONE;
+    conn->list = list;
+    conn->state = STATE_LIST;
+    return 0;
+}
+
+/*         Name: nextDirEntry
+ *  Description: finds the next raw entry of the directory, reading more
+ *               with getdents64 once dents is used up; the entry stays
+ *               until the caller moves dentOff past it
+ *   Parameters: struct listing*, struct dirent64** set to the entry
+ *       Return: int, 1 for an entry, 0 at the end, -1 on error
+ */
+int nextDirEntry(struct listing *list, struct dirent64 **entry){
+    ssize_t n;
+
+    if (list->dentOff == list->dentLen) {
+        if ((n = getdents64(list->dirFd, list->dents, sizeof(list->dents))) < 0)
+            return -1;
+        list->dentLen = n;
+        list->dentOff = 0;
+        if (n == 0)
+            return 0;
+    }
+    *entry = (struct dirent64*)(list->dents + list->dentOff);
+    return 1;
+}
+
+/*         Name: describeEntry
+ *  Description: fills in what the listing needs to know about an entry;
+ *               it is only stat'ed when size or mtime are wanted
+ *   Parameters: struct listing*, struct dirent64*, struct listEntry*
+ *       Return: int, 1 to list the entry, 0 to leave it out
+ */
+int describeEntry(struct listing *list, struct dirent64 *d, struct listEntry *e){
+    static const char types[] = { [DT_REG] = '-', [DT_DIR] = 'd', [DT_LNK] = 'l',
+                                  [DT_FIFO] = 'p', [DT_SOCK] = 's', [DT_CHR] = 'c',
+                                  [DT_BLK] = 'b' };
+    struct stat st;
+
+    if (d->d_name[0] == '.' && (!(list->options & LIST_ALL) || d->d_name[1] == '\0' ||
+                                (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+        return 0;
+
+    e->nameLen = strlen(d->d_name);
+    e->type = (d->d_type < sizeof(types) && types[d->d_type]) ? types[d->d_type] : '?';
+    e->size = 0;
+    e->mtime = 0;
+    if ((list->options & LIST_LONG) || list->sort == LIST_SORT_SIZE || list->sort == LIST_SORT_TIME) {
+        if (fstatat(list->dirFd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            return 0;   /* removed since it was read */
+        e->type = S_ISREG(st.st_mode) ? '-' : S_ISDIR(st.st_mode) ? 'd' : S_ISLNK(st.st_mode) ? 'l' :
+                  S_ISFIFO(st.st_mode) ? 'p' : S_ISSOCK(st.st_mode) ? 's' : S_ISCHR(st.st_mode) ? 'c' :
+                  S_ISBLK(st.st_mode) ? 'b' : '?';
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+    }
+    return 1;
+}
+
+/*         Name: addEntry
+ *  Description: keeps an entry of a sorted listing until the whole
+ *               directory has been read
+ *   Parameters: struct listing*, struct listEntry*, char* name
+ *       Return: int, 0 on success, -1 when out of memory
+ */
+int addEntry(struct listing *list, const struct listEntry *e, const char *name){
+    void *p;
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        if ((p = realloc(list->entries, list->capacity * sizeof(*list->entries))) == NULL)
+            return -1;
+        list->entries = p;
+    }
+    while (list->namesLen + e->nameLen + 1 > list->namesCap) {
+        list->namesCap = list->namesCap ? list->namesCap * 2 : 64 * 1024;
+        if ((p = realloc(list->names, list->namesCap)) == NULL)
+            return -1;
+        list->names = p;
+    }
+    list->entries[list->count] = *e;
+    list->entries[list->count].name = list->namesLen;
+    memcpy(list->names + list->namesLen, name, e->nameLen + 1);
+    list->namesLen += e->nameLen + 1;
+    list->count++;
+    return 0;
+}
+
+/*         Name: compareEntries
+ *  Description: qsort_r order of a listing's sort key, ties going by name
+ *   Parameters: two struct listEntry*, struct listing*
+ *       Return: int, <0, 0 or >0
+ */
+int compareEntries(const void *a, const void *b, void *arg){
+    const struct listEntry *x = a, *y = b;
+    const struct listing *list = arg;
+
+    if (list->sort == LIST_SORT_SIZE && x->size != y->size)
+        return (x->size > y->size) ? -1 : 1;
+    if (list->sort == LIST_SORT_TIME && x->mtime != y->mtime)
+        return (x->mtime > y->mtime) ? -1 : 1;
+    return strcmp(list->names + x->name, list->names + y->name);
+}
+
+/*         Name: encodeEntry
+ *  Description: writes the wire record of one entry
+ *   Parameters: output buffer, LIST_ options, struct listEntry*, char* name
+ *       Return: size_t record length
+ */
+size_t encodeEntry(unsigned char *out, uint8_t options, const struct listEntry *e, const char *name){
+    size_t n = 0;
+
+    if (options & LIST_LONG) {
+        out[n++] = e->type;
+        putU64(out + n, e->size);
+        putU64(out + n + 8, e->mtime);
+        n += 16;
+    }
+    out[n++] = e->nameLen >> 8;
+    out[n++] = e->nameLen;
+    memcpy(out + n, name, e->nameLen);
+    return n + e->nameLen;
+}
+
+/*         Name: queueListing
+ *  Description: does one turn of a listing: an unsorted one queues a DATA
+ *               frame of entries as they are read, a sorted one first
+ *               reads a getdents64 buffer full per turn until it has the
+ *               whole directory, then sorts it and queues it page by page
+ *   Parameters: struct connection*
+ *       Return: int, 1 when every entry has been sent, 0 to continue
+ *               later, -1 on error
+ */
+int queueListing(struct connection *conn){
+    struct listing *list = conn->list;
+    unsigned char page[MAX_REPLY];
+    struct listEntry e;
+    struct dirent64 *d = NULL;
+    const char *name;
+    size_t n = 0;
+    int rv;
+
+    if (list->sort != LIST_SORT_NONE && !list->sorted) {
+        do {
+            if ((rv = nextDirEntry(list, &d)) < 0)
+                return -1;
+            if (rv == 0) {
+                qsort_r(list->entries, list->count, sizeof(*list->entries), compareEntries, list);
+                list->sorted = 1;
+                break;
+            }
+            if (describeEntry(list, d, &e) && addEntry(list, &e, d->d_name) < 0)
+                return -1;
+            list->dentOff += d->d_reclen;
+        } while (list->dentOff < list->dentLen);
+        return 0;
+    }
+
+    for (;;) {
+        if (list->sorted) {
+            if (list->next == list->count)
+                break;
+            e = list->entries[(list->options & LIST_REVERSE) ? list->count - 1 - list->next : list->next];
+            name = list->names + e.name;
+        } else {
+            if ((rv = nextDirEntry(list, &d)) < 0)
+                return -1;
+            if (rv == 0)
+                break;
+            if (!describeEntry(list, d, &e)) {
+                list->dentOff += d->d_reclen;
+                continue;
+            }
+            name = d->d_name;
+        }
+
+        /* a page holds whole records only */
+        if (n + ((list->options & LIST_LONG) ? 17 : 0) + 2 + e.nameLen > sizeof(page))
+            break;
+        n += encodeEntry(page + n, list->options, &e, name);
+        if (list->sorted)
+            list->next++;
+        else
+            list->dentOff += d->d_reclen;
+        list->sent++;
+    }
+
+    if (n == 0)
+        return 1;
+    queueFrame(conn, OP_DATA, page, n);
+    return 0;
+}
+
+/*         Name: freeListing
+ *  Description: closes and frees the listing of a connection, if any
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void freeListing(struct connection *conn){
+    if (conn->list == NULL)
+        return;
+    close(conn->list->dirFd);
+    free(conn->list->entries);
+    free(conn->list->names);
+    free(conn->list);
+    conn->list = NULL;
+}
+
+/*         Name: startTree
+ *  Description: begins a tree get of the directory path names, or a tree
+ *               put into it, which creates it if need be. A put whose
+ *               directory can't be made still reads its stream, and every
+ *               entry of it fails
+ *   Parameters: struct connection*, char* path, request flags, int put
+ *       Return: int, 0 on success, -1 if a get's directory can't be read
+ *               or memory runs out
+ */
+int startTree(struct connection *conn, char *path, uint16_t flags, int put){
+    char parent[FRAME_MAX_CONTROL + 1];
+    struct tree *t;
+    char *name;
+    int fd;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        return -1;
+    t->flags = flags & (FLAG_CHECKSUM | FLAG_COMPRESS | FLAG_BATCH);
+    t->fd = t->rootFd = t->dirFd = -1;
+
+    if (put) {
+        fd = resolvePath(conn, path, O_PATH | O_DIRECTORY, 0);
+        if (fd < 0 && errno == ENOENT && strlen(path) < sizeof(parent)) {
+            strcpy(parent, path);
+            if ((fd = resolveParent(conn, parent, &name)) >= 0) {
+                mkdirat(fd, name, 0700);
+                close(fd);
+            }
+            fd = resolvePath(conn, path, O_PATH | O_DIRECTORY, 0);
+        }
+        t->rootFd = fd;
+        conn->tree = t;
+        conn->state = STATE_TREE_PUT;
+        return 0;
+    }
+
+    if ((fd = resolvePath(conn, path, O_RDONLY | O_DIRECTORY, 0)) < 0 ||
+        (t->dirs[0] = calloc(1, sizeof(struct listing))) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        free(t);
+        return -1;
+    }
+    t->dirs[0]->dirFd = fd;
+    t->depth = 1;
+    conn->tree = t;
+    compressorInit(&conn->zip, conn->zip.codec);
+    conn->state = STATE_TREE_GET;
+    return 0;
+}
+
+/*         Name: nextTreeEntry
+ *  Description: walks a tree get on to its next directory or regular
+ *               file, depth first, and opens it into t->fd; other kinds
+ *               of entries are left out, and ones that can't be opened
+ *               count as failed
+ *   Parameters: struct tree*
+ *       Return: int, 1 for an entry, 0 when the whole tree has been read
+ */
+int nextTreeEntry(struct tree *t){
+    struct listing *list;
+    struct dirent64 *d;
+    size_t len;
+    int rv;
+
+    while (t->depth > 0) {
+        list = t->dirs[t->depth - 1];
+        if ((rv = nextDirEntry(list, &d)) <= 0) {
+            /* done with the directory, or it can't be read any further */
+            if (rv < 0)
+                t->failed++;
+            close(list->dirFd);
+            free(list);
+            if (--t->depth > 0)
+                t->path[t->pathLen[t->depth - 1]] = '\0';
+            continue;
+        }
+        list->dentOff += d->d_reclen;
+
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+            (d->d_type != DT_REG && d->d_type != DT_DIR && d->d_type != DT_UNKNOWN))
+            continue;
+        if (d->d_type == DT_UNKNOWN &&
+            (fstatat(list->dirFd, d->d_name, &t->st, AT_SYMLINK_NOFOLLOW) < 0 ||
+             !(S_ISREG(t->st.st_mode) || S_ISDIR(t->st.st_mode))))
+            continue;
+
+        len = t->pathLen[t->depth - 1];
+        t->relLen = len + (len > 0) + strlen(d->d_name);
+        if (t->relLen > FRAME_MAX_CONTROL - TREE_HEADER) {
+            t->failed++;
+            continue;
+        }
+        memcpy(t->rel, t->path, len);
+        if (len > 0)
+            t->rel[len++] = '/';
+        strcpy(t->rel + len, d->d_name);
+
+        /* O_NONBLOCK, so a FIFO that took the place of a file can't stall the worker */
+        t->fd = openat(list->dirFd, d->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (t->fd >= 0 && fstat(t->fd, &t->st) == 0 &&
+            (S_ISREG(t->st.st_mode) || (S_ISDIR(t->st.st_mode) && t->depth < TREE_DEPTH)))
+            return 1;
+        if (t->fd < 0 || S_ISDIR(t->st.st_mode))
+            t->failed++;
+        if (t->fd >= 0)
+            close(t->fd);
+        t->fd = -1;
+    }
+    return 0;
+}
+
+/*         Name: queueTree
+ *  Description: does one turn of a tree get: queues ENTRY frames, each
+ *               small file's data right behind its ENTRY or, if the client
+ *               takes them, gathered into a BATCH, until outbuf is full, a
+ *               BATCH is sealed or a larger file comes up; that one goes
+ *               out in STATE_GET_DATA, which comes back here once it is sent
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the whole tree has been sent, 0 to continue
+ *               later, -1 on error
+ */
+int queueTree(struct connection *conn){
+    struct tree *t = conn->tree;
+    unsigned char entry[FRAME_MAX_CONTROL], *bufs[4];
+    struct listing *list;
+    size_t need;
+    int isFile, n = 0;
+
+    /*
+     * every buffer the tree will need is taken before the first entry, all
+     * at once, so two trees never hold part each and wait for the rest:
+     * zbuf for compressed or checksummed data, and index, data and the
+     * sealed frame of a BATCH
+     */
+    if (conn->zbuf == NULL && (t->flags & (FLAG_COMPRESS | FLAG_CHECKSUM)))
+        n++;
+    if (t->index == NULL && (t->flags & FLAG_BATCH))
+        n += 3;
+    if (n > 0) {
+        if (!poolTake(conn, bufs, n))
+            return 0;
+        if (t->flags & FLAG_BATCH) {
+            t->batch = bufs[--n];
+            t->data = bufs[--n];
+            t->index = bufs[--n];
+        }
+        if (n > 0)
+            conn->zbuf = bufs[0];
+    }
+
+    while (t->fd >= 0 || nextTreeEntry(t)) {
+        isFile = S_ISREG(t->st.st_mode);
+        if ((t->flags & FLAG_BATCH) && isFile && t->st.st_size <= TREE_INLINE) {
+            /* a full batch goes out behind what outbuf holds; the file waits for the next */
+            if (t->count == BATCH_FILES ||
+                2 + t->indexLen + BATCH_RECORD + 4 + t->relLen + t->dataLen + t->st.st_size > BATCH_MAX) {
+                sealBatch(conn);
+                return 0;
+            }
+            if (addToBatch(conn) < 0)
+                return -1;
+            close(t->fd);
+            t->fd = -1;
+            continue;
+        }
+
+        need = FRAME_HEADER_SIZE + TREE_HEADER + t->relLen;
+        if (isFile && t->st.st_size <= TREE_INLINE)
+            need += FRAME_HEADER_SIZE + 4 + t->st.st_size + 4;
+        if (conn->outoff < conn->outlen && conn->outlen + need > sizeof(conn->outbuf))
+            return 0;   /* the entry waits in t->fd until outbuf is sent */
+
+        entry[0] = isFile ? '-' : 'd';
+        putU32(entry + 1, t->st.st_mode & 07777);
+        putU64(entry + 5, isFile ? t->st.st_size : 0);
+        putU64(entry + 13, t->st.st_mtime);
+        memcpy(entry + TREE_HEADER, t->rel, t->relLen);
+        queueFrame(conn, OP_ENTRY, entry, TREE_HEADER + t->relLen);
+        t->entries++;
+
+        if (!isFile) {
+            if ((list = calloc(1, sizeof(*list))) == NULL)
+                return -1;
+            list->dirFd = t->fd;
+            t->dirs[t->depth] = list;
+            memcpy(t->path, t->rel, t->relLen + 1);
+            t->pathLen[t->depth++] = t->relLen;
+            t->fd = -1;
+            continue;
+        }
+        if (t->st.st_size > TREE_INLINE) {
+            /* too big for outbuf; it is sent like the file of a get */
+            conn->fileFd = t->fd;
+            conn->datalen = t->st.st_size;
+            conn->dataoff = conn->fileBase = conn->chunkLeft = 0;
+            conn->verify = (t->flags & FLAG_CHECKSUM) != 0;
+            conn->compress = (t->flags & FLAG_COMPRESS) && conn->zip.codec != CODEC_NONE;
+            conn->state = STATE_GET_DATA;
+            t->fd = -1;
+            return 0;
+        }
+        if (t->st.st_size > 0 && queueTreeData(conn) < 0)
+            return -1;
+        close(t->fd);
+        t->fd = -1;
+    }
+    if (t->count > 0) {
+        sealBatch(conn);
+        return 0;
+    }
+    return 1;
+}
+
+/*         Name: queueTreeData
+ *  Description: reads a small file of a tree get straight into outbuf as
+ *               one DATA frame, compressed if that shrinks it and ending
+ *               in its CRC32C when the client asked for checksums
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 on error
+ */
+int queueTreeData(struct connection *conn){
+    struct tree *t = conn->tree;
+    unsigned char *frame = conn->outbuf + conn->outlen;
+    unsigned char *data = frame + FRAME_HEADER_SIZE;
+    size_t size = t->st.st_size, len = size, got, packed = 0;
+    uint16_t flags = 0;
+    uint32_t crc;
+    ssize_t n;
+
+    for (got = 0; got < size; got += n) {
+        n = pread(t->fd, data + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            return -1;  /* file shrank under us */
+    }
+    crc = (t->flags & FLAG_CHECKSUM) ? crc32c(0, data, size) : 0;
+
+    if ((t->flags & FLAG_COMPRESS) && conn->zip.codec != CODEC_NONE)
+        packed = compressChunk(&conn->zip, data, size, conn->zbuf, compressedBound(CODEC_MAX_CHUNK));
+    if (packed > 0) {
+        putU32(data, size);
+        memcpy(data + 4, conn->zbuf, packed);
+        len = 4 + packed;
+        flags = FLAG_COMPRESS;
+    }
+    if (t->flags & FLAG_CHECKSUM) {
+        putU32(data + len, crc);
+        len += 4;
+    }
+    conn->outlen += frameBuild(frame, OP_DATA, flags, conn->requestId, len) + len;
+    return 0;
+}
+
+/*         Name: addToBatch
+ *  Description: reads the small file in t->fd into the batch being
+ *               gathered and describes it in the batch's index; a file
+ *               that shrank while it was read is left out as failed
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 on error
+ */
+int addToBatch(struct connection *conn){
+    struct tree *t = conn->tree;
+    unsigned char *rec = t->index + t->indexLen;
+    unsigned char *data = t->data + t->dataLen;
+    size_t size = t->st.st_size, got, crcLen = (t->flags & FLAG_CHECKSUM) ? 4 : 0;
+    ssize_t n;
+
+    for (got = 0; got < size; got += n) {
+        n = pread(t->fd, data + got, size - got, got);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            t->failed++;
+            return 0;
+        }
+    }
+
+    putU32(rec, t->st.st_mode & 07777);
+    putU64(rec + 4, size);
+    putU64(rec + 12, t->st.st_mtime);
+    if (crcLen)
+        putU32(rec + 20, crc32c(0, data, size));
+    rec[20 + crcLen] = t->relLen >> 8;
+    rec[21 + crcLen] = t->relLen;
+    memcpy(rec + BATCH_RECORD + crcLen, t->rel, t->relLen);
+    t->indexLen += BATCH_RECORD + crcLen + t->relLen;
+    t->dataLen += size;
+    t->count++;
+    t->entries++;
+    return 0;
+}
+
+/*         Name: sealBatch
+ *  Description: turns the files gathered so far into one BATCH frame,
+ *               compressed if the client asked and that shrinks it, for
+ *               flushBatch to send once outbuf is out
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void sealBatch(struct connection *conn){
+    struct tree *t = conn->tree;
+    unsigned char *raw = t->batch + FRAME_HEADER_SIZE + 4;
+    size_t len = 2 + t->indexLen + t->dataLen, packed = 0;
+
+    /* raw leaves room for a header, and for a u32 length should it be packed over */
+    raw[0] = t->count >> 8;
+    raw[1] = t->count;
+    memcpy(raw + 2, t->index, t->indexLen);
+    memcpy(raw + 2 + t->indexLen, t->data, t->dataLen);
+
+    if ((t->flags & FLAG_COMPRESS) && conn->zip.codec != CODEC_NONE)
+        packed = compressChunk(&conn->zip, raw, len, conn->zbuf, compressedBound(CODEC_MAX_CHUNK));
+    if (packed > 0) {
+        putU32(raw - 4, len);
+        memcpy(raw, conn->zbuf, packed);
+        frameBuild(t->batch, OP_BATCH, FLAG_COMPRESS, conn->requestId, 4 + packed);
+        t->batchOff = 0;
+        t->batchLen = FRAME_HEADER_SIZE + 4 + packed;
+    } else {
+        frameBuild(t->batch + 4, OP_BATCH, 0, conn->requestId, len);
+        t->batchOff = 4;
+        t->batchLen = FRAME_HEADER_SIZE + 4 + len;
+    }
+    t->count = 0;
+    t->indexLen = t->dataLen = 0;
+}
+
+/*         Name: flushBatch
+ *  Description: sends whatever is left of the sealed BATCH frame, if any
+ *   Parameters: struct connection*
+ *       Return: int, 1 when it is out, 0 if the socket would block, -1 on
+ *               error
+ */
+int flushBatch(struct connection *conn){
+    struct tree *t = conn->tree;
+    ssize_t n;
+
+    while (t->batchOff < t->batchLen) {
+        n = send(conn->fd, t->batch + t->batchOff, t->batchLen - t->batchOff, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            COUNTER_ADD(conn->worker->sendBlocked, 1);
+            return 0;
+        }
+        if (n < 0)
+            return -1;
+        if ((size_t)n < t->batchLen - t->batchOff)
+            COUNTER_ADD(conn->worker->sendShort, 1);
+        t->batchOff += n;
+        COUNT_OUT(conn, n);
+    }
+    return 1;
+}
+
+/*         Name: receiveTreeEntry
+ *  Description: serves an ENTRY frame of a tree put: makes a directory,
+ *               or creates a file and moves on to receiving its DATA; the
+ *               ENTRY without payload ends the tree and is answered. BATCH
+ *               frames go to storeBatch
+ *   Parameters: struct connection*, struct frame*, payload bytes
+ *       Return: int, 1 to keep going, -1 to close the connection
+ */
+int receiveTreeEntry(struct connection *conn, const struct frame *frame, unsigned char *payload){
+    struct tree *t = conn->tree;
+    char path[FRAME_MAX_CONTROL + 1];
+    unsigned char counts[16];
+    char *name;
+    int dirFd;
+    mode_t mode;
+
+    if (frame->opcode == OP_BATCH)
+        return storeBatch(conn, frame, payload);
+    if (frame->opcode != OP_ENTRY)
+        return -1;
+    if (frame->length == 0) {
+        printf("received tree, %llu entries, %llu failed\n",
+               (unsigned long long)t->entries, (unsigned long long)t->failed);
+        putU64(counts, t->entries);
+        putU64(counts + 8, t->failed);
+        freeTree(conn);
+        reply(conn, OP_OK, counts, 16, STATE_READ_FRAME);
+        return 1;
+    }
+    if (frame->length <= TREE_HEADER || (payload[0] != 'd' && payload[0] != '-') ||
+        (int64_t)getU64(payload + 5) < 0 ||
+        payloadString(payload + TREE_HEADER, frame->length - TREE_HEADER, path, sizeof(path)) < 0)
+        return -1;
+
+    t->entries++;
+    mode = getU32(payload + 1) & 07777;
+    dirFd = openTreeParent(t, path, &name);
+    if (payload[0] == 'd') {
+        /* we have to be able to fill it */
+        if (dirFd < 0 || (mkdirat(dirFd, name, mode | 0700) < 0 && errno != EEXIST))
+            t->failed++;
+        return 1;
+    }
+
+    /* if the file can't be created its data is still read and dropped */
+    conn->fileFd = -1;
+    if (dirFd >= 0)
+        conn->fileFd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+    conn->datalen = getU64(payload + 5);
+    conn->dataoff = 0;
+    conn->fileBase = 0;
+    conn->verify = (t->flags & FLAG_CHECKSUM) != 0;
+    t->mtime = getU64(payload + 13);
+    conn->state = STATE_PUT_DATA;
+    return 1;
+}
+
+/*         Name: storeBatch
+ *  Description: serves a BATCH frame of a tree put. Its index is checked
+ *               whole first, then its files are created and written one
+ *               after another straight out of the frame, without a turn
+ *               of the state machine per file; each one that can't be
+ *               stored, or fails its CRC32C, counts as failed
+ *   Parameters: struct connection*, struct frame*, payload bytes
+ *       Return: int, 1 to keep going, -1 to close the connection
+ */
+int storeBatch(struct connection *conn, const struct frame *frame, unsigned char *payload){
+    struct tree *t = conn->tree;
+    char raw[BATCH_MAX];
+    char path[FRAME_MAX_CONTROL + 1];
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, 0 } };
+    size_t len = frame->length, crcLen = (t->flags & FLAG_CHECKSUM) ? 4 : 0;
+    size_t rec, pos, pathLen, size;
+    unsigned count, i;
+    char *name;
+    int dirFd, fd;
+
+    if (frame->flags & FLAG_COMPRESS) {
+        if (len <= 4 || conn->zip.codec == CODEC_NONE || getU32(payload) > BATCH_MAX ||
+            decompressChunk(conn->zip.codec, payload + 4, len - 4, raw, getU32(payload)) < 0)
+            return -1;
+        len = getU32(payload);
+        payload = (unsigned char*)raw;
+    }
+    if (len < 2)
+        return -1;
+    count = payload[0] << 8 | payload[1];
+    for (i = 0, pos = 2, size = 0; i < count; i++) {
+        if (pos + BATCH_RECORD + crcLen > len || getU64(payload + pos + 4) > len)
+            return -1;
+        size += getU64(payload + pos + 4);
+        pos += BATCH_RECORD + crcLen + (payload[pos + 20 + crcLen] << 8 | payload[pos + 21 + crcLen]);
+    }
+    if (pos > len || size != len - pos)
+        return -1;
+
+    for (i = 0, rec = 2; i < count; i++) {
+        size = getU64(payload + rec + 4);
+        times[1].tv_sec = getU64(payload + rec + 12);
+        pathLen = payload[rec + 20 + crcLen] << 8 | payload[rec + 21 + crcLen];
+        t->entries++;
+        fd = -1;
+        if (payloadString(payload + rec + BATCH_RECORD + crcLen, pathLen, path, sizeof(path)) == 0 &&
+            (!crcLen || crc32c(0, payload + pos, size) == getU32(payload + rec + 20)) &&
+            (dirFd = openTreeParent(t, path, &name)) >= 0)
+            fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                        getU32(payload + rec) & 07777);
+        if (fd < 0 || write(fd, payload + pos, size) != (ssize_t)size || futimens(fd, times) < 0)
+            t->failed++;
+        if (fd >= 0)
+            close(fd);
+        rec += BATCH_RECORD + crcLen + pathLen;
+        pos += size;
+    }
+    return 1;
+}
+
+/*         Name: openTreeParent
+ *  Description: finds the directory an entry of a tree put goes in,
+ *               beneath the top of the tree. The last one is kept open,
+ *               as a tree's files arrive grouped by directory
+ *   Parameters: struct tree*, char* path in the tree, which is cut after
+ *               the directory part, char** set to the entry's name
+ *       Return: int directory descriptor, owned by the tree, or -1
+ */
+int openTreeParent(struct tree *t, char *path, char **name){
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    char *slash = strrchr(path, '/');
+
+    *name = slash ? slash + 1 : path;
+    if (**name == '\0' || strcmp(*name, ".") == 0 || strcmp(*name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (slash == NULL)
+        return t->rootFd;
+
+    *slash = '\0';
+    if (t->dirFd >= 0 && strcmp(t->path, path) == 0)
+        return t->dirFd;
+    if (t->dirFd >= 0)
+        close(t->dirFd);
+    t->dirFd = syscall(SYS_openat2, t->rootFd, path, &how, sizeof(how));
+    strcpy(t->path, path);
+    return t->dirFd;
+}
+
+/*         Name: freeTree
+ *  Description: closes and frees the tree of a connection, if any
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void freeTree(struct connection *conn){
+    struct tree *t = conn->tree;
+
+    if (t == NULL)
+        return;
+    while (t->depth > 0) {
+        close(t->dirs[--t->depth]->dirFd);
+        free(t->dirs[t->depth]);
+    }
+    if (t->fd >= 0)
+        close(t->fd);
+    if (t->rootFd >= 0)
+        close(t->rootFd);
+    if (t->dirFd >= 0)
+        close(t->dirFd);
+    if (t->index != NULL) {
+        poolGive(conn->worker, t->index);
+        poolGive(conn->worker, t->data);
+        poolGive(conn->worker, t->batch);
+    }
+    if (conn->zbuf != NULL) {
+        poolGive(conn->worker, conn->zbuf);
+        conn->zbuf = NULL;
+    }
+    free(t);
+    conn->tree = NULL;
+}
+
+/*         Name: joinPath
+ *  Description: works out where path leads from the directory cwd, both
+ *               relative to the root; ".." stops at the root and an
+ *               absolute path starts there, as in a chroot
+ *   Parameters: char* cwd, char* path, output buffer and its size
+ *       Return: int, 0 on success, -1 if the result doesn't fit
+ */
+int joinPath(const char *cwd, const char *path, char *out, size_t size){
+    const char *parts[2] = { (path[0] == '/') ? "" : cwd, path };
+    const char *p, *end;
+    size_t len = 0, n;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        for (p = parts[i]; *p; p = end) {
+            while (*p == '/')
+                p++;
+            end = strchrnul(p, '/');
+            n = end - p;
+            if (n == 0 || (n == 1 && p[0] == '.'))
+                continue;
+            if (n == 2 && p[0] == '.' && p[1] == '.') {
+                while (len > 0 && out[len - 1] != '/')
+                    len--;
+                if (len > 0)
+                    len--;
+                continue;
+            }
+            if (len + 1 + n + 1 > size)
+                return -1;
+            if (len > 0)
+                out[len++] = '/';
+            memcpy(out + len, p, n);
+            len += n;
+        }
+    }
+    if (len == 0)
+        out[len++] = '.';
+    out[len] = '\0';
+    return 0;
+}
+
+/*         Name: resolvePath
+ *  Description: opens path for a session. It is looked up from the
+ *               session's directory fd; a path that is absolute, climbs
+ *               out with "..", or crosses a symlink out of the directory
+ *               is joined to the session's cwd and looked up from the
+ *               root instead. RESOLVE_BENEATH keeps either lookup, and
+ *               any symlinks on the way, under the root.
+ *   Parameters: struct connection*, char* path, open flags, creation mode
+ *       Return: int file descriptor, or -1 with errno set
+ */
+int resolvePath(struct connection *conn, const char *path, int flags, mode_t mode){
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC,
+        .mode = (flags & O_CREAT) ? mode : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    char full[PATH_MAX];
+    const char *p;
+    int fd, up = 0;
+
+    for (p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+            up = 1;
+    }
+    if (path[0] != '/' && !up) {
+        fd = syscall(SYS_openat2, conn->dirFd, path, &how, sizeof(how));
+        if (fd >= 0 || errno != EXDEV)
+            return fd;
+    }
+
+    if (joinPath(conn->cwd, path, full, sizeof(full)) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return syscall(SYS_openat2, rootFd, full, &how, sizeof(how));
+}
+
+/*         Name: resolveParent
+ *  Description: opens the directory a new entry named by path goes in,
+ *               for the *at calls that take a directory and a name
+ *   Parameters: struct connection*, char* path, which is cut after the
+ *               directory part, char** set to the entry's name
+ *       Return: int O_PATH descriptor of the directory, or -1
+ */
+int resolveParent(struct connection *conn, char *path, char **name){
+    char *slash;
+    size_t len = strlen(path);
+
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    if ((slash = strrchr(path, '/')) == NULL) {
+        *name = path;
+        path = ".";
+    } else {
+        *name = slash + 1;
+        *slash = '\0';
+        if (slash == path)
+            path = "/";
+    }
+    if (**name == '\0' || strcmp(*name, ".") == 0 || strcmp(*name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return resolvePath(conn, path, O_PATH | O_DIRECTORY, 0);
+}
+
+/*         Name: createTempAt
+ *  Description: mkstemp relative to a directory fd: replaces the trailing
+ *               XXXXXX of name and creates the file exclusively
+ *   Parameters: int directory fd, char* name ending in XXXXXX
+ *       Return: int file descriptor, or -1
+ */
+int createTempAt(int dirFd, char *name){
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    char *x = name + strlen(name) - 6;
+    unsigned char r[6];
+    int fd, i, tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        if (getrandom(r, sizeof(r), 0) != sizeof(r))
+            return -1;
+        for (i = 0; i < 6; i++)
+            x[i] = letters[r[i] % (sizeof(letters) - 1)];
+        fd = openat(dirFd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
+
+/*         Name: openRegular
+ *  Description: opens a regular file of the session for reading
+ *   Parameters: struct connection*, char* path, struct stat* filled in on
+ *               success
+ *       Return: int file descriptor, or -1 if it isn't a readable regular file
+ */
+int openRegular(struct connection *conn, const char *path, struct stat *st){
+    int fd = resolvePath(conn, path, O_RDONLY, 0);
+
+    if (fd >= 0 && (fstat(fd, st) < 0 || !S_ISREG(st->st_mode))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*         Name: poolInit
+ *  Description: maps a worker's share of the memory budget and cuts it
+ *               into POOL_CHUNK buffers, each room for one whole DATA or
+ *               BATCH frame; pages are only backed once a buffer is used
+ *   Parameters: struct worker*, bytes of budget
+ *       Return: int, 0 on success, -1 if the buffers can't be mapped
+ */
+int poolInit(struct worker *w, size_t budget){
+    int i;
+
+    w->poolSize = budget / POOL_CHUNK;
+    if (w->poolSize < POOL_MIN)
+        w->poolSize = POOL_MIN;
+    w->pool = mmap(NULL, (size_t)w->poolSize * POOL_CHUNK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (w->pool == MAP_FAILED || (w->poolFree = malloc(w->poolSize * sizeof(*w->poolFree))) == NULL)
+        return -1;
+
+    /* the low buffers are handed out first, so a quiet server touches few pages */
+    for (i = 0; i < w->poolSize; i++)
+        w->poolFree[i] = w->pool + (size_t)(w->poolSize - 1 - i) * POOL_CHUNK;
+    w->poolFreeCount = w->poolSize;
+    return 0;
+}
+
+/*         Name: poolTake
+ *  Description: takes n buffers of the connection's worker, all or none.
+ *               With too few free, or others already waiting, the
+ *               connection joins the end of the wait list and stops
+ *               polling its socket until poolWake serves it
+ *   Parameters: struct connection*, where to put the buffers, int n
+ *       Return: int, 1 with the buffers taken, 0 if the connection waits
+ */
+int poolTake(struct connection *conn, unsigned char **bufs, int n){
+    struct worker *w = conn->worker;
+    int i;
+
+    if (w->poolFreeCount < n || (w->waitHead != NULL && w->waking != conn)) {
+        if (!conn->poolWait) {
+            conn->poolWait = n;
+            conn->waitNext = NULL;
+            if (w->waitTail != NULL)
+                w->waitTail->waitNext = conn;
+            else
+                w->waitHead = conn;
+            w->waitTail = conn;
+            COUNTER_ADD(w->poolWaits, 1);
+        }
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+        bufs[i] = w->poolFree[--w->poolFreeCount];
+    return 1;
+}
+
+/*         Name: poolGive
+ *  Description: returns a buffer to its worker's pool
+ *   Parameters: struct worker*, buffer
+ *       Return: void
+ */
+void poolGive(struct worker *w, unsigned char *buf){
+    w->poolFree[w->poolFreeCount++] = buf;
+}
+
+/*         Name: poolWake
+ *  Description: serves waiting connections, oldest first, for as long as
+ *               the oldest one's buffers are free; run after every turn
+ *               of the event loop
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void poolWake(struct worker *w){
+    struct connection *conn;
+
+    while ((conn = w->waitHead) != NULL && w->poolFreeCount >= conn->poolWait) {
+        poolLeave(conn);
+        w->waking = conn;
+        handleConnection(conn);
+        w->waking = NULL;
+    }
+}
+
+/*         Name: poolLeave
+ *  Description: takes a connection off its worker's wait list
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void poolLeave(struct connection *conn){
+    struct worker *w = conn->worker;
+    struct connection **p, *prev = NULL;
+
+    for (p = &w->waitHead; *p != conn; p = &(*p)->waitNext)
+        prev = *p;
+    *p = conn->waitNext;
+    if (w->waitTail == conn)
+        w->waitTail = prev;
+    conn->poolWait = 0;
+}
+
+/*         Name: rateInit
+ *  Description: fills a worker's share of --rate and makes the timer that
+ *               refills it, and the session buckets, while transfers wait
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void rateInit(struct worker *w){
+    struct epoll_event ev;
+
+    w->timerFd = -1;
+    if (rateLimit == 0 && sessionRate == 0)
+        return;
+
+    w->tokens = (rateLimit / numWorkers / 10 > FAIR_QUANTUM) ? rateLimit / numWorkers / 10 : FAIR_QUANTUM;
+    clock_gettime(CLOCK_MONOTONIC, &w->refilled);
+    w->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->timerFd;
+    if (w->timerFd < 0 || epoll_ctl(w->epollFd, EPOLL_CTL_ADD, w->timerFd, &ev) < 0) {
+        printf("Error: worker %d couldn't set up its rate timer\n", w->id);
+        exit(-1);
+    }
+}
+
+/*         Name: takeTurn
+ *  Description: asks whether a transfer may move more bytes now. Each time
+ *               it is served it has its weight in FAIR_QUANTUM bytes, less
+ *               any it overran the last turn by, before it yields to the
+ *               other transfers: deficit round robin over the link. A
+ *               transfer on the io_uring backend has one frame in flight,
+ *               so there a turn is one frame and weights don't apply. With
+ *               --rate or --session-rate it also needs tokens in both
+ *               buckets, and waits for rateTick when either runs dry
+ *   Parameters: struct connection*
+ *       Return: int, 1 to go on, 0 when it must wait
+ */
+int takeTurn(struct connection *conn){
+    struct worker *w = conn->worker;
+
+    if (conn->throttled)
+        return 0;
+    if (conn->turnLeft <= 0) {
+        COUNTER_ADD(w->yields, 1);
+        conn->yielded = 1;
+        return 0;
+    }
+
+    if (rateLimit > 0)
+        refill(&w->tokens, &w->refilled, rateLimit / numWorkers);
+    if (sessionRate > 0)
+        refill(&conn->tokens, &conn->refilled, sessionRate);
+    if ((rateLimit > 0 && w->tokens <= 0) || (sessionRate > 0 && conn->tokens <= 0)) {
+        throttle(conn);
+        return 0;
+    }
+    return 1;
+}
+
+/*         Name: parseWeight
+ *  Description: adds a --weight rule: sessions from ADDR get N turns' worth
+ *               of bytes for every one a session of weight 1 gets
+ *   Parameters: char* ADDR=N
+ *       Return: int, 0 on success, -1 if it doesn't parse or there are too
+ *               many rules
+ */
+int parseWeight(const char *arg){
+    struct weightRule *rule = &weightRules[numWeightRules];
+    const char *eq = strchr(arg, '=');
+    char addr[INET_ADDRSTRLEN];
+
+    if (numWeightRules == WEIGHT_RULES || eq == NULL || (size_t)(eq - arg) >= sizeof(addr))
+        return -1;
+    memcpy(addr, arg, eq - arg);
+    addr[eq - arg] = '\0';
+    rule->weight = atoi(eq + 1);
+    if (inet_pton(AF_INET, addr, &rule->addr) != 1 || rule->weight < 1 || rule->weight > MAX_WEIGHT)
+        return -1;
+    numWeightRules++;
+    return 0;
+}
+
+/*         Name: sessionWeight
+ *  Description: looks up the --weight of a client address
+ *   Parameters: uint32_t address, network order
+ *       Return: int weight, 1 without a rule
+ */
+int sessionWeight(uint32_t addr){
+    int i;
+
+    for (i = 0; i < numWeightRules; i++) {
+        if (weightRules[i].addr == addr)
+            return weightRules[i].weight;
+    }
+    return 1;
+}
+
+/*         Name: refill
+ *  Description: adds the tokens a bucket earned since it was last filled.
+ *               A bucket holds a tenth of a second's worth, and at least
+ *               FAIR_QUANTUM; below zero it is in debt for bytes a send
+ *               took past what it had
+ *   Parameters: tokens, time of the last refill, bytes/s
+ *       Return: void
+ */
+void refill(int64_t *tokens, struct timespec *refilled, uint64_t rate){
+    struct timespec now;
+    int64_t burst = (rate / 10 > FAIR_QUANTUM) ? rate / 10 : FAIR_QUANTUM;
+    uint64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - refilled->tv_sec) * 1000000 + (now.tv_nsec - refilled->tv_nsec) / 1000;
+    if (us < 1000)
+        return;
+    *refilled = now;
+    *tokens += (us * rate) / 1000000;
+    if (*tokens > burst)
+        *tokens = burst;
+}
+
+/*         Name: throttle
+ *  Description: parks a transfer out of tokens on its worker's list and
+ *               starts the timer if it isn't running
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void throttle(struct connection *conn){
+    struct worker *w = conn->worker;
+    struct itimerspec tick = { { 0, RATE_TICK * 1000000 }, { 0, RATE_TICK * 1000000 } };
+
+    COUNTER_ADD(w->throttles, 1);
+    conn->throttled = 1;
+    conn->throttleNext = NULL;
+    if (w->throttledTail != NULL)
+        w->throttledTail->throttleNext = conn;
+    else
+        w->throttledHead = conn;
+    w->throttledTail = conn;
+    if (w->throttledHead == conn)
+        timerfd_settime(w->timerFd, 0, &tick, NULL);
+}
+
+/*         Name: throttleLeave
+ *  Description: takes a connection off its worker's throttled list
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void throttleLeave(struct connection *conn){
+    struct worker *w = conn->worker;
+    struct connection **p, *prev = NULL;
+
+    for (p = &w->throttledHead; *p != conn; p = &(*p)->throttleNext)
+        prev = *p;
+    *p = conn->throttleNext;
+    if (w->throttledTail == conn)
+        w->throttledTail = prev;
+    conn->throttled = 0;
+}
+
+/*         Name: rateTick
+ *  Description: on each tick of the rate timer, serves the throttled
+ *               transfers in the order they ran dry; those still short of
+ *               tokens go back on the list. The timer stops once it is empty
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void rateTick(struct worker *w){
+    struct itimerspec off = { { 0, 0 }, { 0, 0 } };
+    struct connection *conn, *last = w->throttledTail;
+    uint64_t expirations;
+
+    if (read(w->timerFd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+        return;
+
+    /* stops at the last one that was waiting, not at those that rejoin */
+    while ((conn = w->throttledHead) != NULL) {
+        throttleLeave(conn);
+        handleConnection(conn);
+        if (conn == last)
+            break;
+    }
+    if (w->throttledHead == NULL)
+        timerfd_settime(w->timerFd, 0, &off, NULL);
+}
+
+/*         Name: cacheInit
+ *  Description: sets up a worker's file cache and the inotify instance
+ *               that keeps it current; without inotify the cache stays off
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void cacheInit(struct worker *w){
+    struct epoll_event ev;
+
+    w->cache.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->cache.inotifyFd < 0)
+        return;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->cache;
+    if (epoll_ctl(w->epollFd, EPOLL_CTL_ADD, w->cache.inotifyFd, &ev) < 0) {
+        close(w->cache.inotifyFd);
+        w->cache.inotifyFd = -1;
+    }
+}
+
+/*         Name: openCached
+ *  Description: opens a regular file of the session for reading through
+ *               the worker's cache. A hit costs no system call; a miss
+ *               opens the file and keeps it, evicting the least recently
+ *               used entry nobody is reading. A file found again becomes
+ *               hot, and if it is small its bytes are kept as well
+ *   Parameters: struct connection*, char* path, struct stat* filled in on
+ *               success
+ *       Return: int file descriptor, or -1 if it isn't a readable regular
+ *               file; if it belongs to the cache conn->cached is set, and
+ *               either way closeCached gives it back
+ */
+int openCached(struct connection *conn, const char *path, struct stat *st){
+    struct fileCache *c = &conn->worker->cache;
+    struct cacheEntry *e;
+    struct timespec now;
+    struct stat cur;
+    char full[PATH_MAX], proc[32];
+    uint32_t hash = 2166136261u;
+    const char *p;
+    int fd, wd;
+
+    if (c->inotifyFd < 0 || conn->cached != NULL || joinPath(conn->cwd, path, full, sizeof(full)) < 0)
+        return openRegular(conn, path, st);
+
+    for (p = full; *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    for (e = c->buckets[hash % CACHE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->path, full) == 0)
+            break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (e != NULL && now.tv_sec - e->checked >= CACHE_RECHECK) {
+        if (fstatat(rootFd, full, &cur, AT_SYMLINK_NOFOLLOW) < 0 ||
+            cur.st_ino != e->st.st_ino || cur.st_dev != e->st.st_dev) {
+            COUNTER_ADD(conn->worker->cacheStale, 1);
+            cacheDrop(c, e);
+            e = NULL;
+        } else {
+            e->checked = now.tv_sec;
+        }
+    }
+
+    if (e != NULL) {
+        COUNTER_ADD(conn->worker->cacheHits, 1);
+        cacheKeep(c, e);
+        e->refs++;
+        conn->cached = e;
+        *st = e->st;
+        return e->fd;
+    }
+
+    COUNTER_ADD(conn->worker->cacheMisses, 1);
+    if ((fd = resolvePath(conn, path, O_RDONLY, 0)) < 0)
+        return -1;
+
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    /* full of files being read: this one is served without being kept */
+    if (c->count == CACHE_FILES) {
+        for (e = c->oldest; e != NULL && e->refs > 0; e = e->newer)
+            ;
+        if (e == NULL)
+            return fd;
+        cacheDrop(c, e);
+    }
+    if ((e = calloc(1, sizeof(*e))) == NULL || (e->path = strdup(full)) == NULL) {
+        free(e);
+        return fd;
+    }
+
+    /* what is kept is looked at again once the watch is on, so no change slips by */
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    wd = inotify_add_watch(c->inotifyFd, proc, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (wd < 0 || fstat(fd, st) < 0) {
+        if (wd >= 0)
+            cacheUnwatch(c, wd);
+        free(e->path);
+        free(e);
+        return fd;
+    }
+    e->hash = hash;
+    e->fd = fd;
+    e->st = *st;
+    e->wd = wd;
+    e->refs = 1;
+    e->checked = now.tv_sec;
+    e->next = c->buckets[hash % CACHE_BUCKETS];
+    c->buckets[hash % CACHE_BUCKETS] = e;
+    e->older = c->newest;
+    if (c->newest != NULL)
+        c->newest->newer = e;
+    c->newest = e;
+    if (c->oldest == NULL)
+        c->oldest = e;
+    c->count++;
+    conn->cached = e;
+    return fd;
+}
+
+/*         Name: closeCached
+ *  Description: gives back a file opened by openCached: closes it, or
+ *               drops the connection's reference to its cache entry
+ *   Parameters: struct connection*, int file descriptor or -1
+ *       Return: void
+ */
+void closeCached(struct connection *conn, int fd){
+    struct cacheEntry *e = conn->cached;
+
+    if (e != NULL && fd == e->fd) {
+        conn->cached = NULL;
+        if (--e->refs == 0 && e->stale)
+            cacheFree(&conn->worker->cache, e);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*         Name: cacheKeep
+ *  Description: moves a hit to the front of the cache and, when a small
+ *               file is hot and the byte budget allows, reads its bytes
+ *               in, making room by letting go of the bytes of the files
+ *               used least recently
+ *   Parameters: struct fileCache*, struct cacheEntry*
+ *       Return: void
+ */
+void cacheKeep(struct fileCache *c, struct cacheEntry *e){
+    struct cacheEntry *old;
+    size_t size = e->st.st_size;
+
+    if (c->newest != e) {
+        e->newer->older = e->older;
+        if (e->older != NULL)
+            e->older->newer = e->newer;
+        else
+            c->oldest = e->newer;
+        e->newer = NULL;
+        e->older = c->newest;
+        c->newest->newer = e;
+        c->newest = e;
+    }
+
+    if (e->data != NULL || size == 0 || size > CACHE_DATA_MAX)
+        return;
+    for (old = c->oldest; old != e && c->dataBytes + size > CACHE_DATA_BYTES; old = old->newer) {
+        if (old->data != NULL && old->refs == 0) {
+            c->dataBytes -= old->st.st_size;
+            free(old->data);
+            old->data = NULL;
+        }
+    }
+    if (c->dataBytes + size > CACHE_DATA_BYTES || (e->data = malloc(size)) == NULL)
+        return;
+    if (pread(e->fd, e->data, size, 0) != (ssize_t)size) {
+        free(e->data);
+        e->data = NULL;
+        return;
+    }
+    e->crc = crc32c(0, e->data, size);
+    c->dataBytes += size;
+}
+
+/*         Name: cacheDrop
+ *  Description: takes an entry out of the cache; it is freed at once, or
+ *               by closeCached once the last transfer reading it is done
+ *   Parameters: struct fileCache*, struct cacheEntry*
+ *       Return: void
+ */
+void cacheDrop(struct fileCache *c, struct cacheEntry *e){
+    struct cacheEntry **p;
+
+    for (p = &c->buckets[e->hash % CACHE_BUCKETS]; *p != e; p = &(*p)->next)
+        ;
+    *p = e->next;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    c->count--;
+    cacheUnwatch(c, e->wd);
+
+    e->stale = 1;
+    if (e->refs == 0)
+        cacheFree(c, e);
+}
+
+/*         Name: cacheUnwatch
+ *  Description: removes an inotify watch unless an entry still in the
+ *               cache uses it; hard links of one file share a watch
+ *   Parameters: struct fileCache*, int watch descriptor
+ *       Return: void
+ */
+void cacheUnwatch(struct fileCache *c, int wd){
+    struct cacheEntry *e;
+
+    for (e = c->newest; e != NULL && e->wd != wd; e = e->older)
+        ;
+    if (e == NULL)
+        inotify_rm_watch(c->inotifyFd, wd);
+}
+
+/*         Name: cacheFree
+ *  Description: closes and frees an entry already out of the cache
+ *   Parameters: struct fileCache*, struct cacheEntry*
+ *       Return: void
+ */
+void cacheFree(struct fileCache *c, struct cacheEntry *e){
+    if (e->data != NULL)
+        c->dataBytes -= e->st.st_size;
+    free(e->data);
+    free(e->path);
+    close(e->fd);
+    free(e);
+}
+
+/*         Name: cacheEvents
+ *  Description: drops the cache entries of every file inotify reports as
+ *               changed
+ *   Parameters: struct worker*
+ *       Return: void
+ */
+void cacheEvents(struct worker *w){
+    struct fileCache *c = &w->cache;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct cacheEntry *e, *older;
+    ssize_t n, off;
+
+    while ((n = read(c->inotifyFd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *)(buf + off);
+            if (ev->mask & IN_IGNORED)
+                continue;
+            for (e = c->newest; e != NULL; e = older) {
+                older = e->older;
+                if (e->wd == ev->wd) {
+                    COUNTER_ADD(w->cacheStale, 1);
+                    cacheDrop(c, e);
+                }
+            }
+        }
+    }
+}
+
+/*         Name: preallocate
+ *  Description: makes a file exactly size bytes long and reserves its
+ *               blocks where the file system supports it
+ *   Parameters: int file descriptor, int64_t size
+ *       Return: int, 0 on success and -1 on failure
+ */
+int preallocate(int fd, int64_t size){
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (st.st_size != size && ftruncate(fd, size) < 0)
+        return -1;
+    if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+        return -1;
+    return 0;
+}
+
+/*         Name: uringStart
+ *  Description: gives a worker an io_uring, with registered transfer
+ *               buffers and a fixed file table when the kernel allows them
+ *   Parameters: struct worker*
+ *       Return: int, 0 on success, -1 with errno set if the worker has to
+ *               stay on epoll
+ */
+int uringStart(struct worker *w){
+    struct iovec iov[URING_BUFFERS];
+    int fds[2 * URING_CONNS];
+    int i, err;
+
+    if ((w->ring = malloc(sizeof(*w->ring))) == NULL)
+        return -1;
+    if (uringInit(w->ring, URING_ENTRIES) < 0)
+        goto fail;
+    w->ioBuffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w->ioBuffers == MAP_FAILED) {
+        err = errno;
+        uringFree(w->ring);
+        errno = err;
+        goto fail;
+    }
+    for (i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = w->ioBuffers + (size_t)i * URING_BUFFER;
+        iov[i].iov_len = URING_BUFFER;
+        w->ioFree[i] = URING_BUFFERS - 1 - i;
+    }
+    w->ioFreeCount = URING_BUFFERS;
+
+    /* pinning fails under a small RLIMIT_MEMLOCK; plain reads and writes still work */
+    w->fixedBuffers = uringRegisterBuffers(w->ring, iov, URING_BUFFERS) == 0;
+
+    for (i = 0; i < 2 * URING_CONNS; i++)
+        fds[i] = -1;
+    if (uringRegisterFiles(w->ring, fds, 2 * URING_CONNS) == 0) {
+        for (i = 0; i < URING_CONNS; i++)
+            w->fileFree[i] = URING_CONNS - 1 - i;
+        w->fileFreeCount = URING_CONNS;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    free(w->ring);
+    w->ring = NULL;
+    errno = err;
+    return -1;
+}
+
+/*         Name: uringLoop
+ *  Description: the event loop of a worker on the io_uring backend. The
+ *               epoll set is watched by a poll request on the ring, so a
+ *               single io_uring_enter submits every queued disk and socket
+ *               request and sleeps until either a request completes or a
+ *               connection is ready for the ordinary state machine.
+ *   Parameters: struct worker*
+ *       Return: void, never returns
+ */
+void uringLoop(struct worker *w){
+    struct epoll_event events[MAX_EVENTS];
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    uint64_t userData;
+    int32_t res;
+    int n, polled = 1;
+
+    while (1) {
+        if (polled && (sqe = uringGetSqe(w->ring)) != NULL) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = w->epollFd;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = URING_POLL;
+            polled = 0;
+        }
+        if (uringSubmit(w->ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("Error: io_uring_enter failed\n");
+            exit(-1);
+        }
+
+        while ((cqe = uringPeek(w->ring)) != NULL) {
+            userData = cqe->user_data;
+            res = cqe->res;
+            uringSeen(w->ring);
+            if (userData == URING_POLL)
+                polled = 1;
+            else if (userData != 0)     /* 0 marks a cancel request */
+                uringComplete(userData, res);
+        }
+
+        if (polled && (n = epoll_wait(w->epollFd, events, MAX_EVENTS, 0)) > 0)
+            handleEvents(w, events, n);
+        poolWake(w);
+    }
+}
+
+/*         Name: uringAttach
+ *  Description: lends a transfer up to URING_SLOTS of the worker's buffers
+ *               and puts its socket and file in the fixed file table,
+ *               unless it is too small to be worth it
+ *   Parameters: struct connection*
+ *       Return: int number of buffers; 0 leaves the transfer on the
+ *               epoll path
+ */
+int uringAttach(struct connection *conn){
+    struct worker *w = conn->worker;
+    struct ioSlot *slot;
+    int fds[2];
+
+    /* a file that fits in one buffer, like most of a tree's, gains nothing */
+    if (conn->datalen - conn->dataoff <= URING_CHUNK)
+        return 0;
+
+    while (conn->ioSlots < URING_SLOTS && w->ioFreeCount > 0) {
+        slot = &conn->io[conn->ioSlots++];
+        slot->buf = w->ioFree[--w->ioFreeCount];
+        slot->data = w->ioBuffers + (size_t)slot->buf * URING_BUFFER;
+        slot->state = IO_FREE;
+    }
+    if (conn->ioSlots == 0)
+        return 0;
+
+    conn->ioHead = conn->ioTail = conn->ioBusy = 0;
+    conn->ioQueued = 0;
+    conn->ioError = 0;
+    conn->ioFile = -1;
+    if (w->fileFreeCount > 0) {
+        fds[0] = conn->fd;
+        fds[1] = conn->fileFd;
+        if (uringUpdateFiles(w->ring, 2 * w->fileFree[w->fileFreeCount - 1], fds, 2) == 0)
+            conn->ioFile = w->fileFree[--w->fileFreeCount];
+    }
+    return conn->ioSlots;
+}
+
+/*         Name: uringDetach
+ *  Description: hands a finished transfer's buffers and fixed files back
+ *               to the worker
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void uringDetach(struct connection *conn){
+    struct worker *w = conn->worker;
+    int fds[2] = { -1, -1 };
+
+    if (conn->ioFile >= 0) {
+        uringUpdateFiles(w->ring, 2 * conn->ioFile, fds, 2);
+        w->fileFree[w->fileFreeCount++] = conn->ioFile;
+        conn->ioFile = -1;
+    }
+    while (conn->ioSlots > 0)
+        w->ioFree[w->ioFreeCount++] = conn->io[--conn->ioSlots].buf;
+    conn->ioBusy = 0;
+    conn->ioWait = 0;
+}
+
+/*         Name: uringQueue
+ *  Description: queues the request that moves a slot's data along: the
+ *               rest of its disk read, its send or its disk write
+ *   Parameters: struct connection*, slot index
+ *       Return: int, 0 on success, -1 if the ring takes no more requests
+ */
+int uringQueue(struct connection *conn, int i){
+    struct worker *w = conn->worker;
+    struct ioSlot *slot = &conn->io[i];
+    struct io_uring_sqe *sqe;
+    unsigned char *at = slot->data + slot->done;
+    int socketFd = conn->fd, fileFd = conn->fileFd;
+
+    if ((sqe = uringGetSqe(w->ring)) == NULL)
+        return -1;
+    if (conn->ioFile >= 0) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+        socketFd = 2 * conn->ioFile;
+        fileFd = 2 * conn->ioFile + 1;
+    }
+
+    /* the low bits of the connection's address say which slot completed */
+    switch (slot->state) {
+    case IO_READING:
+        uringPrepRw(sqe, w->fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ, fileFd,
+                    at + FRAME_HEADER_SIZE, slot->len - slot->done, slot->offset + slot->done,
+                    (uintptr_t)conn | (i + 1));
+        sqe->buf_index = slot->buf;
+        break;
+    case IO_SENDING:
+        uringPrepRw(sqe, IORING_OP_SEND, socketFd, at, slot->len - slot->done, 0,
+                    (uintptr_t)conn | (i + 1));
+        break;
+    default:
+        uringPrepRw(sqe, w->fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fileFd,
+                    at, slot->len - slot->done, slot->offset + slot->done,
+                    (uintptr_t)conn | (i + 1));
+        sqe->buf_index = slot->buf;
+        break;
+    }
+    conn->ioInflight++;
+    return 0;
+}
+
+/*         Name: uringComplete
+ *  Description: accounts for a finished request of a transfer, queues the
+ *               rest of it if it came up short, and lets the connection's
+ *               state machine take the next step
+ *   Parameters: user data of the request, its result
+ *       Return: void
+ */
+void uringComplete(uint64_t userData, int32_t res){
+    struct connection *conn = (struct connection*)(uintptr_t)(userData & ~(uint64_t)15);
+    struct ioSlot *slot = &conn->io[(userData & 15) - 1];
+    int i = slot - conn->io;
+
+    conn->ioInflight--;
+    if (conn->closing) {
+        if (conn->ioInflight == 0)
+            closeConnection(conn);
+        return;
+    }
+
+    if (res < 0 || (res == 0 && slot->state == IO_READING)) {
+        /* an error, or a file that shrank under us */
+        conn->ioError = 1;
+        if (slot->state == IO_WRITING) {
+            slot->state = IO_FREE;
+            conn->ioBusy--;
+        }
+    } else if ((slot->done += res) < slot->len) {
+        if (slot->state == IO_SENDING) {
+            COUNTER_ADD(conn->worker->sendShort, 1);
+            COUNT_OUT(conn, res);
+        }
+        if (uringQueue(conn, i) < 0)
+            conn->ioError = 1;
+    } else if (slot->state == IO_READING) {
+        slot->state = IO_READY;
+    } else if (slot->state == IO_SENDING) {
+        COUNT_OUT(conn, res);
+        conn->dataoff += slot->bytes;
+        slot->state = IO_FREE;
+        conn->ioBusy--;
+        conn->ioHead = (conn->ioHead + 1) % conn->ioSlots;
+    } else {
+        slot->state = IO_FREE;
+        conn->ioBusy--;
+    }
+
+    conn->ioWait = 0;
+    handleConnection(conn);
+}
+
+/*         Name: uringCancel
+ *  Description: asks the ring to drop the requests of a closed connection
+ *   Parameters: struct connection*
+ *       Return: void
+ */
+void uringCancel(struct connection *conn){
+    struct io_uring_sqe *sqe;
+    int i;
+
+    for (i = 0; i < conn->ioSlots; i++) {
+        if (conn->io[i].state == IO_FREE || conn->io[i].state == IO_READY ||
+            conn->io[i].state == IO_FILLING || (sqe = uringGetSqe(conn->worker->ring)) == NULL)
+            continue;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)conn | (i + 1);
+        sqe->user_data = 0;
+    }
+}
+
+/*         Name: uringSendData
+ *  Description: keeps a get moving on the io_uring backend: every free
+ *               buffer reads the next piece of the file while the oldest
+ *               read one goes out as a DATA frame, so the disk and the
+ *               socket are busy at the same time
+ *   Parameters: struct connection*
+ *       Return: int, 1 when the whole file is sent, 0 while requests are
+ *               in flight, -1 on error
+ */
+int uringSendData(struct connection *conn){
+    struct ioSlot *slot;
+    size_t len;
+
+    if (conn->ioError)
+        return -1;
+    if (conn->dataoff == conn->datalen)
+        return 1;
+
+    while (conn->ioBusy < conn->ioSlots && conn->ioQueued < conn->datalen) {
+        slot = &conn->io[conn->ioTail];
+        slot->state = IO_READING;
+        slot->offset = conn->fileBase + conn->ioQueued;
+        slot->len = slot->bytes = (conn->datalen - conn->ioQueued < URING_CHUNK) ?
+                                  conn->datalen - conn->ioQueued : URING_CHUNK;
+        slot->done = 0;
+        if (uringQueue(conn, conn->ioTail) < 0)
+            return -1;
+        conn->ioQueued += slot->bytes;
+        conn->ioTail = (conn->ioTail + 1) % conn->ioSlots;
+        conn->ioBusy++;
+    }
+
+    /* frames leave strictly in file order, one send at a time */
+    slot = &conn->io[conn->ioHead];
+    if (slot->state == IO_READY) {
+        len = slot->bytes;
+        if (conn->verify) {
+            conn->crc = crc32c(conn->crc, slot->data + FRAME_HEADER_SIZE, slot->bytes);
+            putU32(slot->data + FRAME_HEADER_SIZE + len, conn->crc);
+            len += 4;
+        }
+        frameBuild(slot->data, OP_DATA, 0, conn->requestId, len);
+        slot->state = IO_SENDING;
+        slot->len = FRAME_HEADER_SIZE + len;
+        slot->done = 0;
+        if (uringQueue(conn, conn->ioHead) < 0)
+            return -1;
+    }
+    conn->ioWait = 1;
+    return 0;
+}
+
+/*         Name: uringWriteData
+ *  Description: takes received bytes of a put into the buffer being
+ *               filled, and queues the buffer's disk write once it is full
+ *   Parameters: struct connection*, bytes, length
+ *       Return: size_t bytes taken; 0 when every buffer is still at the
+ *               disk, and a completion will bring the connection back
+ */
+size_t uringWriteData(struct connection *conn, const char *data, size_t len){
+    struct ioSlot *slot;
+    size_t taken = 0, n;
+
+    /* after a failed write the rest of the upload is only drained */
+    if (conn->ioError)
+        return len;
+
+    while (taken < len) {
+        slot = &conn->io[conn->ioTail];
+
+        /* a COPY frame of a delta put moved the offset on; that starts a new buffer */
+        if (slot->state == IO_FILLING && slot->offset + (int64_t)slot->bytes != conn->fileBase + conn->dataoff + (int64_t)taken) {
+            if (uringStartWrite(conn) < 0)
+                return len;
+            continue;
+        }
+        if (slot->state == IO_WRITING)
+            break;
+        if (slot->state == IO_FREE) {
+            slot->state = IO_FILLING;
+            slot->offset = conn->fileBase + conn->dataoff + taken;
+            slot->bytes = 0;
+            conn->ioBusy++;
+        }
+        n = (len - taken < URING_CHUNK - slot->bytes) ? len - taken : URING_CHUNK - slot->bytes;
+        memcpy(slot->data + slot->bytes, data + taken, n);
+        slot->bytes += n;
+        taken += n;
+
+        if (slot->bytes == URING_CHUNK && uringStartWrite(conn) < 0)
+            return len;
+    }
+    if (taken == 0)
+        conn->ioWait = 1;
+    return taken;
+}
+
+/*         Name: uringStartWrite
+ *  Description: queues the disk write of the buffer being filled and
+ *               moves on to the next buffer
+ *   Parameters: struct connection*
+ *       Return: int, 0 on success, -1 if the write couldn't be queued
+ */
+int uringStartWrite(struct connection *conn){
+    struct ioSlot *slot = &conn->io[conn->ioTail];
+
+    slot->state = IO_WRITING;
+    slot->len = slot->bytes;
+    slot->done = 0;
+    if (uringQueue(conn, conn->ioTail) < 0) {
+        conn->ioError = 1;
+        return -1;
+    }
+    conn->ioTail = (conn->ioTail + 1) % conn->ioSlots;
+    return 0;
+}
+
+/*         Name: uringFlushWrites
+ *  Description: writes out the last, partly filled buffer of a put and
+ *               waits for all of its writes to land
+ *   Parameters: struct connection*
+ *       Return: int, 1 when everything is on disk, 0 to wait; a failed
+ *               write closes fileFd so the put is answered with an error
+ */
+int uringFlushWrites(struct connection *conn){
+    if (conn->io[conn->ioTail].state == IO_FILLING && !conn->ioError)
+        uringStartWrite(conn);
+    if (conn->ioInflight > 0) {
+        conn->ioWait = 1;
+        return 0;
+    }
+    if (conn->ioError && conn->fileFd >= 0) {
+        close(conn->fileFd);
+        conn->fileFd = -1;
+    }
+    return 1;
+}
+
+/*         Name: cleanUp
+ *  Description: prints worker counters and closes the listening sockets
+ *   Parameters: none
+ *       Return: void
+ */
+void cleanUp(){
+    int i;
+
+    printWorkerStats();
+
+    /* Closing sockets; client sockets go with the process */
+    for (i = 0; i < numWorkers; i++)
+        close(workers[i].listenSocket);
+
+    printf("clean up finished, terminating process\n");
+    exit(0);
+}
+
+/*         Name: handleSigInt
+ *  Description: handles the SIGINT signal and calls the cleanUp function
+ *   Parameters: int
+ *       Return: void
+ */
+void handleSigInt(int i){
+    printf("handling SIGINT, calling cleanUp function\n");
+    cleanUp();
+    exit(0);
+}
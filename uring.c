@@ -0,0 +1,233 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* opcodes the server's transfers use; a kernel without one of them gets epoll */
+static const int requiredOps[] = {
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    IORING_OP_SEND, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL
+};
+
+/*         Name: uringProbe
+ *  Description: asks the kernel which opcodes the ring supports
+ *   Parameters: struct uring*
+ *       Return: int, 0 if every required opcode is there, -1 if not
+ */
+static int uringProbe(struct uring *ring){
+    struct {
+        struct io_uring_probe   probe;
+        struct io_uring_probe_op ops[256];
+    } p;
+    size_t i;
+
+    memset(&p, 0, sizeof(p));
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, &p, 256) < 0)
+        return -1;
+    for (i = 0; i < sizeof(requiredOps) / sizeof(requiredOps[0]); i++) {
+        if (requiredOps[i] > p.probe.last_op || !(p.ops[requiredOps[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*         Name: uringInit
+ *  Description: sets up a ring and maps its queues
+ *   Parameters: struct uring*, number of submission entries
+ *       Return: int, 0 on success, -1 with errno set when the kernel has
+ *               no usable io_uring
+ */
+int uringInit(struct uring *ring, unsigned entries){
+    struct io_uring_params params;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_NODROP) || uringProbe(ring) < 0)
+        goto fail;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    ring->sqHead = (unsigned*)((char*)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+    return 0;
+
+fail:
+    err = errno;
+    uringFree(ring);
+    errno = err;
+    return -1;
+}
+
+/*         Name: uringFree
+ *  Description: unmaps the queues and closes the ring
+ *   Parameters: struct uring*
+ *       Return: void
+ */
+void uringFree(struct uring *ring){
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*         Name: uringGetSqe
+ *  Description: hands out the next free submission entry, cleared; when
+ *               the queue is full what is queued is submitted first
+ *   Parameters: struct uring*
+ *       Return: struct io_uring_sqe*, or NULL if the kernel took none
+ */
+struct io_uring_sqe *uringGetSqe(struct uring *ring){
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries &&
+        (uringSubmit(ring, 0) < 0 ||
+         ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries))
+        return NULL;
+
+    index = ring->sqLocalTail & *ring->sqMask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    ring->pending++;
+    return sqe;
+}
+
+/*         Name: uringSubmit
+ *  Description: publishes the queued entries and enters the kernel once to
+ *               submit them all, waiting for completions if asked to
+ *   Parameters: struct uring*, completions to wait for
+ *       Return: int entries submitted, or -1 with errno set
+ */
+int uringSubmit(struct uring *ring, unsigned waitFor){
+    int n;
+
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    if (ring->pending == 0 && waitFor == 0)
+        return 0;
+    n = syscall(SYS_io_uring_enter, ring->fd, ring->pending, waitFor,
+                waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0)
+        return -1;
+    ring->pending -= (unsigned)n < ring->pending ? (unsigned)n : ring->pending;
+    return n;
+}
+
+/*         Name: uringPeek
+ *  Description: looks at the oldest completion without waiting
+ *   Parameters: struct uring*
+ *       Return: struct io_uring_cqe*, or NULL if none is ready
+ */
+struct io_uring_cqe *uringPeek(struct uring *ring){
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+/*         Name: uringSeen
+ *  Description: gives the completion returned by uringPeek back to the kernel
+ *   Parameters: struct uring*
+ *       Return: void
+ */
+void uringSeen(struct uring *ring){
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*         Name: uringRegisterBuffers
+ *  Description: pins buffers so READ_FIXED and WRITE_FIXED skip mapping
+ *               them on every request
+ *   Parameters: struct uring*, iovec per buffer, number of buffers
+ *       Return: int, 0 on success, -1 with errno set
+ */
+int uringRegisterBuffers(struct uring *ring, const struct iovec *iov, unsigned n){
+    return syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) < 0 ? -1 : 0;
+}
+
+/*         Name: uringRegisterFiles
+ *  Description: installs the ring's fixed file table; -1 leaves a slot empty
+ *   Parameters: struct uring*, file descriptors, table size
+ *       Return: int, 0 on success, -1 with errno set
+ */
+int uringRegisterFiles(struct uring *ring, const int *fds, unsigned n){
+    return syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, n) < 0 ? -1 : 0;
+}
+
+/*         Name: uringUpdateFiles
+ *  Description: replaces a run of fixed file slots; -1 empties a slot
+ *   Parameters: struct uring*, first slot, file descriptors, slot count
+ *       Return: int, 0 on success, -1 with errno set
+ */
+int uringUpdateFiles(struct uring *ring, unsigned first, const int *fds, unsigned n){
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = first;
+    update.fds = (uint64_t)(uintptr_t)fds;
+    return syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, n) < 0 ? -1 : 0;
+}
+
+/*         Name: uringPrepRw
+ *  Description: fills in an entry for a read, write or send style request
+ *   Parameters: struct io_uring_sqe*, opcode, file descriptor or fixed
+ *               slot, buffer, length, file offset, user data
+ *       Return: void
+ */
+void uringPrepRw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len,
+                 uint64_t offset, uint64_t userData){
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+}
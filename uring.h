@@ -0,0 +1,50 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * A bare io_uring: the two mmap'ed rings and the calls around them, made
+ * with the raw system calls so the build needs no liburing. Requests are
+ * queued with uringGetSqe and the uringPrep* helpers and reach the kernel
+ * together on the next uringSubmit, which can also wait for completions.
+ */
+struct uring
+{
+    int         fd;
+    unsigned   *sqHead;
+    unsigned   *sqTail;
+    unsigned   *sqMask;
+    unsigned   *sqArray;
+    unsigned    sqEntries;
+    unsigned    sqLocalTail;    /* tail including entries not yet published */
+    struct io_uring_sqe *sqes;
+    unsigned   *cqHead;
+    unsigned   *cqTail;
+    unsigned   *cqMask;
+    struct io_uring_cqe *cqes;
+    void       *sqRing;
+    void       *cqRing;
+    size_t      sqRingSize;
+    size_t      cqRingSize;
+    size_t      sqesSize;
+    unsigned    pending;        /* entries queued since the last submit */
+};
+
+int uringInit(struct uring*, unsigned);
+void uringFree(struct uring*);
+struct io_uring_sqe *uringGetSqe(struct uring*);
+int uringSubmit(struct uring*, unsigned);
+struct io_uring_cqe *uringPeek(struct uring*);
+void uringSeen(struct uring*);
+
+int uringRegisterBuffers(struct uring*, const struct iovec*, unsigned);
+int uringRegisterFiles(struct uring*, const int*, unsigned);
+int uringUpdateFiles(struct uring*, unsigned, const int*, unsigned);
+
+void uringPrepRw(struct io_uring_sqe*, int, int, const void*, unsigned, uint64_t, uint64_t);
+
+#endif